@@ -1,25 +1,103 @@
 #include <vector>
+#include <string>
 #include <mutex>
 #include <shared_mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
 #include <random>
+#include <functional>
+#include <queue>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <future>
+#include <deque>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <limits>
+#include <array>
+#include <bit>
+#include <type_traits>
+#include <csignal>
+#include <cerrno>
+#include <climits>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
 
-struct Node {
-    std::vector<uint8_t> key;
-    std::vector<uint8_t> value;
-    Node *left;
-    Node *right;
-    Node *parent;
+// Values are immutable and reference counted, so readers can hold on to one (e.g. while it
+// is being sent) after releasing the tree lock, even if the key is overwritten or erased.
+using ValueRef = std::shared_ptr<const std::vector<uint8_t> >;
+
+// First 8 key bytes as a big-endian integer, zero padded. When two prefixes differ they order
+// the same way as the full keys, so most comparisons never touch the key's heap buffer.
+static uint64_t key_prefix_of(const std::vector<uint8_t> &key) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        prefix = (prefix << 8) | (i < key.size() ? key[i] : 0);
+    }
+    return prefix;
+}
+
+// Merkle augmentation of a node, allocated only once its tree enables digests: the hash of
+// the entry, and the sum of entry hashes and the entry count of the subtree.
+struct NodeDigest {
+    uint64_t digest = 0;
+    uint64_t subtree_digest = 0;
+    size_t subtree_count = 1;
+};
+
+// Node of a BasicRedBlackTree<K>. Fixed-size keys are stored inline and compare cheaply, so
+// this keeps no prefix; byte-string keys use the specialization below.
+template<class K>
+struct BasicNode {
+    K key;
+    BasicNode *left;
+    BasicNode *right;
+    BasicNode *parent;
+    ValueRef value;
+    // Set on every node of a tree with digests enabled.
+    std::unique_ptr<NodeDigest> merkle;
     bool is_red;
 
-    Node(const std::vector<uint8_t> &k, const std::vector<uint8_t> &v)
-        : key(k), value(v), left(nullptr), right(nullptr), parent(nullptr), is_red(true) {
+    BasicNode(K k, ValueRef v)
+        : key(std::move(k)), left(nullptr), right(nullptr), parent(nullptr), value(std::move(v)), is_red(true) {
     }
+};
+
+// Hot fields first: a lookup only reads key_prefix, the children and, on a prefix tie, key,
+// which fill the first 56 bytes. parent, value and merkle are only touched by writes, scans
+// and hits, and come after. Trees without digests pay one null pointer for them.
+template<>
+struct BasicNode<std::vector<uint8_t> > {
+    uint64_t key_prefix;
+    BasicNode *left;
+    BasicNode *right;
+    std::vector<uint8_t> key;
+    bool is_red;
+    BasicNode *parent;
+    ValueRef value;
+    // Set on every node of a tree with digests enabled.
+    std::unique_ptr<NodeDigest> merkle;
 
-    ~Node() = default;
+    BasicNode(std::vector<uint8_t> k, ValueRef v)
+        : key_prefix(key_prefix_of(k)), left(nullptr), right(nullptr), key(std::move(k)), is_red(true),
+          parent(nullptr), value(std::move(v)) {
+    }
 };
 
+using Node = BasicNode<std::vector<uint8_t> >;
+
 int compare_keys(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
     int min_len = (a.size() < b.size()) ? a.size() : b.size();
     for (int i = 0; i < min_len; i++) {
@@ -39,13 +117,693 @@ int compare_keys(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
     return 0;
 }
 
-class RedBlackTree {
+// compare_keys(key, node->key), deciding on the prefix alone when it can.
+static int compare_to_node(uint64_t prefix, const std::vector<uint8_t> &key, const Node *node) {
+    if (prefix != node->key_prefix) {
+        return prefix < node->key_prefix ? -1 : 1;
+    }
+    return compare_keys(key, node->key);
+}
+
+// Other key types keep no prefix in the node and compare directly.
+template<class K>
+static uint64_t key_prefix_of(const K &) {
+    return 0;
+}
+
+template<class K>
+static int compare_to_node(uint64_t, const K &key, const BasicNode<K> *node) {
+    return compare_keys(key, node->key);
+}
+
+// Chase-Lev work-stealing deque (Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owning worker pushes and pops at the bottom;
+// other threads steal from the top. The buffer grows when full; retired buffers are kept until
+// the deque is destroyed because a thief may still be reading one.
+template<typename T>
+class WorkStealingDeque {
+private:
+    struct Buffer {
+        size_t capacity;
+        std::unique_ptr<std::atomic<T *>[]> slots;
+
+        explicit Buffer(size_t c) : capacity(c), slots(new std::atomic<T *>[c]) {
+        }
+
+        T *get(int64_t i) const {
+            return slots[static_cast<size_t>(i) & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T *item) {
+            slots[static_cast<size_t>(i) & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<Buffer *> buffer;
+    std::vector<std::unique_ptr<Buffer> > buffers;
+
+public:
+    explicit WorkStealingDeque(size_t capacity = 256) {
+        buffers.emplace_back(new Buffer(capacity));
+        buffer.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    // Owner only.
+    void push(T *item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer *current = buffer.load(std::memory_order_relaxed);
+        if (b - t > static_cast<int64_t>(current->capacity) - 1) {
+            Buffer *grown = new Buffer(current->capacity * 2);
+            for (int64_t i = t; i < b; i++) {
+                grown->put(i, current->get(i));
+            }
+            buffers.emplace_back(grown);
+            buffer.store(grown, std::memory_order_release);
+            current = grown;
+        }
+        current->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only; newest first. Null when empty.
+    T *pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer *current = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T *item = current->get(b);
+        if (t == b) {
+            // Last item: race the thieves for it.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread; oldest first. Null when empty or when another thief won.
+    T *steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        T *item = buffer.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+};
+
+// Fork/join scheduler shared by the parallel tree operations, so they neither create threads
+// per call nor oversubscribe the machine when they nest. One worker per core, each with a
+// WorkStealingDeque: a fork pushes its second half on the caller's deque and runs the first
+// half; idle workers steal the oldest (largest) pending halves. A thread outside the pool hands
+// its whole fork/join to a worker through a shared queue and blocks until it finishes, so every
+// fork below it lands on a worker deque.
+class WorkStealingPool {
+private:
+    struct Task {
+        std::atomic<bool> done{false};
+
+        virtual void run() = 0;
+        virtual ~Task() = default;
+    };
+
+    template<typename Fn>
+    struct FnTask : Task {
+        Fn &fn;
+
+        explicit FnTask(Fn &f) : fn(f) {
+        }
+
+        void run() override {
+            fn();
+            this->done.store(true, std::memory_order_release);
+        }
+    };
+
+    // A fork/join submitted from outside the pool. Signals under the pool mutex, so the waiting
+    // thread cannot return and destroy the task while the worker still touches it.
+    template<typename Fn>
+    struct RootTask : Task {
+        Fn &fn;
+        WorkStealingPool &pool;
+
+        RootTask(Fn &f, WorkStealingPool &p) : fn(f), pool(p) {
+        }
+
+        void run() override {
+            fn();
+            std::lock_guard lock(pool.mutex);
+            this->done.store(true, std::memory_order_release);
+            pool.finished.notify_all();
+        }
+    };
+
+    struct Worker {
+        WorkStealingDeque<Task> deque;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable finished;
+    std::deque<Task *> injected;
+    std::atomic<size_t> injected_count{0};
+    std::atomic<int> sleeping{0};
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> tasks_run{0};
+
+    static thread_local WorkStealingPool *current_pool;
+    static thread_local Worker *current_worker;
+
+    Task *take_injected() {
+        if (injected_count.load(std::memory_order_acquire) == 0) {
+            return nullptr;
+        }
+        std::lock_guard lock(mutex);
+        if (injected.empty()) {
+            return nullptr;
+        }
+        Task *task = injected.front();
+        injected.pop_front();
+        injected_count--;
+        return task;
+    }
+
+    // Own deque first, then the injection queue, then the other workers' deques.
+    Task *find_task(Worker *self, size_t &victim) {
+        if (self != nullptr) {
+            if (Task *task = self->deque.pop()) {
+                return task;
+            }
+        }
+        if (Task *task = take_injected()) {
+            return task;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker *other = workers[(victim + i) % workers.size()].get();
+            if (other == self) {
+                continue;
+            }
+            if (Task *task = other->deque.steal()) {
+                victim = (victim + i) % workers.size();
+                steals++;
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void run_task(Task *task) {
+        task->run();
+        tasks_run++;
+    }
+
+    void wake() {
+        if (sleeping.load(std::memory_order_acquire) > 0) {
+            std::lock_guard lock(mutex);
+            cv.notify_all();
+        }
+    }
+
+    void worker_loop(Worker *self, size_t index) {
+        current_pool = this;
+        current_worker = self;
+        size_t victim = index + 1;
+        int idle = 0;
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (Task *task = find_task(self, victim)) {
+                run_task(task);
+                idle = 0;
+                continue;
+            }
+            if (++idle < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+            // Timed so a push that races with going to sleep costs at most a millisecond.
+            std::unique_lock lock(mutex);
+            sleeping++;
+            cv.wait_for(lock, std::chrono::milliseconds(1), [this] {
+                return stopping.load() || injected_count.load() > 0;
+            });
+            sleeping--;
+            idle = 0;
+        }
+    }
+
+    // Runs other tasks until `task` finishes. Workers only.
+    void help_until(Worker *self, Task &task) {
+        size_t victim = 0;
+        while (!task.done.load(std::memory_order_acquire)) {
+            if (Task *other = find_task(self, victim)) {
+                run_task(other);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+public:
+    explicit WorkStealingPool(unsigned threads) {
+        threads = std::max(1u, threads);
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back(new Worker());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            Worker *worker = workers[i].get();
+            worker->thread = std::thread([this, worker, i] { worker_loop(worker, i); });
+        }
+    }
+
+    WorkStealingPool() : WorkStealingPool(std::thread::hardware_concurrency()) {
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool() {
+        stopping = true;
+        {
+            std::lock_guard lock(mutex);
+            cv.notify_all();
+        }
+        for (auto &worker: workers) {
+            worker->thread.join();
+        }
+    }
+
+    // Process-wide pool with one worker per core.
+    static WorkStealingPool &shared() {
+        static WorkStealingPool pool;
+        return pool;
+    }
+
+    // Runs `first` and `second`, possibly in parallel, and returns when both are done.
+    template<typename First, typename Second>
+    void fork_join(First &&first, Second &&second) {
+        Worker *self = current_pool == this ? current_worker : nullptr;
+        if (self == nullptr) {
+            auto root = [&] { fork_join(first, second); };
+            RootTask<decltype(root)> task(root, *this);
+            std::unique_lock lock(mutex);
+            injected.push_back(&task);
+            injected_count++;
+            cv.notify_all();
+            finished.wait(lock, [&] { return task.done.load(std::memory_order_acquire); });
+            return;
+        }
+        FnTask<Second> task(second);
+        self->deque.push(&task);
+        wake();
+        first();
+        // Usually nobody stole it and it is still on top of our deque.
+        if (Task *top = self->deque.pop()) {
+            run_task(top);
+            if (top == &task) {
+                return;
+            }
+        }
+        help_until(self, task);
+    }
+
+    // Calls fn(i) for every i in [begin, end), splitting ranges larger than `grain`.
+    template<typename Fn>
+    void parallel_for(size_t begin, size_t end, size_t grain, Fn &&fn) {
+        if (end - begin <= std::max<size_t>(grain, 1)) {
+            for (size_t i = begin; i < end; i++) {
+                fn(i);
+            }
+            return;
+        }
+        size_t mid = begin + (end - begin) / 2;
+        fork_join([&] { parallel_for(begin, mid, grain, fn); }, [&] { parallel_for(mid, end, grain, fn); });
+    }
+
+    unsigned size() const {
+        return workers.size();
+    }
+
+    uint64_t get_steals() const {
+        return steals.load();
+    }
+
+    uint64_t get_tasks_run() const {
+        return tasks_run.load();
+    }
+};
+
+thread_local WorkStealingPool *WorkStealingPool::current_pool = nullptr;
+thread_local WorkStealingPool::Worker *WorkStealingPool::current_worker = nullptr;
+
+using KeyValue = std::pair<std::vector<uint8_t>, std::vector<uint8_t> >;
+
+// MSD radix sort for byte-string keys. Each pass buckets items by the byte at `depth`, with keys
+// that end there in bucket 0 so shorter keys sort first, then sorts every bucket one byte
+// deeper. Passes are stable, so items with equal keys keep their input order.
+static size_t radix_bucket(const KeyValue *item, size_t depth) {
+    return depth < item->first.size() ? item->first[depth] + 1 : 0;
+}
+
+// Advances `depth` past the bytes every item shares, so a long common prefix or a run of
+// duplicates costs one compare per byte instead of a counting pass per byte.
+static size_t radix_skip_common(KeyValue *const *items, size_t n, size_t depth) {
+    const std::vector<uint8_t> &first = items[0]->first;
+    size_t end = first.size();
+    for (size_t i = 1; i < n && end > depth; i++) {
+        const std::vector<uint8_t> &key = items[i]->first;
+        size_t limit = std::min(end, key.size());
+        size_t at = depth;
+        while (at < limit && key[at] == first[at]) {
+            at++;
+        }
+        end = at;
+    }
+    return end;
+}
+
+// Iterative, with pending buckets on an explicit stack, so key length never bounds the depth
+// of the C++ stack.
+static void radix_sort_sequential(KeyValue **items, KeyValue **scratch, size_t n, size_t depth) {
+    struct Range {
+        size_t begin;
+        size_t size;
+        size_t depth;
+    };
+    std::vector<Range> pending = {{0, n, depth}};
+    size_t offsets[259];
+    while (!pending.empty()) {
+        Range range = pending.back();
+        pending.pop_back();
+        KeyValue **base = items + range.begin;
+        // Small buckets are cheaper to finish with a comparison sort.
+        if (range.size < 64) {
+            std::stable_sort(base, base + range.size, [](const KeyValue *a, const KeyValue *b) {
+                return compare_keys(a->first, b->first) < 0;
+            });
+            continue;
+        }
+        size_t at = radix_skip_common(base, range.size, range.depth);
+        memset(offsets, 0, sizeof(offsets));
+        for (size_t i = 0; i < range.size; i++) {
+            offsets[radix_bucket(base[i], at) + 2]++;
+        }
+        for (size_t b = 2; b < 259; b++) {
+            offsets[b] += offsets[b - 1];
+        }
+        for (size_t i = 0; i < range.size; i++) {
+            scratch[offsets[radix_bucket(base[i], at) + 1]++] = base[i];
+        }
+        memcpy(base, scratch, range.size * sizeof(KeyValue *));
+        // offsets[b] is now the start of bucket b; bucket 0 holds equal keys and is done.
+        for (size_t b = 1; b < 257; b++) {
+            size_t size = offsets[b + 1] - offsets[b];
+            if (size > 1) {
+                pending.push_back(Range{range.begin + offsets[b], size, at + 1});
+            }
+        }
+    }
+}
+
+static void radix_sort_parallel(KeyValue **items, KeyValue **scratch, size_t n, size_t depth, unsigned threads) {
+    if (threads <= 1 || n < 65536) {
+        radix_sort_sequential(items, scratch, n, depth);
+        return;
+    }
+    depth = radix_skip_common(items, n, depth);
+    // Each chunk is counted on its own, then scattered behind the chunks before it, which
+    // keeps the pass stable.
+    WorkStealingPool &pool = WorkStealingPool::shared();
+    std::vector<std::array<size_t, 257> > counts(threads);
+    auto chunk_begin = [n, threads](size_t t) { return n * t / threads; };
+    pool.parallel_for(0, threads, 1, [&](size_t t) {
+        counts[t].fill(0);
+        for (size_t i = chunk_begin(t); i < chunk_begin(t + 1); i++) {
+            counts[t][radix_bucket(items[i], depth)]++;
+        }
+    });
+    std::array<size_t, 258> bucket_start{};
+    size_t total = 0;
+    for (size_t b = 0; b < 257; b++) {
+        bucket_start[b] = total;
+        for (unsigned t = 0; t < threads; t++) {
+            size_t count = counts[t][b];
+            counts[t][b] = total;
+            total += count;
+        }
+    }
+    bucket_start[257] = n;
+    pool.parallel_for(0, threads, 1, [&](size_t t) {
+        for (size_t i = chunk_begin(t); i < chunk_begin(t + 1); i++) {
+            scratch[counts[t][radix_bucket(items[i], depth)]++] = items[i];
+        }
+    });
+    memcpy(items, scratch, n * sizeof(KeyValue *));
+
+    // Buckets too big for one thread get another parallel pass; the rest are shared out
+    // largest first.
+    std::vector<size_t> small;
+    for (size_t b = 1; b < 257; b++) {
+        size_t size = bucket_start[b + 1] - bucket_start[b];
+        if (size > n / threads) {
+            radix_sort_parallel(items + bucket_start[b], scratch + bucket_start[b], size, depth + 1, threads);
+        } else if (size > 1) {
+            small.push_back(b);
+        }
+    }
+    std::sort(small.begin(), small.end(), [&bucket_start](size_t a, size_t b) {
+        return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+    });
+    std::atomic<size_t> next{0};
+    pool.parallel_for(0, threads, 1, [&](size_t) {
+        for (size_t i = next++; i < small.size(); i = next++) {
+            size_t b = small[i];
+            radix_sort_sequential(items + bucket_start[b], scratch + bucket_start[b],
+                                  bucket_start[b + 1] - bucket_start[b], depth + 1);
+        }
+    });
+}
+
+// Stable sort of entry pointers by key, on up to `threads` threads.
+void radix_sort_by_key(std::vector<KeyValue *> &items, unsigned threads = std::thread::hardware_concurrency()) {
+    std::vector<KeyValue *> scratch(items.size());
+    radix_sort_parallel(items.data(), scratch.data(), items.size(), 0, std::max(1u, threads));
+}
+
+static uint64_t hash_bytes(const uint8_t *data, size_t len, uint64_t seed = 0) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    // FNV-1a alone clusters badly on short keys; finish with a 64-bit mixer.
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static const uint32_t SNAPSHOT_MAGIC = 0x42445459; // "YTDB"
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+// Digest of the entries in a key range: the sum of their hashes and their count. A sum does
+// not depend on tree shape, so replicas holding the same entries agree whatever order they
+// were written in.
+struct RangeDigest {
+    uint64_t hash = 0;
+    size_t count = 0;
+
+    bool operator==(const RangeDigest &other) const {
+        return hash == other.hash && count == other.count;
+    }
+};
+
+static uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Where one traced operation spent its time, filled in by the tree and its wrappers.
+struct OpTrace {
+    uint64_t lock_wait_ns = 0;
+    uint64_t alloc_ns = 0;
+    uint32_t depth = 0;
+    uint32_t rotations = 0;
+};
+
+// Red-black tree over keys of type K: std::vector<uint8_t> byte strings (RedBlackTree) or
+// fixed-size keys such as FixedKey<N>. K needs compare_keys(a, b), and data() and size() for
+// digests. Members that build keys from bytes (put_batch, snapshots) exist only for byte
+// strings; templates only instantiate what is used.
+template<class K>
+class BasicRedBlackTree {
+public:
+    using Key = K;
+    using Node = BasicNode<K>;
+    static constexpr size_t node_bytes = sizeof(Node);
+
 private:
     Node *root;
+    size_t count;
+    bool digests = false;
+    uint64_t rotations = 0;
+
+    static uint64_t entry_digest(const K &key, const std::vector<uint8_t> &value) {
+        return hash_bytes(value.data(), value.size(), hash_bytes(key.data(), key.size()));
+    }
+
+    static void pull(Node *node) {
+        NodeDigest &merkle = *node->merkle;
+        merkle.subtree_digest = merkle.digest;
+        merkle.subtree_count = 1;
+        for (const Node *child: {node->left, node->right}) {
+            if (child != nullptr) {
+                merkle.subtree_digest += child->merkle->subtree_digest;
+                merkle.subtree_count += child->merkle->subtree_count;
+            }
+        }
+    }
+
+    void pull_to_root(Node *node) {
+        if (digests) {
+            for (; node != nullptr; node = node->parent) {
+                pull(node);
+            }
+        }
+    }
+
+    static void pull_all(Node *node) {
+        if (node != nullptr) {
+            if (node->merkle == nullptr) {
+                node->merkle = std::make_unique<NodeDigest>();
+            }
+            node->merkle->digest = entry_digest(node->key, *node->value);
+            pull_all(node->left);
+            pull_all(node->right);
+            pull(node);
+        }
+    }
+
+    // Digest of all entries with key < `key` (all entries for null).
+    RangeDigest digest_below(const K *key) const {
+        RangeDigest result;
+        for (const Node *node = root; node != nullptr;) {
+            if (key != nullptr && compare_keys(node->key, *key) >= 0) {
+                node = node->left;
+                continue;
+            }
+            result.hash += node->merkle->digest;
+            result.count++;
+            if (node->left != nullptr) {
+                result.hash += node->left->merkle->subtree_digest;
+                result.count += node->left->merkle->subtree_count;
+            }
+            node = node->right;
+        }
+        return result;
+    }
+
+    const Node *node_at(size_t rank) const {
+        const Node *node = root;
+        while (node != nullptr) {
+            size_t left = node->left != nullptr ? node->left->merkle->subtree_count : 0;
+            if (rank == left) {
+                return node;
+            }
+            if (rank < left) {
+                node = node->left;
+            } else {
+                rank -= left + 1;
+                node = node->right;
+            }
+        }
+        return nullptr;
+    }
+
+    template<typename Fn>
+    void diff_range(const BasicRedBlackTree &other, const K *lo, const K *hi, size_t &compared, Fn &fn) const {
+        RangeDigest mine = range_digest(lo, hi);
+        RangeDigest theirs = other.range_digest(lo, hi);
+        compared++;
+        if (mine == theirs) {
+            return;
+        }
+        if (mine.count + theirs.count > 32) {
+            // Split at the median key of the larger side and compare each half.
+            const BasicRedBlackTree &side = mine.count >= theirs.count ? *this : other;
+            size_t first = lo != nullptr ? side.digest_below(lo).count : 0;
+            K middle = side.node_at(first + std::max(mine.count, theirs.count) / 2)->key;
+            diff_range(other, lo, &middle, compared, fn);
+            diff_range(other, &middle, hi, compared, fn);
+            return;
+        }
+        diff_entries(other, lo, hi, fn);
+    }
+
+    // Calls fn for every entry in [lo, hi) that differs from `other`, walking both in order.
+    template<typename Fn>
+    void diff_entries(const BasicRedBlackTree &other, const K *lo, const K *hi, Fn &fn) const {
+        auto first = [lo, hi](const Node *root) {
+            const Node *node = lo != nullptr ? lower_bound_node(root, *lo) : leftmost(root);
+            return node != nullptr && (hi == nullptr || compare_keys(node->key, *hi) < 0) ? node : nullptr;
+        };
+        auto next = [hi](const Node *node) {
+            node = successor(node);
+            return node != nullptr && (hi == nullptr || compare_keys(node->key, *hi) < 0) ? node : nullptr;
+        };
+        const std::vector<uint8_t> *missing = nullptr;
+        const Node *a = first(root);
+        const Node *b = first(other.root);
+        while (a != nullptr || b != nullptr) {
+            int cmp = a == nullptr ? 1 : (b == nullptr ? -1 : compare_keys(a->key, b->key));
+            if (cmp < 0) {
+                fn(a->key, a->value.get(), missing);
+                a = next(a);
+            } else if (cmp > 0) {
+                fn(b->key, missing, b->value.get());
+                b = next(b);
+            } else {
+                if (*a->value != *b->value) {
+                    fn(a->key, a->value.get(), b->value.get());
+                }
+                a = next(a);
+                b = next(b);
+            }
+        }
+    }
 
-    static Node *find_node(Node *node, const std::vector<uint8_t> &key) {
+    static Node *find_node(Node *node, const K &key, uint32_t *depth = nullptr) {
+        uint64_t prefix = key_prefix_of(key);
         while (node != nullptr) {
-            int cmp = compare_keys(key, node->key);
+            if (depth != nullptr) {
+                ++*depth;
+            }
+            int cmp = compare_to_node(prefix, key, node);
             if (cmp == 0) {
                 return node;
             }
@@ -59,6 +817,7 @@ private:
     }
 
     void rotate_left(Node *node) {
+        rotations++;
         Node *right_child = node->right;
         node->right = right_child->left;
         if (right_child->left != nullptr) {
@@ -74,9 +833,14 @@ private:
         }
         right_child->left = node;
         node->parent = right_child;
+        if (digests) {
+            pull(node);
+            pull(right_child);
+        }
     }
 
     void rotate_right(Node *node) {
+        rotations++;
         Node *left_child = node->left;
         node->left = left_child->right;
         if (left_child->right != nullptr) {
@@ -92,6 +856,10 @@ private:
         }
         left_child->right = node;
         node->parent = left_child;
+        if (digests) {
+            pull(node);
+            pull(left_child);
+        }
     }
 
     void fix_insert(Node *node) {
@@ -133,38 +901,567 @@ private:
         root->is_red = false;
     }
 
-    static void delete_tree(const Node *node) {
-        if (node == nullptr)
-            return;
-        delete_tree(node->left);
-        delete_tree(node->right);
-        delete node;
+    static bool is_red(const Node *node) {
+        return node != nullptr && node->is_red;
     }
 
-public:
-    RedBlackTree() : root(nullptr) {
+    void transplant(Node *node, Node *replacement) {
+        if (node->parent == nullptr) {
+            root = replacement;
+        } else if (node == node->parent->left) {
+            node->parent->left = replacement;
+        } else {
+            node->parent->right = replacement;
+        }
+        if (replacement != nullptr) {
+            replacement->parent = node->parent;
+        }
     }
 
-    ~RedBlackTree() {
-        delete_tree(root);
+    // `node` may be null (a removed black leaf), so its parent is tracked separately.
+    void fix_erase(Node *node, Node *parent) {
+        while (node != root && !is_red(node)) {
+            if (node == parent->left) {
+                Node *sibling = parent->right;
+                if (is_red(sibling)) {
+                    sibling->is_red = false;
+                    parent->is_red = true;
+                    rotate_left(parent);
+                    sibling = parent->right;
+                }
+                if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                    sibling->is_red = true;
+                    node = parent;
+                    parent = node->parent;
+                } else {
+                    if (!is_red(sibling->right)) {
+                        sibling->left->is_red = false;
+                        sibling->is_red = true;
+                        rotate_right(sibling);
+                        sibling = parent->right;
+                    }
+                    sibling->is_red = parent->is_red;
+                    parent->is_red = false;
+                    sibling->right->is_red = false;
+                    rotate_left(parent);
+                    node = root;
+                    parent = nullptr;
+                }
+            } else {
+                Node *sibling = parent->left;
+                if (is_red(sibling)) {
+                    sibling->is_red = false;
+                    parent->is_red = true;
+                    rotate_right(parent);
+                    sibling = parent->left;
+                }
+                if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                    sibling->is_red = true;
+                    node = parent;
+                    parent = node->parent;
+                } else {
+                    if (!is_red(sibling->left)) {
+                        sibling->right->is_red = false;
+                        sibling->is_red = true;
+                        rotate_left(sibling);
+                        sibling = parent->left;
+                    }
+                    sibling->is_red = parent->is_red;
+                    parent->is_red = false;
+                    sibling->left->is_red = false;
+                    rotate_right(parent);
+                    node = root;
+                    parent = nullptr;
+                }
+            }
+        }
+        if (node != nullptr) {
+            node->is_red = false;
+        }
     }
 
-    void put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
-        if (root == nullptr) {
-            root = new Node(key, value);
-            root->is_red = false;
-            return;
+    // Returns the black height of the subtree, or -1 if it violates an invariant.
+    static int check_subtree(const Node *node, const K *lower, const K *upper) {
+        if (node == nullptr) {
+            return 0;
         }
-
-        Node *parent = nullptr;
-        Node *current = root;
-        int cmp = 0;
+        if ((lower != nullptr && compare_keys(node->key, *lower) <= 0) ||
+            (upper != nullptr && compare_keys(node->key, *upper) >= 0)) {
+            return -1;
+        }
+        if (node->is_red && (is_red(node->left) || is_red(node->right))) {
+            return -1;
+        }
+        if ((node->left != nullptr && node->left->parent != node) ||
+            (node->right != nullptr && node->right->parent != node)) {
+            return -1;
+        }
+        int left_height = check_subtree(node->left, lower, &node->key);
+        int right_height = check_subtree(node->right, &node->key, upper);
+        if (left_height < 0 || left_height != right_height) {
+            return -1;
+        }
+        return left_height + (node->is_red ? 0 : 1);
+    }
+
+    static bool check_digest_subtree(const Node *node) {
+        if (node == nullptr) {
+            return true;
+        }
+        if (node->merkle == nullptr) {
+            return false;
+        }
+        uint64_t digest = entry_digest(node->key, *node->value);
+        size_t subtree_count = 1;
+        for (const Node *child: {node->left, node->right}) {
+            if (child != nullptr && child->merkle != nullptr) {
+                digest += child->merkle->subtree_digest;
+                subtree_count += child->merkle->subtree_count;
+            }
+        }
+        const NodeDigest &merkle = *node->merkle;
+        return merkle.digest == entry_digest(node->key, *node->value) && merkle.subtree_digest == digest &&
+               merkle.subtree_count == subtree_count && check_digest_subtree(node->left) &&
+               check_digest_subtree(node->right);
+    }
+
+    static const Node *lower_bound_node(const Node *node, const K &key) {
+        const Node *result = nullptr;
+        uint64_t prefix = key_prefix_of(key);
+        while (node != nullptr) {
+            if (compare_to_node(prefix, key, node) <= 0) {
+                result = node;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        return result;
+    }
+
+    static void delete_tree(const Node *node) {
+        if (node == nullptr)
+            return;
+        delete_tree(node->left);
+        delete_tree(node->right);
+        delete node;
+    }
+
+    static const Node *leftmost(const Node *node) {
+        while (node != nullptr && node->left != nullptr) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    static const Node *successor(const Node *node) {
+        if (node->right != nullptr) {
+            return leftmost(node->right);
+        }
+        const Node *parent = node->parent;
+        while (parent != nullptr && node == parent->right) {
+            node = parent;
+            parent = parent->parent;
+        }
+        return parent;
+    }
+
+    // Join-based set operations (Blelloch, Ferizovic and Sun, "Just Join for Parallel Ordered
+    // Sets"). Detached subtrees travel with their black height so joins never walk to a leaf.
+    struct Subtree {
+        Node *root;
+        int height;
+    };
+
+    static int black_height(const Node *node) {
+        int height = 0;
+        for (; node != nullptr; node = node->left) {
+            height += node->is_red ? 0 : 1;
+        }
+        return height;
+    }
+
+    // Detaches the children of `tree`'s root.
+    static void expose(Subtree tree, Subtree &left, Subtree &right) {
+        int height = tree.height - (tree.root->is_red ? 0 : 1);
+        left = Subtree{tree.root->left, height};
+        right = Subtree{tree.root->right, height};
+        for (Node *child: {left.root, right.root}) {
+            if (child != nullptr) {
+                child->parent = nullptr;
+            }
+        }
+    }
+
+    Node *link(Node *left, Node *node, Node *right, bool red) const {
+        node->left = left;
+        node->right = right;
+        node->parent = nullptr;
+        node->is_red = red;
+        for (Node *child: {left, right}) {
+            if (child != nullptr) {
+                child->parent = node;
+            }
+        }
+        if (digests) {
+            pull(node);
+        }
+        return node;
+    }
+
+    Node *rotate_left_at(Node *node) const {
+        Node *right_child = node->right;
+        node->right = right_child->left;
+        if (node->right != nullptr) {
+            node->right->parent = node;
+        }
+        right_child->left = node;
+        right_child->parent = nullptr;
+        node->parent = right_child;
+        if (digests) {
+            pull(node);
+            pull(right_child);
+        }
+        return right_child;
+    }
+
+    Node *rotate_right_at(Node *node) const {
+        Node *left_child = node->left;
+        node->left = left_child->right;
+        if (node->left != nullptr) {
+            node->left->parent = node;
+        }
+        left_child->right = node;
+        left_child->parent = nullptr;
+        node->parent = left_child;
+        if (digests) {
+            pull(node);
+            pull(left_child);
+        }
+        return left_child;
+    }
+
+    // Hangs `node` and `right` off the right spine of the taller `left`, at the first black
+    // node of the same black height, then fixes a red-red pair on the way back up.
+    Node *join_right(Node *left, int left_height, Node *node, Node *right, int right_height) const {
+        if (!is_red(left) && left_height == right_height) {
+            return link(left, node, right, true);
+        }
+        Node *joined = join_right(left->right, left_height - (left->is_red ? 0 : 1), node, right, right_height);
+        left->right = joined;
+        joined->parent = left;
+        if (digests) {
+            pull(left);
+        }
+        if (!left->is_red && joined->is_red && is_red(joined->right)) {
+            joined->right->is_red = false;
+            return rotate_left_at(left);
+        }
+        return left;
+    }
+
+    Node *join_left(Node *left, int left_height, Node *node, Node *right, int right_height) const {
+        if (!is_red(right) && left_height == right_height) {
+            return link(left, node, right, true);
+        }
+        Node *joined = join_left(left, left_height, node, right->left, right_height - (right->is_red ? 0 : 1));
+        right->left = joined;
+        joined->parent = right;
+        if (digests) {
+            pull(right);
+        }
+        if (!right->is_red && joined->is_red && is_red(joined->left)) {
+            joined->left->is_red = false;
+            return rotate_right_at(right);
+        }
+        return right;
+    }
+
+    // Every key in `left` < node's key < every key in `right`.
+    Subtree join(Subtree left, Node *node, Subtree right) const {
+        for (Subtree *side: {&left, &right}) {
+            if (is_red(side->root)) {
+                side->root->is_red = false;
+                side->height++;
+            }
+        }
+        Subtree result{nullptr, left.height};
+        if (left.height > right.height) {
+            result.root = join_right(left.root, left.height, node, right.root, right.height);
+            if (result.root->is_red && is_red(result.root->right)) {
+                result.root->is_red = false;
+                result.height++;
+            }
+        } else if (right.height > left.height) {
+            result = Subtree{join_left(left.root, left.height, node, right.root, right.height), right.height};
+            if (result.root->is_red && is_red(result.root->left)) {
+                result.root->is_red = false;
+                result.height++;
+            }
+        } else {
+            result.root = link(left.root, node, right.root, true);
+        }
+        result.root->parent = nullptr;
+        return result;
+    }
+
+    // Splits `tree` into keys below and above `key`; a node holding `key` is returned detached.
+    Node *split(Subtree tree, const K &key, Subtree &left, Subtree &right) const {
+        if (tree.root == nullptr) {
+            left = right = Subtree{nullptr, 0};
+            return nullptr;
+        }
+        Node *node = tree.root;
+        Subtree below;
+        Subtree above;
+        expose(tree, below, above);
+        int cmp = compare_keys(key, node->key);
+        if (cmp == 0) {
+            left = below;
+            right = above;
+            return node;
+        }
+        Subtree inner;
+        Node *match;
+        if (cmp < 0) {
+            match = split(below, key, left, inner);
+            right = join(inner, node, above);
+        } else {
+            match = split(above, key, inner, right);
+            left = join(below, node, inner);
+        }
+        return match;
+    }
+
+    // Detaches the largest node of a non-empty tree.
+    Node *split_last(Subtree tree, Subtree &rest) const {
+        Node *node = tree.root;
+        Subtree below;
+        Subtree above;
+        expose(tree, below, above);
+        if (above.root == nullptr) {
+            rest = below;
+            return node;
+        }
+        Subtree inner;
+        Node *last = split_last(above, inner);
+        rest = join(below, node, inner);
+        return last;
+    }
+
+    Subtree join2(Subtree left, Subtree right) const {
+        if (left.root == nullptr) {
+            return right;
+        }
+        if (right.root == nullptr) {
+            return left;
+        }
+        Subtree rest;
+        Node *last = split_last(left, rest);
+        return join(rest, last, right);
+    }
+
+    // Runs both halves of a recursion on the shared pool while `forks` levels remain.
+    template<typename First, typename Second>
+    static void fork_join(int forks, First &&first, Second &&second) {
+        if (forks > 0) {
+            WorkStealingPool::shared().fork_join(first, second);
+        } else {
+            first();
+            second();
+        }
+    }
+
+    // Equal keys take the value from `b`.
+    Subtree union_subtrees(Subtree a, Subtree b, std::atomic<size_t> &duplicates, int forks) const {
+        if (a.root == nullptr) {
+            return b;
+        }
+        if (b.root == nullptr) {
+            return a;
+        }
+        Node *node = a.root;
+        Subtree a_left;
+        Subtree a_right;
+        expose(a, a_left, a_right);
+        Subtree b_left;
+        Subtree b_right;
+        Node *match = split(b, node->key, b_left, b_right);
+        if (match != nullptr) {
+            node->value = std::move(match->value);
+            node->merkle = std::move(match->merkle);
+            delete match;
+            duplicates++;
+        }
+        Subtree left;
+        Subtree right;
+        fork_join(forks, [&] { left = union_subtrees(a_left, b_left, duplicates, forks - 1); },
+                  [&] { right = union_subtrees(a_right, b_right, duplicates, forks - 1); });
+        return join(left, node, right);
+    }
+
+    Subtree intersect_subtrees(Subtree a, Subtree b, std::atomic<size_t> &matches, int forks) const {
+        if (a.root == nullptr || b.root == nullptr) {
+            delete_tree(a.root);
+            delete_tree(b.root);
+            return Subtree{nullptr, 0};
+        }
+        Node *node = a.root;
+        Subtree a_left;
+        Subtree a_right;
+        expose(a, a_left, a_right);
+        Subtree b_left;
+        Subtree b_right;
+        Node *match = split(b, node->key, b_left, b_right);
+        Subtree left;
+        Subtree right;
+        fork_join(forks, [&] { left = intersect_subtrees(a_left, b_left, matches, forks - 1); },
+                  [&] { right = intersect_subtrees(a_right, b_right, matches, forks - 1); });
+        if (match == nullptr) {
+            delete node;
+            return join2(left, right);
+        }
+        delete match;
+        matches++;
+        return join(left, node, right);
+    }
+
+    Subtree subtract_subtrees(Subtree a, Subtree b, std::atomic<size_t> &removed, int forks) const {
+        if (a.root == nullptr || b.root == nullptr) {
+            delete_tree(b.root);
+            return a;
+        }
+        Node *node = b.root;
+        Subtree b_left;
+        Subtree b_right;
+        expose(b, b_left, b_right);
+        Subtree a_left;
+        Subtree a_right;
+        Node *match = split(a, node->key, a_left, a_right);
+        delete node;
+        if (match != nullptr) {
+            delete match;
+            removed++;
+        }
+        Subtree left;
+        Subtree right;
+        fork_join(forks, [&] { left = subtract_subtrees(a_left, b_left, removed, forks - 1); },
+                  [&] { right = subtract_subtrees(a_right, b_right, removed, forks - 1); });
+        return join2(left, right);
+    }
+
+    // Takes both trees apart for a set operation; `other` is left empty.
+    int begin_set_operation(BasicRedBlackTree &other, unsigned threads, Subtree &a, Subtree &b) {
+        if (digests && !other.digests) {
+            pull_all(other.root);
+        }
+        // Small inputs are not worth a thread.
+        int forks = 0;
+        if (count + other.count >= 65536) {
+            while ((1u << forks) < threads) {
+                forks++;
+            }
+        }
+        a = Subtree{root, black_height(root)};
+        b = Subtree{other.root, black_height(other.root)};
+        root = nullptr;
+        other.root = nullptr;
+        other.count = 0;
+        return forks;
+    }
+
+    void end_set_operation(Subtree result, size_t new_count) {
+        root = result.root;
+        if (root != nullptr) {
+            root->is_red = false;
+            root->parent = nullptr;
+        }
+        count = new_count;
+    }
+
+    // Balanced subtree over sorted, unique items[lo, hi), moving their keys and values. Only
+    // the bottom level can be incomplete; its nodes are red so every path has the same number
+    // of black nodes.
+    static Node *build_balanced(KeyValue **items, size_t lo, size_t hi, int depth, int red_depth, Node *parent) {
+        if (lo >= hi) {
+            return nullptr;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        Node *node = new Node(std::move(items[mid]->first),
+                              std::make_shared<const std::vector<uint8_t> >(std::move(items[mid]->second)));
+        node->parent = parent;
+        node->is_red = depth == red_depth;
+        node->left = build_balanced(items, lo, mid, depth + 1, red_depth, node);
+        node->right = build_balanced(items, mid + 1, hi, depth + 1, red_depth, node);
+        return node;
+    }
+
+    static Node *clone_subtree(const Node *node, Node *parent) {
+        if (node == nullptr) {
+            return nullptr;
+        }
+        Node *copy = new Node(node->key, node->value);
+        copy->parent = parent;
+        copy->is_red = node->is_red;
+        if (node->merkle != nullptr) {
+            copy->merkle = std::make_unique<NodeDigest>(*node->merkle);
+        }
+        copy->left = clone_subtree(node->left, copy);
+        copy->right = clone_subtree(node->right, copy);
+        return copy;
+    }
+
+public:
+    BasicRedBlackTree() : root(nullptr), count(0) {
+    }
+
+    BasicRedBlackTree(const BasicRedBlackTree &) = delete;
+    BasicRedBlackTree &operator=(const BasicRedBlackTree &) = delete;
+
+    ~BasicRedBlackTree() {
+        delete_tree(root);
+    }
+
+    void put(const K &key, const std::vector<uint8_t> &value) {
+        put(key, std::make_shared<const std::vector<uint8_t> >(value));
+    }
+
+    // With a trace, also reports the depth reached, rotations and node allocation time.
+    void put(const K &key, ValueRef value, OpTrace *trace = nullptr) {
+        uint64_t digest = digests ? entry_digest(key, *value) : 0;
+        if (root == nullptr) {
+            uint64_t alloc_start = trace != nullptr ? steady_ns() : 0;
+            root = new Node(key, std::move(value));
+            if (trace != nullptr) {
+                trace->alloc_ns += steady_ns() - alloc_start;
+            }
+            root->is_red = false;
+            if (digests) {
+                root->merkle = std::make_unique<NodeDigest>(NodeDigest{digest, digest, 1});
+            }
+            count = 1;
+            return;
+        }
+
+        Node *parent = nullptr;
+        Node *current = root;
+        int cmp = 0;
+        uint64_t prefix = key_prefix_of(key);
+        uint32_t depth = 0;
 
         while (current != nullptr) {
             parent = current;
-            cmp = compare_keys(key, current->key);
+            depth++;
+            cmp = compare_to_node(prefix, key, current);
             if (cmp == 0) {
-                current->value = value;
+                current->value = std::move(value);
+                if (digests) {
+                    current->merkle->digest = digest;
+                }
+                pull_to_root(current);
+                if (trace != nullptr) {
+                    trace->depth = depth;
+                }
                 return;
             }
             if (cmp < 0) {
@@ -174,11 +1471,21 @@ public:
             }
         }
 
-        Node *new_node = new Node(key, value);
+        // Only traced puts read the clock around the allocation.
+        uint64_t alloc_start = trace != nullptr ? steady_ns() : 0;
+        Node *new_node = new Node(key, std::move(value));
+        uint64_t rotations_before = rotations;
+        if (trace != nullptr) {
+            trace->alloc_ns += steady_ns() - alloc_start;
+            trace->depth = depth;
+        }
         new_node->parent = parent;
+        if (digests) {
+            new_node->merkle = std::make_unique<NodeDigest>(NodeDigest{digest, digest, 1});
+        }
 
         if (parent != nullptr) {
-            cmp = compare_keys(key, parent->key);
+            cmp = compare_to_node(prefix, key, parent);
             if (cmp < 0) {
                 parent->left = new_node;
             } else {
@@ -186,215 +1493,10103 @@ public:
             }
         }
 
-        fix_insert(new_node);
+        // Ancestors first, so rotations in fix_insert only need to fix up the nodes they move.
+        pull_to_root(new_node);
+        fix_insert(new_node);
+        count++;
+        if (trace != nullptr) {
+            trace->rotations = rotations - rotations_before;
+        }
+    }
+
+    bool get(const K &key, std::vector<uint8_t> &out_value, OpTrace *trace = nullptr) const {
+        Node *node = find_node(root, key, trace != nullptr ? &trace->depth : nullptr);
+        if (node != nullptr) {
+            out_value = *node->value;
+            return true;
+        }
+        return false;
+    }
+
+    bool get_ref(const K &key, ValueRef &out_value) const {
+        Node *node = find_node(root, key);
+        if (node != nullptr) {
+            out_value = node->value;
+            return true;
+        }
+        return false;
+    }
+
+    bool erase(const K &key, OpTrace *trace = nullptr) {
+        Node *node = find_node(root, key, trace != nullptr ? &trace->depth : nullptr);
+        if (node == nullptr) {
+            return false;
+        }
+
+        uint64_t rotations_before = rotations;
+        bool removed_red = node->is_red;
+        Node *replacement;
+        Node *replacement_parent;
+        if (node->left == nullptr) {
+            replacement = node->right;
+            replacement_parent = node->parent;
+            transplant(node, node->right);
+        } else if (node->right == nullptr) {
+            replacement = node->left;
+            replacement_parent = node->parent;
+            transplant(node, node->left);
+        } else {
+            Node *next = node->right;
+            while (next->left != nullptr) {
+                next = next->left;
+            }
+            removed_red = next->is_red;
+            replacement = next->right;
+            if (next->parent == node) {
+                replacement_parent = next;
+            } else {
+                replacement_parent = next->parent;
+                transplant(next, next->right);
+                next->right = node->right;
+                next->right->parent = next;
+            }
+            transplant(node, next);
+            next->left = node->left;
+            next->left->parent = next;
+            next->is_red = node->is_red;
+        }
+        delete node;
+        count--;
+        pull_to_root(replacement_parent);
+
+        if (!removed_red) {
+            fix_erase(replacement, replacement_parent);
+        }
+        if (trace != nullptr) {
+            trace->rotations = rotations - rotations_before;
+        }
+        return true;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Verifies ordering, parent links and the red-black properties.
+    bool check_invariants() const {
+        if (is_red(root) || (root != nullptr && root->parent != nullptr)) {
+            return false;
+        }
+        return check_subtree(root, nullptr, nullptr) >= 0;
+    }
+
+    // Starts maintaining subtree digests, which range_digest and diff need. Costs a hash of
+    // every written entry and a walk to the root on each write.
+    void enable_digests() {
+        digests = true;
+        pull_all(root);
+    }
+
+    bool has_digests() const {
+        return digests;
+    }
+
+    // Digest of the entries in [lo, hi); null bounds are open. O(log n).
+    RangeDigest range_digest(const K *lo, const K *hi) const {
+        RangeDigest below_hi = digest_below(hi);
+        RangeDigest below_lo = lo != nullptr ? digest_below(lo) : RangeDigest();
+        return RangeDigest{below_hi.hash - below_lo.hash, below_hi.count - below_lo.count};
+    }
+
+    // Calls fn(key, mine, theirs) for every key whose value differs from `other`, with null
+    // for a missing side. With digests on both trees it only descends into key ranges whose
+    // digests differ, so the cost grows with the number of differences rather than the tree
+    // size; otherwise it walks both trees in full. Returns the number of range digests
+    // compared, 0 for a full walk.
+    template<typename Fn>
+    size_t diff(const BasicRedBlackTree &other, Fn &&fn) const {
+        if (!digests || !other.digests) {
+            diff_entries(other, nullptr, nullptr, fn);
+            return 0;
+        }
+        size_t compared = 0;
+        diff_range(other, nullptr, nullptr, compared, fn);
+        return compared;
+    }
+
+    // Set operations that move `other`'s nodes into this tree and leave `other` empty; use
+    // copy_from first to keep an input. Each costs O(m log(n / m + 1)) for sizes m <= n, and
+    // trees of 64K+ entries split the recursion into up to `threads` tasks on the shared pool.
+
+    // Adds every entry of `other`; its values win on equal keys.
+    void unite(BasicRedBlackTree &other, unsigned threads = std::thread::hardware_concurrency()) {
+        if (&other == this) {
+            return;
+        }
+        Subtree a;
+        Subtree b;
+        size_t total = count + other.count;
+        int forks = begin_set_operation(other, threads, a, b);
+        std::atomic<size_t> duplicates{0};
+        Subtree result = union_subtrees(a, b, duplicates, forks);
+        end_set_operation(result, total - duplicates);
+    }
+
+    // Keeps only the keys also in `other`.
+    void intersect(BasicRedBlackTree &other, unsigned threads = std::thread::hardware_concurrency()) {
+        if (&other == this) {
+            return;
+        }
+        Subtree a;
+        Subtree b;
+        int forks = begin_set_operation(other, threads, a, b);
+        std::atomic<size_t> matches{0};
+        Subtree result = intersect_subtrees(a, b, matches, forks);
+        end_set_operation(result, matches);
+    }
+
+    // Removes the keys in `other`.
+    void subtract(BasicRedBlackTree &other, unsigned threads = std::thread::hardware_concurrency()) {
+        if (&other == this) {
+            clear();
+            return;
+        }
+        Subtree a;
+        Subtree b;
+        size_t before = count;
+        int forks = begin_set_operation(other, threads, a, b);
+        std::atomic<size_t> removed{0};
+        Subtree result = subtract_subtrees(a, b, removed, forks);
+        end_set_operation(result, before - removed);
+    }
+
+    // Inserts unsorted entries, moving their keys and values out. Later entries win over earlier
+    // ones with the same key, and the batch wins over existing entries. The batch is radix
+    // sorted, built into a balanced tree in O(n) and merged in with unite().
+    void put_batch(std::vector<KeyValue> &entries, unsigned threads = std::thread::hardware_concurrency()) {
+        std::vector<KeyValue *> items;
+        items.reserve(entries.size());
+        for (auto &entry: entries) {
+            items.push_back(&entry);
+        }
+        radix_sort_by_key(items, threads);
+        // The sort is stable, so the last of a run of equal keys is the latest write.
+        size_t unique = 0;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (i + 1 == items.size() || items[i]->first != items[i + 1]->first) {
+                items[unique++] = items[i];
+            }
+        }
+        BasicRedBlackTree batch;
+        int red_depth = 0;
+        while ((size_t(2) << red_depth) <= unique + 1) {
+            red_depth++;
+        }
+        batch.root = build_balanced(items.data(), 0, unique, 0, red_depth, nullptr);
+        batch.count = unique;
+        unite(batch, threads);
+    }
+
+    // Replaces the contents with a structural copy of `other`, sharing its value buffers.
+    void copy_from(const BasicRedBlackTree &other) {
+        if (&other == this) {
+            return;
+        }
+        clear();
+        root = clone_subtree(other.root, nullptr);
+        count = other.count;
+        digests = other.digests;
+    }
+
+    // Moves every entry with key >= `key` into `upper`, which must be empty, in O(log n). The
+    // tree keeps no subtree sizes, so the caller says how many entries stay below `key`.
+    void split_at(const K &key, size_t lower_count, BasicRedBlackTree &upper) {
+        size_t total = count;
+        Subtree lower;
+        Subtree higher;
+        Node *match = split(Subtree{root, black_height(root)}, key, lower, higher);
+        if (match != nullptr) {
+            higher = join(Subtree{nullptr, 0}, match, higher);
+        }
+        root = nullptr;
+        end_set_operation(lower, lower_count);
+        delete_tree(upper.root);
+        upper.digests = digests;
+        upper.end_set_operation(higher, total - lower_count);
+    }
+
+    // Moves all of `upper` in, in O(log n); every key in `upper` must be greater than every
+    // key here.
+    void append(BasicRedBlackTree &upper) {
+        if (digests && !upper.digests) {
+            pull_all(upper.root);
+        }
+        size_t total = count + upper.count;
+        Subtree joined = join2(Subtree{root, black_height(root)}, Subtree{upper.root, black_height(upper.root)});
+        upper.root = nullptr;
+        upper.count = 0;
+        end_set_operation(joined, total);
+    }
+
+    // Checks every subtree digest and count against its children.
+    bool check_digests() const {
+        return !digests || check_digest_subtree(root);
+    }
+
+    void clear() {
+        delete_tree(root);
+        root = nullptr;
+        count = 0;
+    }
+
+    // Visits entries in key order. Iterative so it is safe to run in a forked child.
+    template<typename Fn>
+    void for_each(Fn &&fn) const {
+        for (const Node *node = leftmost(root); node != nullptr; node = successor(node)) {
+            fn(node->key, *node->value);
+        }
+    }
+
+    // Visits entries with key >= start in key order until `fn` returns false.
+    template<typename Fn>
+    void scan(const K &start, Fn &&fn) const {
+        for (const Node *node = lower_bound_node(root, start); node != nullptr; node = successor(node)) {
+            if (!fn(node->key, *node->value)) {
+                return;
+            }
+        }
+    }
+
+    // Snapshot format: magic, version, entry count, then (u32 key_len, key, u32 value_len, value)
+    // for every entry in key order. Integers are in host byte order.
+    template<typename Sink>
+    void serialize(Sink &&sink) const {
+        uint64_t entries = count;
+        sink(&SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        sink(&SNAPSHOT_VERSION, sizeof(SNAPSHOT_VERSION));
+        sink(&entries, sizeof(entries));
+        for_each([&sink](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            uint32_t key_len = key.size();
+            uint32_t value_len = value.size();
+            sink(&key_len, sizeof(key_len));
+            sink(key.data(), key.size());
+            sink(&value_len, sizeof(value_len));
+            sink(value.data(), value.size());
+        });
+    }
+
+    void serialize(std::vector<uint8_t> &out) const {
+        serialize([&out](const void *data, size_t len) {
+            const uint8_t *bytes = static_cast<const uint8_t *>(data);
+            out.insert(out.end(), bytes, bytes + len);
+        });
+    }
+
+    // Exchanges contents with `other`; digest maintenance stays with each tree, so both must
+    // agree on it.
+    void swap(BasicRedBlackTree &other) {
+        std::swap(root, other.root);
+        std::swap(count, other.count);
+    }
+
+    // Decodes a snapshot produced by serialize(), handing each entry to fn(key, value) in key
+    // order; fn may move from both and returns false to stop. `size` is how many bytes the
+    // source holds, so a corrupt length is rejected before anything is allocated for it.
+    template<typename Source, typename Fn> requires std::is_invocable_r_v<bool, Source &, void *, size_t>
+    static bool read_snapshot(Source &&source, uint64_t size, Fn &&fn) {
+        uint64_t consumed = 0;
+        auto read = [&source, size, &consumed](void *out, uint64_t n) {
+            if (n > size - consumed || !source(out, n)) {
+                return false;
+            }
+            consumed += n;
+            return true;
+        };
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint64_t entries = 0;
+        if (!read(&magic, sizeof(magic)) || !read(&version, sizeof(version)) || !read(&entries, sizeof(entries))) {
+            return false;
+        }
+        // Every entry takes at least its two length fields.
+        if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION || entries > (size - consumed) / 8) {
+            return false;
+        }
+        std::vector<uint8_t> key;
+        std::vector<uint8_t> value;
+        for (uint64_t i = 0; i < entries; i++) {
+            uint32_t key_len = 0;
+            uint32_t value_len = 0;
+            if (!read(&key_len, sizeof(key_len)) || key_len > size - consumed) {
+                return false;
+            }
+            key.resize(key_len);
+            if (!read(key.data(), key_len) || !read(&value_len, sizeof(value_len)) || value_len > size - consumed) {
+                return false;
+            }
+            value.resize(value_len);
+            if (!read(value.data(), value_len) || !fn(key, value)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // read_snapshot over the file at `path`.
+    template<typename Fn>
+    static bool read_snapshot_file(const std::string &path, Fn &&fn) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        bool ok = fseeko(file, 0, SEEK_END) == 0;
+        off_t size = ok ? ftello(file) : -1;
+        ok = size >= 0 && fseeko(file, 0, SEEK_SET) == 0 && read_snapshot([file](void *out, size_t n) {
+            return n == 0 || fread(out, 1, n, file) == n;
+        }, size, fn);
+        fclose(file);
+        return ok;
+    }
+
+    // Replaces the tree contents with a snapshot produced by serialize(). The tree is
+    // unchanged unless the whole snapshot decodes.
+    template<typename Source> requires std::is_invocable_r_v<bool, Source &, void *, size_t>
+    bool deserialize(Source &&source, uint64_t size) {
+        BasicRedBlackTree loaded;
+        loaded.digests = digests;
+        auto insert = [&loaded](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            loaded.put(key, value);
+            return true;
+        };
+        if (!read_snapshot(source, size, insert)) {
+            return false;
+        }
+        swap(loaded);
+        return true;
+    }
+
+    bool deserialize(const uint8_t *data, size_t len) {
+        size_t offset = 0;
+        return deserialize([data, &offset](void *out, size_t n) {
+            memcpy(out, data + offset, n);
+            offset += n;
+            return true;
+        }, len);
+    }
+
+    bool save_snapshot(const std::string &path, size_t *bytes_written = nullptr) const {
+        FILE *file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        size_t written = 0;
+        bool ok = true;
+        serialize([file, &written, &ok](const void *data, size_t len) {
+            if (ok && len > 0 && fwrite(data, 1, len, file) != len) {
+                ok = false;
+            }
+            written += len;
+        });
+        if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+            ok = false;
+        }
+        if (fclose(file) != 0) {
+            ok = false;
+        }
+        if (bytes_written != nullptr) {
+            *bytes_written = written;
+        }
+        return ok;
+    }
+
+    bool load_snapshot(const std::string &path) {
+        BasicRedBlackTree loaded;
+        loaded.digests = digests;
+        auto insert = [&loaded](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            loaded.put(key, value);
+            return true;
+        };
+        if (!read_snapshot_file(path, insert)) {
+            return false;
+        }
+        swap(loaded);
+        return true;
+    }
+};
+
+using RedBlackTree = BasicRedBlackTree<std::vector<uint8_t> >;
+
+// Z-order (Morton) keys for 2D points: x and y bits interleaved, x in the even bits, stored
+// big-endian after a prefix so key order is Z order. A box [x0, x1] x [y0, y1] spans the Z
+// interval [z(x0, y0), z(x1, y1)], which also holds points outside it; a box scan jumps over
+// those with BIGMIN (Tropf & Herzog), the next Z value inside the box.
+static uint64_t spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+static uint32_t compact_bits(uint64_t x) {
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+    return static_cast<uint32_t>(x);
+}
+
+uint64_t z_encode(uint32_t x, uint32_t y) {
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+void z_decode(uint64_t z, uint32_t &x, uint32_t &y) {
+    x = compact_bits(z);
+    y = compact_bits(z >> 1);
+}
+
+static std::vector<uint8_t> z_key(const std::vector<uint8_t> &prefix, uint64_t z) {
+    std::vector<uint8_t> key = prefix;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        key.push_back(static_cast<uint8_t>(z >> shift));
+    }
+    return key;
+}
+
+std::vector<uint8_t> z_key(const std::vector<uint8_t> &prefix, uint32_t x, uint32_t y) {
+    return z_key(prefix, z_encode(x, y));
+}
+
+// Smallest Z value greater than `z` inside the box whose corners are zmin and zmax. `z` must
+// lie in [zmin, zmax] but outside the box.
+uint64_t z_bigmin(uint64_t z, uint64_t zmin, uint64_t zmax) {
+    uint64_t bigmin = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        uint64_t mask = 1ULL << bit;
+        // Lower bits of the same dimension as `bit`.
+        uint64_t below = (bit % 2 == 0 ? 0x5555555555555555ULL : 0xAAAAAAAAAAAAAAAAULL) & (mask - 1);
+        int state = ((z & mask) ? 4 : 0) | ((zmin & mask) ? 2 : 0) | ((zmax & mask) ? 1 : 0);
+        switch (state) {
+            case 0b001:
+                // The box straddles this bit: the upper half starts at bigmin, keep searching
+                // the lower half.
+                bigmin = (zmin | mask) & ~below;
+                zmax = (zmax & ~mask) | below;
+                break;
+            case 0b011:
+                return zmin;
+            case 0b100:
+                return bigmin;
+            case 0b101:
+                zmin = (zmin | mask) & ~below;
+                break;
+            default:
+                break;
+        }
+    }
+    return bigmin;
+}
+
+struct ZBoxStats {
+    // Entries read from the tree, including the ones outside the box.
+    size_t visited = 0;
+    size_t seeks = 0;
+};
+
+// Calls fn(x, y, key, value) for every `prefix` + z_key entry inside the box, in Z order.
+template<typename Fn>
+ZBoxStats z_box_scan(const RedBlackTree &tree, const std::vector<uint8_t> &prefix, uint32_t x0, uint32_t y0,
+                     uint32_t x1, uint32_t y1, Fn &&fn) {
+    ZBoxStats stats;
+    uint64_t zmin = z_encode(x0, y0);
+    uint64_t zmax = z_encode(x1, y1);
+    uint64_t next = zmin;
+    bool jumped = true;
+    while (jumped) {
+        jumped = false;
+        stats.seeks++;
+        tree.scan(z_key(prefix, next), [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            if (key.size() < prefix.size() || !std::equal(prefix.begin(), prefix.end(), key.begin())) {
+                return false;
+            }
+            if (key.size() != prefix.size() + sizeof(uint64_t)) {
+                return true;
+            }
+            uint64_t z = 0;
+            for (size_t i = prefix.size(); i < key.size(); i++) {
+                z = (z << 8) | key[i];
+            }
+            if (z > zmax) {
+                return false;
+            }
+            stats.visited++;
+            uint32_t x = 0;
+            uint32_t y = 0;
+            z_decode(z, x, y);
+            if (x >= x0 && x <= x1 && y >= y0 && y <= y1) {
+                fn(x, y, key, value);
+                return true;
+            }
+            next = z_bigmin(z, zmin, zmax);
+            jumped = true;
+            return false;
+        });
+    }
+    return stats;
+}
+
+// Workload capture. Each operation becomes one record: op, nanoseconds since the capture
+// opened, key and value size (values themselves are not kept; a scan stores its limit).
+// Threads append to their own buffer and hand a full buffer to a writer thread, which writes
+// it out as a block:
+//   [u32 thread][u32 records][u32 payload bytes][u64 base ns] then records of
+//   [u8 op][varint ns since previous record][varint key length][key][varint value size].
+static const uint32_t TRACE_MAGIC = 0x43525459; // "YTRC"
+static const uint32_t TRACE_VERSION = 1;
+
+enum class TraceOp : uint8_t {
+    PUT = 1,
+    GET = 2,
+    ERASE = 3,
+    SCAN = 4,
+};
+
+static void append_varint(std::vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static bool read_varint(const uint8_t *&data, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && data < end; shift += 7) {
+        uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class WorkloadCapture {
+public:
+    struct Options {
+        size_t buffer_bytes = 64 << 10;
+        // Full buffers waiting for the writer; recording threads wait beyond this.
+        size_t max_pending_blocks = 64;
+    };
+
+private:
+    struct ThreadBuffer {
+        std::mutex mutex;
+        uint32_t thread;
+        std::vector<uint8_t> records;
+        uint32_t count = 0;
+        uint64_t base_ns = 0;
+        uint64_t last_ns = 0;
+        uint64_t recorded = 0;
+    };
+
+    struct Block {
+        uint32_t thread;
+        uint32_t count;
+        uint64_t base_ns;
+        std::vector<uint8_t> records;
+    };
+
+    struct ThreadSlot {
+        uint64_t capture_id = 0;
+        ThreadBuffer *buffer = nullptr;
+    };
+
+    static std::atomic<uint64_t> &next_id() {
+        static std::atomic<uint64_t> id{1};
+        return id;
+    }
+
+    Options options;
+    uint64_t id = next_id()++;
+    std::chrono::steady_clock::time_point start;
+    std::mutex file_mutex;
+    FILE *file = nullptr;
+    bool write_failed = false;
+    uint64_t bytes_written = 0;
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<ThreadBuffer> > buffers;
+    std::unordered_map<std::thread::id, ThreadBuffer *> thread_buffers;
+    std::thread writer;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable space_cv;
+    std::deque<Block> queue;
+    std::vector<std::vector<uint8_t> > spare;
+    bool stopping = false;
+
+    ThreadBuffer &local_buffer() {
+        // Caches the capture this thread last recorded into; a thread alternating between
+        // captures finds its buffer again in thread_buffers.
+        static thread_local ThreadSlot slot;
+        if (slot.capture_id != id) {
+            std::lock_guard lock(buffers_mutex);
+            ThreadBuffer *&buffer = thread_buffers[std::this_thread::get_id()];
+            if (buffer == nullptr) {
+                buffers.emplace_back(new ThreadBuffer());
+                buffers.back()->thread = buffers.size() - 1;
+                buffers.back()->records.reserve(options.buffer_bytes);
+                buffer = buffers.back().get();
+            }
+            slot.capture_id = id;
+            slot.buffer = buffer;
+        }
+        return *slot.buffer;
+    }
+
+    // Caller holds buffer.mutex. Queues the buffer's records for the writer and gives the
+    // buffer a recycled one.
+    void submit_block(ThreadBuffer &buffer) {
+        if (buffer.count == 0) {
+            return;
+        }
+        if (!writer.joinable()) {
+            buffer.records.clear();
+            buffer.count = 0;
+            return;
+        }
+        Block block{buffer.thread, buffer.count, buffer.base_ns, {}};
+        {
+            std::unique_lock lock(queue_mutex);
+            space_cv.wait(lock, [this] { return queue.size() < std::max<size_t>(1, options.max_pending_blocks); });
+            block.records.swap(buffer.records);
+            if (!spare.empty()) {
+                buffer.records.swap(spare.back());
+                spare.pop_back();
+            }
+            queue.push_back(std::move(block));
+        }
+        queue_cv.notify_one();
+        buffer.count = 0;
+        buffer.records.reserve(options.buffer_bytes);
+    }
+
+    void write_loop() {
+        std::unique_lock lock(queue_mutex);
+        while (true) {
+            queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            Block block = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            space_cv.notify_all();
+            uint32_t header[3] = {block.thread, block.count, static_cast<uint32_t>(block.records.size())};
+            {
+                std::lock_guard file_lock(file_mutex);
+                if (!write_failed) {
+                    write_failed = fwrite(header, sizeof(header), 1, file) != 1 ||
+                                   fwrite(&block.base_ns, sizeof(block.base_ns), 1, file) != 1 ||
+                                   fwrite(block.records.data(), 1, block.records.size(), file) !=
+                                   block.records.size();
+                    bytes_written += sizeof(header) + sizeof(block.base_ns) + block.records.size();
+                }
+            }
+            block.records.clear();
+            lock.lock();
+            if (spare.size() < options.max_pending_blocks) {
+                spare.push_back(std::move(block.records));
+            }
+        }
+    }
+
+public:
+    WorkloadCapture() : WorkloadCapture(Options()) {
+    }
+
+    explicit WorkloadCapture(const Options &opts) : options(opts) {
+    }
+
+    WorkloadCapture(const WorkloadCapture &) = delete;
+    WorkloadCapture &operator=(const WorkloadCapture &) = delete;
+
+    ~WorkloadCapture() {
+        close();
+    }
+
+    bool open(const std::string &path) {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        uint32_t header[2] = {TRACE_MAGIC, TRACE_VERSION};
+        write_failed = fwrite(header, sizeof(header), 1, file) != 1;
+        bytes_written = sizeof(header);
+        start = std::chrono::steady_clock::now();
+        stopping = false;
+        writer = std::thread([this] { write_loop(); });
+        return !write_failed;
+    }
+
+    void record(TraceOp op, const std::vector<uint8_t> &key, size_t value_size) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ThreadBuffer &buffer = local_buffer();
+        std::lock_guard lock(buffer.mutex);
+        if (buffer.count == 0) {
+            buffer.base_ns = now;
+            buffer.last_ns = now;
+        }
+        buffer.records.push_back(static_cast<uint8_t>(op));
+        append_varint(buffer.records, now - buffer.last_ns);
+        append_varint(buffer.records, key.size());
+        buffer.records.insert(buffer.records.end(), key.begin(), key.end());
+        append_varint(buffer.records, value_size);
+        buffer.last_ns = now;
+        buffer.count++;
+        buffer.recorded++;
+        if (buffer.records.size() >= options.buffer_bytes) {
+            submit_block(buffer);
+        }
+    }
+
+    // Writes out every thread's buffer and closes the file. Stop issuing operations first.
+    bool close() {
+        {
+            std::lock_guard lock(buffers_mutex);
+            for (auto &buffer: buffers) {
+                std::lock_guard buffer_lock(buffer->mutex);
+                submit_block(*buffer);
+            }
+        }
+        if (writer.joinable()) {
+            {
+                std::lock_guard lock(queue_mutex);
+                stopping = true;
+            }
+            queue_cv.notify_one();
+            writer.join();
+        }
+        std::lock_guard lock(file_mutex);
+        if (file == nullptr) {
+            return !write_failed;
+        }
+        bool ok = !write_failed && fclose(file) == 0;
+        file = nullptr;
+        return ok;
+    }
+
+    uint64_t get_recorded() {
+        std::lock_guard lock(buffers_mutex);
+        uint64_t total = 0;
+        for (auto &buffer: buffers) {
+            std::lock_guard buffer_lock(buffer->mutex);
+            total += buffer->recorded;
+        }
+        return total;
+    }
+
+    uint64_t get_bytes_written() {
+        std::lock_guard lock(file_mutex);
+        return bytes_written;
+    }
+};
+
+// One operation that took at least the slow-op threshold.
+struct SlowOp {
+    uint64_t sequence;
+    uint64_t start_ns;
+    uint64_t total_ns;
+    uint64_t lock_wait_ns;
+    uint64_t alloc_ns;
+    uint32_t depth;
+    uint32_t rotations;
+    uint32_t key_size;
+    TraceOp op;
+    uint8_t key_prefix_len;
+    uint8_t key_prefix[16];
+};
+
+// Keeps the most recent slow operations in a fixed ring that writers overwrite without locks.
+// Each slot is a seqlock: a writer claims it by moving its sequence to an odd value, stores
+// the record word by word and publishes it with the next even value. Readers copy a slot and
+// keep it only if the sequence was the same even value before and after. Operations under
+// the threshold only pay for the clock reads around them.
+class SlowOpLog {
+public:
+    struct Options {
+        uint64_t threshold_ns = 1000000;
+        size_t capacity = 1024;
+    };
+
+private:
+    static constexpr size_t WORDS = (sizeof(SlowOp) + 7) / 8;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> words[WORDS];
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t size;
+    std::atomic<uint64_t> threshold_ns;
+    alignas(64) std::atomic<uint64_t> next{0};
+    std::atomic<uint64_t> dropped{0};
+
+public:
+    SlowOpLog() : SlowOpLog(Options()) {
+    }
+
+    explicit SlowOpLog(const Options &options) : size(std::max<size_t>(1, options.capacity)),
+                                                 threshold_ns(options.threshold_ns) {
+        slots.reset(new Slot[size]);
+        for (size_t i = 0; i < size; i++) {
+            for (auto &word: slots[i].words) {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void set_threshold(std::chrono::nanoseconds threshold) {
+        threshold_ns.store(threshold.count(), std::memory_order_relaxed);
+    }
+
+    uint64_t get_threshold_ns() const {
+        return threshold_ns.load(std::memory_order_relaxed);
+    }
+
+    // Called when a traced operation that began at start_ns completes.
+    void finish(TraceOp op, const std::vector<uint8_t> &key, uint64_t start_ns, const OpTrace &trace) {
+        uint64_t total_ns = steady_ns() - start_ns;
+        if (total_ns < threshold_ns.load(std::memory_order_relaxed)) {
+            return;
+        }
+        SlowOp record{};
+        record.sequence = next.fetch_add(1, std::memory_order_relaxed);
+        record.start_ns = start_ns;
+        record.total_ns = total_ns;
+        record.lock_wait_ns = trace.lock_wait_ns;
+        record.alloc_ns = trace.alloc_ns;
+        record.depth = trace.depth;
+        record.rotations = trace.rotations;
+        record.key_size = key.size();
+        record.op = op;
+        record.key_prefix_len = std::min(key.size(), sizeof(record.key_prefix));
+        memcpy(record.key_prefix, key.data(), record.key_prefix_len);
+
+        // A slot still being written, or already holding a newer record, means this writer
+        // was lapped; the record is dropped rather than waited on.
+        Slot &slot = slots[record.sequence % size];
+        uint64_t published = 2 * record.sequence + 2;
+        uint64_t current = slot.sequence.load(std::memory_order_relaxed);
+        do {
+            if (current % 2 == 1 || current >= published) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        } while (!slot.sequence.compare_exchange_weak(current, published - 1, std::memory_order_acquire));
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t words[WORDS] = {};
+        memcpy(words, &record, sizeof(record));
+        for (size_t i = 0; i < WORDS; i++) {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.sequence.store(published, std::memory_order_release);
+    }
+
+    // The retained records, oldest first. Safe to call while operations are being logged.
+    std::vector<SlowOp> read() const {
+        std::vector<SlowOp> out;
+        uint64_t end = next.load(std::memory_order_acquire);
+        for (uint64_t position = end > size ? end - size : 0; position < end; position++) {
+            const Slot &slot = slots[position % size];
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            uint64_t words[WORDS];
+            for (size_t i = 0; i < WORDS; i++) {
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before != 2 * position + 2 || slot.sequence.load(std::memory_order_relaxed) != before) {
+                continue;
+            }
+            SlowOp record;
+            memcpy(&record, words, sizeof(record));
+            out.push_back(record);
+        }
+        return out;
+    }
+
+    uint64_t get_recorded() const {
+        return next.load();
+    }
+
+    uint64_t get_dropped() const {
+        return dropped.load();
+    }
+};
+
+struct SnapshotStats {
+    pid_t pid = -1;
+    bool ok = false;
+    size_t keys = 0;
+    size_t bytes_written = 0;
+    // Pages the child ended up owning privately because the parent wrote to them after fork().
+    size_t cow_bytes = 0;
+    uint64_t fork_us = 0;
+    uint64_t duration_us = 0;
+};
+
+// Reads Private_Dirty from /proc/self/smaps_rollup; the copy-on-write cost of a forked child.
+static size_t private_dirty_bytes() {
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    char line[256];
+    size_t total_kb = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        size_t kb = 0;
+        if (sscanf(line, "Private_Dirty: %zu kB", &kb) == 1) {
+            total_kb += kb;
+        }
+    }
+    fclose(file);
+    return total_kb * 1024;
+}
+
+class ConcurrentRedBlackTree {
+private:
+    RedBlackTree tree;
+    mutable std::shared_mutex mutex;
+
+    // Background save state; only one save can be in flight at a time.
+    std::mutex save_mutex;
+    SnapshotStats save_stats;
+    int save_pipe = -1;
+    std::chrono::steady_clock::time_point save_start;
+
+    struct ChildReport {
+        bool ok;
+        size_t bytes_written;
+        size_t cow_bytes;
+    };
+
+    // Version history, recorded only while history is enabled. Each chain is ordered by
+    // timestamp (microseconds since the epoch) and a null value marks an erase. Values are
+    // shared with the tree, so the current version costs no extra copy.
+    struct Version {
+        uint64_t ts;
+        ValueRef value;
+    };
+    bool history_enabled = false;
+    uint64_t retention_us = 0;
+    uint64_t last_ts = 0;
+    std::map<std::vector<uint8_t>, std::vector<Version> > history;
+
+    std::thread compactor;
+    std::mutex compactor_mutex;
+    std::condition_variable compactor_cv;
+    bool compactor_stopping = false;
+
+    // Set while a workload capture is attached; checked with one relaxed load per operation.
+    std::atomic<WorkloadCapture *> capture{nullptr};
+    // Likewise for the slow-op log; only traced operations read the clock.
+    std::atomic<SlowOpLog *> slow_log{nullptr};
+
+    // Strictly increasing, so versions written in one microsecond still have an order.
+    uint64_t next_timestamp() {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        last_ts = std::max<uint64_t>(last_ts + 1, std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+        return last_ts;
+    }
+
+    void put_value(const std::vector<uint8_t> &key, ValueRef value, SlowOpLog *log, uint64_t start) {
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            c->record(TraceOp::PUT, key, value ? value->size() : 0);
+        }
+        OpTrace trace;
+        {
+            std::unique_lock lock(mutex, std::defer_lock);
+            lock_traced(lock, log != nullptr ? &trace : nullptr);
+            if (history_enabled) {
+                history[key].push_back(Version{next_timestamp(), value});
+            }
+            tree.put(key, std::move(value), log != nullptr ? &trace : nullptr);
+        }
+        if (log != nullptr) {
+            log->finish(TraceOp::PUT, key, start, trace);
+        }
+    }
+
+    // Takes the lock; when traced, an uncontended acquisition is recorded as zero wait without
+    // reading the clock.
+    template<typename Lock>
+    static void lock_traced(Lock &lock, OpTrace *trace) {
+        if (trace == nullptr) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            uint64_t wait_start = steady_ns();
+            lock.lock();
+            trace->lock_wait_ns = steady_ns() - wait_start;
+        }
+    }
+
+    // The version visible at `ts`, or nullptr if the key did not exist then.
+    static const Version *version_at(const std::vector<Version> &chain, uint64_t ts) {
+        auto it = std::upper_bound(chain.begin(), chain.end(), ts,
+                                   [](uint64_t t, const Version &version) { return t < version.ts; });
+        if (it == chain.begin() || (it - 1)->value == nullptr) {
+            return nullptr;
+        }
+        return &*(it - 1);
+    }
+
+public:
+    ConcurrentRedBlackTree() = default;
+
+    ~ConcurrentRedBlackTree() {
+        stop_history_compaction();
+        SnapshotStats ignored;
+        finish_background_save(ignored);
+    }
+
+    void put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        // Allocate the value buffer before taking the lock.
+        SlowOpLog *log = slow_log.load(std::memory_order_relaxed);
+        uint64_t start = log != nullptr ? steady_ns() : 0;
+        ValueRef ref = std::make_shared<const std::vector<uint8_t> >(value);
+        put_value(key, std::move(ref), log, start);
+    }
+
+    void put(const std::vector<uint8_t> &key, ValueRef value) {
+        SlowOpLog *log = slow_log.load(std::memory_order_relaxed);
+        put_value(key, std::move(value), log, log != nullptr ? steady_ns() : 0);
+    }
+
+    // See RedBlackTree::put_batch. Sorting and building run before the lock is taken; only the
+    // merge holds it.
+    void put_batch(std::vector<KeyValue> &entries, unsigned threads = std::thread::hardware_concurrency()) {
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            for (const KeyValue &entry: entries) {
+                c->record(TraceOp::PUT, entry.first, entry.second.size());
+            }
+        }
+        RedBlackTree batch;
+        batch.put_batch(entries, threads);
+        std::unique_lock lock(mutex);
+        if (!history_enabled) {
+            tree.unite(batch, threads);
+            return;
+        }
+        batch.for_each([this](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            ValueRef ref = std::make_shared<const std::vector<uint8_t> >(value);
+            history[key].push_back(Version{next_timestamp(), ref});
+            tree.put(key, std::move(ref));
+        });
+    }
+
+    // Writes only if `key` is absent; returns whether it wrote.
+    bool put_if_absent(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        ValueRef ref = std::make_shared<const std::vector<uint8_t> >(value);
+        {
+            std::unique_lock lock(mutex);
+            ValueRef existing;
+            if (tree.get_ref(key, existing)) {
+                return false;
+            }
+            if (history_enabled) {
+                history[key].push_back(Version{next_timestamp(), ref});
+            }
+            tree.put(key, std::move(ref));
+        }
+        // Recorded after unlocking: a full capture queue blocks the caller.
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            c->record(TraceOp::PUT, key, value.size());
+        }
+        return true;
+    }
+
+    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) const {
+        SlowOpLog *log = slow_log.load(std::memory_order_relaxed);
+        OpTrace trace;
+        uint64_t start = log != nullptr ? steady_ns() : 0;
+        bool found;
+        {
+            std::shared_lock lock(mutex, std::defer_lock);
+            lock_traced(lock, log != nullptr ? &trace : nullptr);
+            found = tree.get(key, out_value, log != nullptr ? &trace : nullptr);
+        }
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            c->record(TraceOp::GET, key, found ? out_value.size() : 0);
+        }
+        if (log != nullptr) {
+            log->finish(TraceOp::GET, key, start, trace);
+        }
+        return found;
+    }
+
+    // Shares the stored buffer instead of copying it.
+    bool get_ref(const std::vector<uint8_t> &key, ValueRef &out_value) const {
+        bool found;
+        {
+            std::shared_lock lock(mutex);
+            found = tree.get_ref(key, out_value);
+        }
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            c->record(TraceOp::GET, key, found ? out_value->size() : 0);
+        }
+        return found;
+    }
+
+    // Runs fn(tree) under a single exclusive lock acquisition. Writes made this way would
+    // bypass the version history, so while it is enabled this returns false without running
+    // fn; use transact instead.
+    template<typename Fn>
+    bool atomically(Fn &&fn) {
+        std::unique_lock lock(mutex);
+        if (history_enabled) {
+            return false;
+        }
+        fn(tree);
+        return true;
+    }
+
+    // Runs fn(tree) under a shared lock, for read-only walks over the whole tree.
+    template<typename Fn>
+    void visit(Fn &&fn) const {
+        std::shared_lock lock(mutex);
+        fn(static_cast<const RedBlackTree &>(tree));
+    }
+
+    // Key -> (present, value) for every key a transaction wrote.
+    using WriteSet = std::map<std::vector<uint8_t>, std::pair<bool, std::vector<uint8_t> > >;
+
+    // Runs fn(tree, writes) under one exclusive lock and, if it returns true, applies `writes`
+    // before unlocking, versioned like ordinary puts and erases. The writes are captured after
+    // unlocking.
+    template<typename Fn>
+    bool transact(Fn &&fn) {
+        WriteSet writes;
+        WorkloadCapture *c = capture.load(std::memory_order_relaxed);
+        std::vector<size_t> value_sizes;
+        {
+            std::unique_lock lock(mutex);
+            if (!fn(static_cast<const RedBlackTree &>(tree), writes)) {
+                return false;
+            }
+            for (auto &[key, write]: writes) {
+                if (c != nullptr) {
+                    value_sizes.push_back(write.second.size());
+                }
+                if (!write.first) {
+                    if (tree.erase(key) && history_enabled) {
+                        history[key].push_back(Version{next_timestamp(), nullptr});
+                    }
+                    continue;
+                }
+                ValueRef ref = std::make_shared<const std::vector<uint8_t> >(std::move(write.second));
+                if (history_enabled) {
+                    history[key].push_back(Version{next_timestamp(), ref});
+                }
+                tree.put(key, std::move(ref));
+            }
+        }
+        if (c != nullptr) {
+            size_t i = 0;
+            for (const auto &[key, write]: writes) {
+                c->record(write.first ? TraceOp::PUT : TraceOp::ERASE, key, value_sizes[i++]);
+            }
+        }
+        return true;
+    }
+
+    bool erase(const std::vector<uint8_t> &key) {
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            c->record(TraceOp::ERASE, key, 0);
+        }
+        SlowOpLog *log = slow_log.load(std::memory_order_relaxed);
+        OpTrace trace;
+        uint64_t start = log != nullptr ? steady_ns() : 0;
+        bool erased;
+        {
+            std::unique_lock lock(mutex, std::defer_lock);
+            lock_traced(lock, log != nullptr ? &trace : nullptr);
+            erased = tree.erase(key, log != nullptr ? &trace : nullptr);
+            if (erased && history_enabled) {
+                history[key].push_back(Version{next_timestamp(), nullptr});
+            }
+        }
+        if (log != nullptr) {
+            log->finish(TraceOp::ERASE, key, start, trace);
+        }
+        return erased;
+    }
+
+    // Copies up to `limit` entries with key >= start, in key order.
+    void scan(const std::vector<uint8_t> &start, size_t limit,
+              std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > &out) const {
+        if (WorkloadCapture *c = capture.load(std::memory_order_relaxed)) {
+            c->record(TraceOp::SCAN, start, limit);
+        }
+        std::shared_lock lock(mutex);
+        tree.scan(start, [&out, limit](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            if (out.size() >= limit) {
+                return false;
+            }
+            out.emplace_back(key, value);
+            return true;
+        });
+    }
+
+    // Records every put, get, erase and scan into `c` until detached with nullptr. Detach
+    // before closing the capture.
+    void set_capture(WorkloadCapture *c) {
+        capture.store(c);
+    }
+
+    // Times every put, get and erase and logs those over the log's threshold, with lock wait,
+    // depth, rotations and allocation time. Detach with nullptr before destroying the log.
+    void set_slow_op_log(SlowOpLog *log) {
+        slow_log.store(log);
+    }
+
+    void enable_digests() {
+        std::unique_lock lock(mutex);
+        tree.enable_digests();
+    }
+
+    RangeDigest range_digest(const std::vector<uint8_t> *lo, const std::vector<uint8_t> *hi) const {
+        std::shared_lock lock(mutex);
+        return tree.range_digest(lo, hi);
+    }
+
+    // See RedBlackTree::diff. Both trees stay read-locked for the whole comparison.
+    template<typename Fn>
+    size_t diff(const ConcurrentRedBlackTree &other, Fn &&fn) const {
+        if (&other == this) {
+            return 0;
+        }
+        // Lock in address order so two diffs in opposite directions cannot deadlock.
+        const ConcurrentRedBlackTree *first = this < &other ? this : &other;
+        const ConcurrentRedBlackTree *second = this < &other ? &other : this;
+        std::shared_lock first_lock(first->mutex);
+        std::shared_lock second_lock(second->mutex);
+        return tree.diff(other.tree, fn);
+    }
+
+    // Anti-entropy: makes this tree match `source` by copying only the entries that differ.
+    // Returns the number of keys repaired.
+    size_t repair_from(const ConcurrentRedBlackTree &source) {
+        std::vector<std::pair<std::vector<uint8_t>, ValueRef> > changes;
+        diff(source, [&changes](const std::vector<uint8_t> &key, const std::vector<uint8_t> *,
+                                const std::vector<uint8_t> *theirs) {
+            changes.emplace_back(key, theirs != nullptr ? std::make_shared<const std::vector<uint8_t> >(*theirs)
+                                                        : nullptr);
+        });
+        for (auto &change: changes) {
+            if (change.second != nullptr) {
+                put(change.first, std::move(change.second));
+            } else {
+                erase(change.first);
+            }
+        }
+        return changes.size();
+    }
+
+    // Box query over points stored under z_key(prefix, x, y); see z_box_scan.
+    template<typename Fn>
+    ZBoxStats scan_box(const std::vector<uint8_t> &prefix, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+                       Fn &&fn) const {
+        std::shared_lock lock(mutex);
+        return z_box_scan(tree, prefix, x0, y0, x1, y1, fn);
+    }
+
+    size_t size() const {
+        std::shared_lock lock(mutex);
+        return tree.size();
+    }
+
+    void serialize(std::vector<uint8_t> &out) const {
+        std::shared_lock lock(mutex);
+        tree.serialize(out);
+    }
+
+    // Replaces the contents with a snapshot produced by serialize(). The snapshot is decoded
+    // without the lock, and a snapshot that fails to decode changes nothing. With history
+    // enabled the restore is recorded as one write at a single timestamp: every restored entry
+    // gets a version and every key it removes a tombstone, so earlier versions stay queryable.
+    bool restore(const uint8_t *data, size_t len) {
+        RedBlackTree loaded;
+        {
+            std::shared_lock lock(mutex);
+            if (tree.has_digests()) {
+                loaded.enable_digests();
+            }
+        }
+        if (!loaded.deserialize(data, len)) {
+            return false;
+        }
+        std::unique_lock lock(mutex);
+        if (tree.has_digests() && !loaded.has_digests()) {
+            loaded.enable_digests();
+        }
+        if (history_enabled) {
+            uint64_t ts = next_timestamp();
+            for (auto &[key, chain]: history) {
+                ValueRef value;
+                if (chain.back().value != nullptr && !loaded.get_ref(key, value)) {
+                    chain.push_back(Version{ts, nullptr});
+                }
+            }
+            loaded.for_each([this, &loaded, ts](const std::vector<uint8_t> &key, const std::vector<uint8_t> &) {
+                ValueRef value;
+                loaded.get_ref(key, value);
+                history[key].push_back(Version{ts, std::move(value)});
+            });
+        }
+        // The old contents are freed by `loaded` after the lock is released.
+        tree.swap(loaded);
+        return true;
+    }
+
+    // Starts keeping superseded values. Entries already in the tree become versions stamped
+    // with the current time; as-of queries for earlier times see nothing. Versions that were
+    // superseded more than `retention` ago are dropped by compact_history().
+    void enable_history(std::chrono::microseconds retention) {
+        std::unique_lock lock(mutex);
+        retention_us = retention.count();
+        if (history_enabled) {
+            return;
+        }
+        history_enabled = true;
+        uint64_t ts = next_timestamp();
+        tree.for_each([this, ts](const std::vector<uint8_t> &key, const std::vector<uint8_t> &) {
+            ValueRef value;
+            tree.get_ref(key, value);
+            history[key].push_back(Version{ts, std::move(value)});
+        });
+    }
+
+    uint64_t get_last_timestamp() const {
+        std::shared_lock lock(mutex);
+        return last_ts;
+    }
+
+    // Value of `key` as of timestamp `ts`, found by binary search over its versions.
+    bool get_as_of(const std::vector<uint8_t> &key, uint64_t ts, std::vector<uint8_t> &out_value) const {
+        std::shared_lock lock(mutex);
+        auto it = history.find(key);
+        if (it == history.end()) {
+            return false;
+        }
+        const Version *version = version_at(it->second, ts);
+        if (version == nullptr) {
+            return false;
+        }
+        out_value = *version->value;
+        return true;
+    }
+
+    // Copies up to `limit` entries with key >= start as they were at timestamp `ts`.
+    void scan_as_of(const std::vector<uint8_t> &start, uint64_t ts, size_t limit,
+                    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > &out) const {
+        std::shared_lock lock(mutex);
+        for (auto it = history.lower_bound(start); it != history.end() && out.size() < limit; ++it) {
+            const Version *version = version_at(it->second, ts);
+            if (version != nullptr) {
+                out.emplace_back(it->first, *version->value);
+            }
+        }
+    }
+
+    // Drops versions that no as-of query inside the retention window can see: everything
+    // older than the newest version at the horizon, and keys erased before the horizon. Keys
+    // are visited `batch` at a time so writers get the lock in between. Returns the number
+    // of versions dropped.
+    size_t compact_history(size_t batch = 256) {
+        size_t dropped = 0;
+        std::vector<uint8_t> next;
+        bool more = true;
+        while (more) {
+            std::unique_lock lock(mutex);
+            auto horizon_now = std::chrono::system_clock::now().time_since_epoch();
+            uint64_t horizon = std::chrono::duration_cast<std::chrono::microseconds>(horizon_now).count();
+            horizon = horizon > retention_us ? horizon - retention_us : 0;
+            auto it = history.lower_bound(next);
+            for (size_t visited = 0; it != history.end() && visited < batch; visited++) {
+                std::vector<Version> &chain = it->second;
+                auto visible = std::upper_bound(chain.begin(), chain.end(), horizon,
+                                                [](uint64_t t, const Version &version) { return t < version.ts; });
+                if (visible != chain.begin()) {
+                    --visible;
+                    dropped += visible - chain.begin();
+                    chain.erase(chain.begin(), visible);
+                }
+                if (chain.size() == 1 && chain[0].value == nullptr && chain[0].ts <= horizon) {
+                    dropped++;
+                    it = history.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            more = it != history.end();
+            if (more) {
+                next = it->first;
+            }
+        }
+        return dropped;
+    }
+
+    size_t history_versions() const {
+        std::shared_lock lock(mutex);
+        size_t total = 0;
+        for (const auto &[key, chain]: history) {
+            total += chain.size();
+        }
+        return total;
+    }
+
+    // False if compaction is already running.
+    bool start_history_compaction(std::chrono::milliseconds interval) {
+        if (compactor.joinable()) {
+            return false;
+        }
+        compactor = std::thread([this, interval]() {
+            std::unique_lock lock(compactor_mutex);
+            while (!compactor_cv.wait_for(lock, interval, [this]() { return compactor_stopping; })) {
+                lock.unlock();
+                compact_history();
+                lock.lock();
+            }
+        });
+        return true;
+    }
+
+    void stop_history_compaction() {
+        if (!compactor.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard lock(compactor_mutex);
+            compactor_stopping = true;
+        }
+        compactor_cv.notify_all();
+        compactor.join();
+        compactor_stopping = false;
+    }
+
+    // Redis-style BGSAVE: fork() while holding the write lock so the child sees a consistent
+    // tree, then let the child serialize its copy-on-write view. Writers are paused only for
+    // the duration of fork() itself.
+    bool start_background_save(const std::string &path) {
+        std::lock_guard save_lock(save_mutex);
+        if (save_stats.pid > 0) {
+            return false;
+        }
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return false;
+        }
+
+        pid_t pid;
+        size_t keys;
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::unique_lock lock(mutex);
+            keys = tree.size();
+            pid = fork();
+        }
+        auto forked = std::chrono::steady_clock::now();
+
+        if (pid == 0) {
+            // Child: serializes with the allocator and stdio, which glibc keeps usable across
+            // fork(), and leaves with _exit. It never takes the parent's locks; other threads'
+            // locks may have been copied in a held state.
+            close(fds[0]);
+            std::string tmp_path = path + ".tmp";
+            ChildReport report{};
+            report.ok = tree.save_snapshot(tmp_path, &report.bytes_written) &&
+                        rename(tmp_path.c_str(), path.c_str()) == 0;
+            report.cow_bytes = private_dirty_bytes();
+            ssize_t ignored = write(fds[1], &report, sizeof(report));
+            (void) ignored;
+            _exit(report.ok ? 0 : 1);
+        }
+
+        close(fds[1]);
+        if (pid < 0) {
+            close(fds[0]);
+            return false;
+        }
+        save_pipe = fds[0];
+        save_start = start;
+        save_stats = SnapshotStats{};
+        save_stats.pid = pid;
+        save_stats.keys = keys;
+        save_stats.fork_us = std::chrono::duration_cast<std::chrono::microseconds>(forked - start).count();
+        return true;
+    }
+
+    bool background_save_in_progress() {
+        std::lock_guard save_lock(save_mutex);
+        return save_stats.pid > 0;
+    }
+
+    // Waits for the running background save, if any, and reports how it went.
+    bool finish_background_save(SnapshotStats &out_stats) {
+        std::lock_guard save_lock(save_mutex);
+        if (save_stats.pid <= 0) {
+            return false;
+        }
+        ChildReport report{};
+        ssize_t n = read(save_pipe, &report, sizeof(report));
+        close(save_pipe);
+        save_pipe = -1;
+
+        int status = 0;
+        waitpid(save_stats.pid, &status, 0);
+        auto end = std::chrono::steady_clock::now();
+
+        save_stats.ok = n == sizeof(report) && report.ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        save_stats.bytes_written = report.bytes_written;
+        save_stats.cow_bytes = report.cow_bytes;
+        save_stats.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(end - save_start).count();
+        out_stats = save_stats;
+        save_stats.pid = -1;
+        return true;
+    }
+};
+
+enum class JobPriority {
+    Flush = 0,
+    Compaction = 1,
+    Backup = 2
+};
+
+// Token bucket measured in bytes. Callers reserve tokens up front and sleep off any deficit,
+// so concurrent requests are paced in arrival order without holding the lock while waiting.
+class TokenBucketRateLimiter {
+private:
+    mutable std::mutex mutex;
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last_refill;
+    std::atomic<uint64_t> total_bytes{0};
+    std::atomic<uint64_t> total_wait_us{0};
+
+    void refill(std::chrono::steady_clock::time_point now) {
+        double elapsed = std::chrono::duration<double>(now - last_refill).count();
+        tokens = std::min(burst, tokens + elapsed * rate);
+        last_refill = now;
+    }
+
+public:
+    TokenBucketRateLimiter(double bytes_per_sec, double burst_bytes)
+        : rate(bytes_per_sec), burst(burst_bytes), tokens(burst_bytes),
+          last_refill(std::chrono::steady_clock::now()) {
+    }
+
+    void request(size_t bytes) {
+        double deficit;
+        double current_rate;
+        {
+            std::lock_guard lock(mutex);
+            refill(std::chrono::steady_clock::now());
+            tokens -= static_cast<double>(bytes);
+            deficit = -tokens;
+            current_rate = rate;
+        }
+        total_bytes += bytes;
+        if (deficit > 0) {
+            auto wait = std::chrono::microseconds(static_cast<int64_t>(deficit / current_rate * 1e6));
+            std::this_thread::sleep_for(wait);
+            total_wait_us += wait.count();
+        }
+    }
+
+    bool try_request(size_t bytes) {
+        std::lock_guard lock(mutex);
+        refill(std::chrono::steady_clock::now());
+        if (tokens < static_cast<double>(bytes)) {
+            return false;
+        }
+        tokens -= static_cast<double>(bytes);
+        total_bytes += bytes;
+        return true;
+    }
+
+    void set_rate(double bytes_per_sec) {
+        std::lock_guard lock(mutex);
+        refill(std::chrono::steady_clock::now());
+        rate = bytes_per_sec;
+    }
+
+    double get_rate() const {
+        std::lock_guard lock(mutex);
+        return rate;
+    }
+
+    uint64_t get_total_bytes() const {
+        return total_bytes.load();
+    }
+
+    uint64_t get_total_wait_us() const {
+        return total_wait_us.load();
+    }
+};
+
+// Fixed-size window of recent foreground latencies. Recording is a single relaxed store so
+// it can sit on the put/get path.
+class LatencyWindow {
+private:
+    static constexpr size_t WINDOW = 4096;
+    std::atomic<uint64_t> samples[WINDOW];
+    std::atomic<uint64_t> next{0};
+
+public:
+    LatencyWindow() {
+        for (auto &sample: samples) {
+            sample.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t micros) {
+        uint64_t slot = next.fetch_add(1, std::memory_order_relaxed) % WINDOW;
+        samples[slot].store(micros, std::memory_order_relaxed);
+    }
+
+    uint64_t percentile(double p) const {
+        size_t filled = std::min<uint64_t>(next.load(std::memory_order_relaxed), WINDOW);
+        if (filled == 0) {
+            return 0;
+        }
+        std::vector<uint64_t> values(filled);
+        for (size_t i = 0; i < filled; i++) {
+            values[i] = samples[i].load(std::memory_order_relaxed);
+        }
+        size_t rank = std::min(filled - 1, static_cast<size_t>(p * filled));
+        std::nth_element(values.begin(), values.begin() + rank, values.end());
+        return values[rank];
+    }
+};
+
+// Runs flush, compaction, snapshot and backup work on a private thread pool. Jobs are taken
+// strictly by priority (flush first), their I/O goes through a shared token bucket, and the
+// bucket is shrunk whenever foreground p99 latency exceeds its target.
+class BackgroundScheduler {
+public:
+    struct Options {
+        size_t num_threads = 2;
+        double io_bytes_per_sec = 64.0 * 1024 * 1024;
+        double io_burst_bytes = 1024 * 1024;
+        // Foreground p99 above this target halves the I/O rate, down to min_io_bytes_per_sec.
+        uint64_t target_p99_us = 1000;
+        double min_io_bytes_per_sec = 1024 * 1024;
+        std::chrono::milliseconds throttle_interval{100};
+    };
+
+    using Job = std::function<void(TokenBucketRateLimiter &)>;
+
+private:
+    struct QueuedJob {
+        JobPriority priority;
+        uint64_t seq;
+        Job job;
+
+        bool operator<(const QueuedJob &other) const {
+            if (priority != other.priority) {
+                return priority > other.priority;
+            }
+            return seq > other.seq;
+        }
+    };
+
+    Options options;
+    TokenBucketRateLimiter limiter;
+    LatencyWindow foreground;
+    std::priority_queue<QueuedJob> queue;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable idle_cv;
+    // Separate from work_cv so a submit's notify_one always reaches a worker.
+    std::condition_variable throttle_cv;
+    std::vector<std::thread> workers;
+    std::thread throttler;
+    uint64_t next_seq = 0;
+    size_t running = 0;
+    bool stopping = false;
+    std::atomic<uint64_t> throttle_events{0};
+
+    void worker_loop() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            work_cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            Job job = std::move(const_cast<QueuedJob &>(queue.top()).job);
+            queue.pop();
+            running++;
+            lock.unlock();
+            job(limiter);
+            lock.lock();
+            running--;
+            if (running == 0 && queue.empty()) {
+                idle_cv.notify_all();
+            }
+        }
+    }
+
+    void throttle_loop() {
+        std::unique_lock lock(mutex);
+        while (!stopping) {
+            throttle_cv.wait_for(lock, options.throttle_interval);
+            if (stopping) {
+                return;
+            }
+            lock.unlock();
+            adjust_throttle();
+            lock.lock();
+        }
+    }
+
+public:
+    explicit BackgroundScheduler(const Options &opts)
+        : options(opts), limiter(opts.io_bytes_per_sec, opts.io_burst_bytes) {
+        for (size_t i = 0; i < options.num_threads; i++) {
+            workers.emplace_back([this]() { worker_loop(); });
+        }
+        throttler = std::thread([this]() { throttle_loop(); });
+    }
+
+    ~BackgroundScheduler() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        throttle_cv.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        throttler.join();
+    }
+
+    void submit(JobPriority priority, Job job) {
+        {
+            std::lock_guard lock(mutex);
+            queue.push(QueuedJob{priority, next_seq++, std::move(job)});
+        }
+        work_cv.notify_one();
+    }
+
+    void wait_idle() {
+        std::unique_lock lock(mutex);
+        idle_cv.wait(lock, [this]() { return running == 0 && queue.empty(); });
+    }
+
+    void record_foreground_latency(uint64_t micros) {
+        foreground.record(micros);
+    }
+
+    // Multiplicative decrease while foreground p99 is over target, gradual recovery otherwise.
+    void adjust_throttle() {
+        uint64_t p99 = foreground.percentile(0.99);
+        double rate = limiter.get_rate();
+        if (p99 > options.target_p99_us) {
+            double lowered = std::max(options.min_io_bytes_per_sec, rate / 2);
+            if (lowered < rate) {
+                limiter.set_rate(lowered);
+                throttle_events++;
+            }
+        } else if (rate < options.io_bytes_per_sec) {
+            limiter.set_rate(std::min(options.io_bytes_per_sec, rate * 1.25));
+        }
+    }
+
+    uint64_t foreground_p99_us() const {
+        return foreground.percentile(0.99);
+    }
+
+    uint64_t get_throttle_events() const {
+        return throttle_events.load();
+    }
+
+    TokenBucketRateLimiter &rate_limiter() {
+        return limiter;
+    }
+};
+
+// Writes a file in fixed-size chunks, charging each chunk to the rate limiter first.
+static bool write_file_rate_limited(const std::string &path, const std::vector<uint8_t> &data,
+                                    TokenBucketRateLimiter &limiter, size_t chunk_size = 64 * 1024) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t offset = 0; offset < data.size() && ok; offset += chunk_size) {
+        size_t len = std::min(chunk_size, data.size() - offset);
+        limiter.request(len);
+        ok = fwrite(data.data() + offset, 1, len, file) == len;
+    }
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+// Backpressure for writers feeding a memtable flush pipeline. Between the slowdown and stop
+// thresholds writers are paced to a rate that shrinks linearly with the worst pressure signal;
+// at or above any stop threshold they wait until the pipeline catches up.
+class WriteController {
+public:
+    struct Options {
+        size_t slowdown_memtables = 3;
+        size_t stop_memtables = 5;
+        size_t slowdown_pending_bytes = 64 * 1024 * 1024;
+        size_t stop_pending_bytes = 256 * 1024 * 1024;
+        size_t slowdown_l0_files = 8;
+        size_t stop_l0_files = 16;
+        double delayed_write_rate = 16.0 * 1024 * 1024;
+        double min_write_rate = 64 * 1024;
+    };
+
+    enum class State {
+        Normal,
+        Delayed,
+        Stopped
+    };
+
+private:
+    Options options;
+    std::mutex mutex;
+    std::condition_variable resume_cv;
+    State state = State::Normal;
+    double write_rate;
+    // Earliest time the next delayed write may proceed; advanced by bytes / write_rate.
+    std::chrono::steady_clock::time_point next_write_time;
+    std::atomic<uint64_t> stall_us{0};
+    std::atomic<uint64_t> delayed_writes{0};
+    std::atomic<uint64_t> stopped_writes{0};
+
+    // Checked against `stop` first, so equal (or inverted) thresholds go straight from no
+    // pressure to a stop instead of dividing by zero.
+    static double pressure(size_t value, size_t slowdown, size_t stop) {
+        if (value >= stop) {
+            return 1;
+        }
+        if (value < slowdown) {
+            return -1;
+        }
+        return static_cast<double>(value - slowdown) / static_cast<double>(stop - slowdown);
+    }
+
+public:
+    explicit WriteController(const Options &opts)
+        : options(opts), write_rate(opts.delayed_write_rate), next_write_time(std::chrono::steady_clock::now()) {
+    }
+
+    void update(size_t memtables, size_t pending_flush_bytes, size_t l0_files) {
+        double worst = std::max({
+            pressure(memtables, options.slowdown_memtables, options.stop_memtables),
+            pressure(pending_flush_bytes, options.slowdown_pending_bytes, options.stop_pending_bytes),
+            pressure(l0_files, options.slowdown_l0_files, options.stop_l0_files)
+        });
+        std::lock_guard lock(mutex);
+        if (worst >= 1) {
+            state = State::Stopped;
+            return;
+        }
+        if (worst < 0) {
+            state = State::Normal;
+        } else {
+            if (state == State::Normal) {
+                next_write_time = std::chrono::steady_clock::now();
+            }
+            state = State::Delayed;
+            write_rate = std::max(options.min_write_rate, options.delayed_write_rate * (1 - worst));
+        }
+        resume_cv.notify_all();
+    }
+
+    // Called by each writer before applying `bytes`; returns the time it was held back.
+    uint64_t delay_write(size_t bytes) {
+        std::unique_lock lock(mutex);
+        if (state == State::Normal) {
+            return 0;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (state == State::Stopped) {
+            stopped_writes++;
+            resume_cv.wait(lock, [this]() { return state != State::Stopped; });
+            if (state == State::Normal) {
+                uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                stall_us += waited;
+                return waited;
+            }
+        }
+        delayed_writes++;
+        auto now = std::chrono::steady_clock::now();
+        auto slot = std::max(now, next_write_time);
+        next_write_time = slot + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                              std::chrono::duration<double>(bytes / write_rate));
+        lock.unlock();
+        std::this_thread::sleep_until(slot);
+        uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stall_us += waited;
+        return waited;
+    }
+
+    State get_state() {
+        std::lock_guard lock(mutex);
+        return state;
+    }
+
+    double get_write_rate() {
+        std::lock_guard lock(mutex);
+        return write_rate;
+    }
+
+    uint64_t get_stall_us() const {
+        return stall_us.load();
+    }
+
+    uint64_t get_delayed_writes() const {
+        return delayed_writes.load();
+    }
+
+    uint64_t get_stopped_writes() const {
+        return stopped_writes.load();
+    }
+};
+
+// Range-partitioned tree whose shard boundaries move under traffic. Routing goes through an
+// immutable, versioned table that is swapped atomically, so put/get never wait on a global
+// lock. A split or merge locks only the shards it replaces; operations that land on a retired
+// shard simply reload the table and retry.
+class ShardedRedBlackTree {
+public:
+    struct Options {
+        double split_ops_per_sec = 50000;
+        size_t split_min_entries = 1024;
+        size_t max_entries = 1 << 20;
+        double merge_ops_per_sec = 1000;
+    };
+
+    struct ShardStats {
+        std::vector<uint8_t> lower_bound;
+        size_t entries;
+        double ops_per_sec;
+        double bytes_per_sec;
+    };
+
+private:
+    struct Shard {
+        RedBlackTree tree;
+        mutable std::shared_mutex mutex;
+        bool retired = false;
+        std::atomic<uint64_t> ops{0};
+        std::atomic<uint64_t> bytes{0};
+        // Counters at the previous rebalance pass, used to derive rates. The rates are read by
+        // stats() while the monitor updates them.
+        uint64_t sampled_ops = 0;
+        uint64_t sampled_bytes = 0;
+        std::atomic<double> ops_per_sec{0};
+        std::atomic<double> bytes_per_sec{0};
+        // While a split is pending, puts count the new keys they add below split_key.
+        bool splitting = false;
+        std::vector<uint8_t> split_key;
+        size_t below_split = 0;
+    };
+
+    struct RoutingTable {
+        uint64_t version;
+        // lower_bounds[i] is the smallest key owned by shards[i]; lower_bounds[0] is empty.
+        std::vector<std::vector<uint8_t>> lower_bounds;
+        std::vector<std::shared_ptr<Shard>> shards;
+
+        size_t route(const std::vector<uint8_t> &key) const {
+            size_t lo = 1;
+            size_t hi = lower_bounds.size();
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (compare_keys(key, lower_bounds[mid]) < 0) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            return lo - 1;
+        }
+    };
+
+    Options options;
+    // Accessed only through load_routing() and store_routing().
+    std::shared_ptr<const RoutingTable> routing;
+    std::mutex rebalance_mutex;
+    std::chrono::steady_clock::time_point last_sample;
+    std::atomic<uint64_t> splits{0};
+    std::atomic<uint64_t> merges{0};
+
+    std::thread monitor;
+    std::mutex monitor_mutex;
+    std::condition_variable monitor_cv;
+    bool monitor_stopping = false;
+
+    std::shared_ptr<const RoutingTable> load_routing() const {
+        return std::atomic_load(&routing);
+    }
+
+    void store_routing(std::shared_ptr<const RoutingTable> table) {
+        std::atomic_store(&routing, std::move(table));
+    }
+
+    // Replaces shards [first, first + count) of `table` with `replacement`.
+    void publish(const RoutingTable &table, size_t first, size_t count,
+                 std::vector<std::vector<uint8_t>> bounds, std::vector<std::shared_ptr<Shard>> replacement) {
+        auto next = std::make_shared<RoutingTable>();
+        next->version = table.version + 1;
+        for (size_t i = 0; i < first; i++) {
+            next->lower_bounds.push_back(table.lower_bounds[i]);
+            next->shards.push_back(table.shards[i]);
+        }
+        for (size_t i = 0; i < replacement.size(); i++) {
+            next->lower_bounds.push_back(std::move(bounds[i]));
+            next->shards.push_back(std::move(replacement[i]));
+        }
+        for (size_t i = first + count; i < table.shards.size(); i++) {
+            next->lower_bounds.push_back(table.lower_bounds[i]);
+            next->shards.push_back(table.shards[i]);
+        }
+        store_routing(std::move(next));
+    }
+
+    // The median is found under the shared lock, so only readers run alongside the walk. The
+    // exclusive lock is then held just long enough to cut the tree in two, moving its nodes.
+    bool split_shard(const RoutingTable &table, size_t index) {
+        Shard &shard = *table.shards[index];
+        {
+            std::shared_lock lock(shard.mutex);
+            if (shard.retired || shard.tree.size() < 2) {
+                return false;
+            }
+            // No writer holds the lock, so the split fields can be set here.
+            size_t half = shard.tree.size() / 2;
+            size_t seen = 0;
+            shard.tree.scan({}, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &) {
+                if (seen++ < half) {
+                    return true;
+                }
+                shard.split_key = key;
+                return false;
+            });
+            shard.below_split = half;
+            shard.splitting = true;
+        }
+        std::unique_lock lock(shard.mutex);
+        shard.splitting = false;
+        auto left = std::make_shared<Shard>();
+        auto right = std::make_shared<Shard>();
+        shard.tree.split_at(shard.split_key, shard.below_split, right->tree);
+        left->tree.append(shard.tree);
+        publish(table, index, 1, {table.lower_bounds[index], shard.split_key}, {left, right});
+        shard.retired = true;
+        splits++;
+        return true;
+    }
+
+    bool merge_shards(const RoutingTable &table, size_t index) {
+        Shard &first = *table.shards[index];
+        Shard &second = *table.shards[index + 1];
+        std::unique_lock first_lock(first.mutex);
+        std::unique_lock second_lock(second.mutex);
+        if (first.retired || second.retired) {
+            return false;
+        }
+        auto merged = std::make_shared<Shard>();
+        merged->tree.append(first.tree);
+        merged->tree.append(second.tree);
+        publish(table, index, 2, {table.lower_bounds[index]}, {merged});
+        first.retired = true;
+        second.retired = true;
+        merges++;
+        return true;
+    }
+
+public:
+    ShardedRedBlackTree() : ShardedRedBlackTree(Options()) {
+    }
+
+    explicit ShardedRedBlackTree(const Options &opts) : options(opts) {
+        auto table = std::make_shared<RoutingTable>();
+        table->version = 1;
+        table->lower_bounds.emplace_back();
+        table->shards.push_back(std::make_shared<Shard>());
+        store_routing(std::move(table));
+        last_sample = std::chrono::steady_clock::now();
+    }
+
+    ~ShardedRedBlackTree() {
+        stop_monitor();
+    }
+
+    void put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        while (true) {
+            auto table = load_routing();
+            Shard &shard = *table->shards[table->route(key)];
+            std::unique_lock lock(shard.mutex);
+            if (shard.retired) {
+                continue;
+            }
+            size_t before = shard.tree.size();
+            shard.tree.put(key, value);
+            if (shard.splitting && shard.tree.size() > before && compare_keys(key, shard.split_key) < 0) {
+                shard.below_split++;
+            }
+            shard.ops.fetch_add(1, std::memory_order_relaxed);
+            shard.bytes.fetch_add(key.size() + value.size(), std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) const {
+        while (true) {
+            auto table = load_routing();
+            Shard &shard = *table->shards[table->route(key)];
+            std::shared_lock lock(shard.mutex);
+            if (shard.retired) {
+                continue;
+            }
+            bool found = shard.tree.get(key, out_value);
+            shard.ops.fetch_add(1, std::memory_order_relaxed);
+            shard.bytes.fetch_add(key.size() + (found ? out_value.size() : 0), std::memory_order_relaxed);
+            return found;
+        }
+    }
+
+    // One monitoring pass: refresh per-shard rates, split hot or oversized shards and merge
+    // adjacent cold ones.
+    void rebalance() {
+        std::lock_guard rebalance_lock(rebalance_mutex);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_sample).count();
+        last_sample = now;
+        if (elapsed <= 0) {
+            return;
+        }
+
+        auto table = load_routing();
+        std::vector<size_t> entries(table->shards.size());
+        for (size_t i = 0; i < table->shards.size(); i++) {
+            Shard &shard = *table->shards[i];
+            uint64_t ops = shard.ops.load(std::memory_order_relaxed);
+            uint64_t bytes = shard.bytes.load(std::memory_order_relaxed);
+            shard.ops_per_sec.store((ops - shard.sampled_ops) / elapsed, std::memory_order_relaxed);
+            shard.bytes_per_sec.store((bytes - shard.sampled_bytes) / elapsed, std::memory_order_relaxed);
+            shard.sampled_ops = ops;
+            shard.sampled_bytes = bytes;
+            std::shared_lock lock(shard.mutex);
+            entries[i] = shard.tree.size();
+        }
+
+        for (size_t i = 0; i < table->shards.size(); i++) {
+            const Shard &shard = *table->shards[i];
+            bool hot = shard.ops_per_sec > options.split_ops_per_sec && entries[i] >= options.split_min_entries;
+            if (hot || entries[i] > options.max_entries) {
+                split_shard(*table, i);
+                return;
+            }
+        }
+        for (size_t i = 0; i + 1 < table->shards.size(); i++) {
+            const Shard &first = *table->shards[i];
+            const Shard &second = *table->shards[i + 1];
+            if (first.ops_per_sec < options.merge_ops_per_sec && second.ops_per_sec < options.merge_ops_per_sec &&
+                entries[i] + entries[i + 1] <= options.max_entries / 2) {
+                merge_shards(*table, i);
+                return;
+            }
+        }
+    }
+
+    void start_monitor(std::chrono::milliseconds interval) {
+        monitor = std::thread([this, interval]() {
+            std::unique_lock lock(monitor_mutex);
+            while (!monitor_cv.wait_for(lock, interval, [this]() { return monitor_stopping; })) {
+                lock.unlock();
+                rebalance();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop_monitor() {
+        if (!monitor.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard lock(monitor_mutex);
+            monitor_stopping = true;
+        }
+        monitor_cv.notify_all();
+        monitor.join();
+        monitor_stopping = false;
+    }
+
+    std::vector<ShardStats> stats() const {
+        auto table = load_routing();
+        std::vector<ShardStats> result;
+        for (size_t i = 0; i < table->shards.size(); i++) {
+            const Shard &shard = *table->shards[i];
+            std::shared_lock lock(shard.mutex);
+            result.push_back(ShardStats{table->lower_bounds[i], shard.tree.size(),
+                                        shard.ops_per_sec.load(std::memory_order_relaxed),
+                                        shard.bytes_per_sec.load(std::memory_order_relaxed)});
+        }
+        return result;
+    }
+
+    size_t shard_count() const {
+        return load_routing()->shards.size();
+    }
+
+    uint64_t routing_version() const {
+        return load_routing()->version;
+    }
+
+    uint64_t get_splits() const {
+        return splits.load();
+    }
+
+    uint64_t get_merges() const {
+        return merges.load();
+    }
+};
+
+enum class WireOp : uint8_t {
+    MultiGet = 1,
+    PutBatch = 2,
+    Erase = 3,
+    // entries[0].key is the start key, entries[0].value holds a u32 entry limit.
+    Scan = 4,
+    // entries[0].key is a procedure name, the values of entries[1..] are its arguments.
+    Call = 5,
+    // Like PutBatch, but leaves keys that already exist untouched.
+    PutIfAbsent = 6
+};
+
+enum class WireStatus : uint8_t {
+    Ok = 0,
+    Error = 1
+};
+
+struct WireEntry {
+    std::vector<uint8_t> key;
+    std::vector<uint8_t> value;
+    bool found = false;
+};
+
+// One request or response frame: [u32 payload_len][u8 code][u32 count] followed by `count`
+// entries of [u8 found][u32 key_len][key][u32 value_len][value]. `code` is a WireOp for
+// requests and a WireStatus for responses.
+struct WireMessage {
+    uint8_t code = 0;
+    std::vector<WireEntry> entries;
+};
+
+static void append_u32(std::vector<uint8_t> &out, uint32_t value) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+static uint32_t load_u32(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static void append_u64(std::vector<uint8_t> &out, uint64_t value) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+static uint64_t load_u64(const uint8_t *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static void encode_message(const WireMessage &message, std::vector<uint8_t> &out) {
+    size_t frame_start = out.size();
+    append_u32(out, 0);
+    out.push_back(message.code);
+    append_u32(out, message.entries.size());
+    for (const WireEntry &entry: message.entries) {
+        out.push_back(entry.found ? 1 : 0);
+        append_u32(out, entry.key.size());
+        out.insert(out.end(), entry.key.begin(), entry.key.end());
+        append_u32(out, entry.value.size());
+        out.insert(out.end(), entry.value.begin(), entry.value.end());
+    }
+    uint32_t payload_len = out.size() - frame_start - sizeof(uint32_t);
+    memcpy(out.data() + frame_start, &payload_len, sizeof(payload_len));
+}
+
+static bool decode_message(const uint8_t *data, size_t len, WireMessage &message) {
+    if (len < 5) {
+        return false;
+    }
+    message.code = data[0];
+    uint32_t count = load_u32(data + 1);
+    size_t offset = 5;
+    message.entries.clear();
+    message.entries.reserve(std::min<size_t>(count, len / 9));
+    for (uint32_t i = 0; i < count; i++) {
+        WireEntry entry;
+        if (len - offset < 5) {
+            return false;
+        }
+        entry.found = data[offset] != 0;
+        uint32_t key_len = load_u32(data + offset + 1);
+        offset += 5;
+        if (len - offset < key_len + sizeof(uint32_t)) {
+            return false;
+        }
+        entry.key.assign(data + offset, data + offset + key_len);
+        offset += key_len;
+        uint32_t value_len = load_u32(data + offset);
+        offset += sizeof(uint32_t);
+        if (len - offset < value_len) {
+            return false;
+        }
+        entry.value.assign(data + offset, data + offset + value_len);
+        offset += value_len;
+        message.entries.push_back(std::move(entry));
+    }
+    return offset == len;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (len > 0) {
+        ssize_t n = send(fd, bytes, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Sends every byte described by `iov`, at most IOV_MAX segments per sendmsg call. Consumes
+// `iov` as it goes.
+static bool sendmsg_all(int fd, std::vector<iovec> &iov) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        msghdr message{};
+        message.msg_iov = iov.data() + first;
+        message.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        size_t sent = n;
+        while (first < iov.size() && sent >= iov[first].iov_len) {
+            sent -= iov[first].iov_len;
+            first++;
+        }
+        if (sent > 0) {
+            iov[first].iov_base = static_cast<uint8_t *>(iov[first].iov_base) + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t len) {
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    while (len > 0) {
+        ssize_t n = recv(fd, bytes, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
+static const uint32_t MAX_FRAME_BYTES = 256 * 1024 * 1024;
+
+static bool read_message(int fd, WireMessage &message, std::vector<uint8_t> &buffer) {
+    uint32_t payload_len;
+    if (!read_all(fd, &payload_len, sizeof(payload_len)) || payload_len > MAX_FRAME_BYTES) {
+        return false;
+    }
+    buffer.resize(payload_len);
+    return read_all(fd, buffer.data(), payload_len) && decode_message(buffer.data(), payload_len, message);
+}
+
+static bool send_message(int fd, const WireMessage &message) {
+    std::vector<uint8_t> frame;
+    encode_message(message, frame);
+    return write_all(fd, frame.data(), frame.size());
+}
+
+static int listen_unix(const std::string &path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_unix(const std::string &path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Stored procedure bytecode. Every stack slot is a byte string; arithmetic treats a slot as
+// a little-endian u64 (shorter strings are zero-extended) and pushes 8-byte results.
+enum class ProcedureOp : uint8_t {
+    PushConst,  // push constants[operand]
+    PushArg,    // push args[operand]
+    Dup,
+    Pop,
+    Swap,
+    Concat,     // a b -> a+b
+    Get,        // key -> value, empty if missing
+    Exists,     // key -> 1 or 0
+    Put,        // key value ->
+    Erase,      // key ->
+    Add,        // a b -> a+b
+    Sub,        // a b -> a-b
+    Less,       // a b -> a<b
+    Jump,       // continue at operand
+    JumpIfZero, // pop; continue at operand if it was zero
+    Abort,      // fail and discard all writes
+    Return      // pop the result and commit all writes
+};
+
+struct ProcedureInstruction {
+    ProcedureOp op;
+    uint32_t operand = 0;
+};
+
+struct Procedure {
+    std::vector<ProcedureInstruction> code;
+    std::vector<std::vector<uint8_t> > constants;
+    size_t max_steps = 10000;
+    size_t max_stack = 256;
+    // Bytes held on the stack plus buffered writes, so a Dup/Concat loop cannot grow a value
+    // without bound.
+    size_t max_bytes = 1 << 20;
+};
+
+// Rejects procedures with out-of-range jumps or constants.
+static bool validate_procedure(const Procedure &procedure) {
+    for (const ProcedureInstruction &instruction: procedure.code) {
+        bool jump = instruction.op == ProcedureOp::Jump || instruction.op == ProcedureOp::JumpIfZero;
+        if ((jump && instruction.operand >= procedure.code.size()) ||
+            (instruction.op == ProcedureOp::PushConst && instruction.operand >= procedure.constants.size())) {
+            return false;
+        }
+    }
+    return !procedure.code.empty();
+}
+
+static uint64_t procedure_number(const std::vector<uint8_t> &slot) {
+    uint8_t bytes[sizeof(uint64_t)] = {};
+    if (!slot.empty()) {
+        memcpy(bytes, slot.data(), std::min(slot.size(), sizeof(bytes)));
+    }
+    return load_u64(bytes);
+}
+
+static std::vector<uint8_t> procedure_slot(uint64_t number) {
+    std::vector<uint8_t> slot;
+    append_u64(slot, number);
+    return slot;
+}
+
+// Runs a validated procedure against `tree`, which the caller holds exclusively. Writes are
+// buffered in `writes` for the caller to apply when this returns true; Abort, a bad argument
+// index, a stack fault or running out of steps or bytes returns false.
+static bool run_procedure(const Procedure &procedure, const RedBlackTree &tree,
+                          const std::vector<std::vector<uint8_t> > &args, std::vector<uint8_t> &result,
+                          ConcurrentRedBlackTree::WriteSet &writes) {
+    auto read = [&](const std::vector<uint8_t> &key, std::vector<uint8_t> &value) {
+        auto it = writes.find(key);
+        if (it != writes.end()) {
+            value = it->second.second;
+            return it->second.first;
+        }
+        value.clear();
+        return tree.get(key, value);
+    };
+
+    std::vector<std::vector<uint8_t> > stack;
+    size_t bytes = 0;
+    size_t pc = 0;
+    for (size_t steps = 0; steps < procedure.max_steps && pc < procedure.code.size(); steps++) {
+        const ProcedureInstruction &instruction = procedure.code[pc++];
+        size_t pops = 0;
+        switch (instruction.op) {
+            case ProcedureOp::Dup:
+            case ProcedureOp::Pop:
+            case ProcedureOp::Get:
+            case ProcedureOp::Exists:
+            case ProcedureOp::Erase:
+            case ProcedureOp::JumpIfZero:
+            case ProcedureOp::Return:
+                pops = 1;
+                break;
+            case ProcedureOp::Swap:
+            case ProcedureOp::Concat:
+            case ProcedureOp::Put:
+            case ProcedureOp::Add:
+            case ProcedureOp::Sub:
+            case ProcedureOp::Less:
+                pops = 2;
+                break;
+            default:
+                break;
+        }
+        if (stack.size() < pops) {
+            return false;
+        }
+        // Charge the slots this instruction replaces against what it leaves behind.
+        size_t base = stack.size() - pops;
+        for (size_t i = base; i < stack.size(); i++) {
+            bytes -= stack[i].size();
+        }
+        size_t top = stack.size() - 1;
+        switch (instruction.op) {
+            case ProcedureOp::PushConst:
+                stack.push_back(procedure.constants[instruction.operand]);
+                break;
+            case ProcedureOp::PushArg:
+                if (instruction.operand >= args.size()) {
+                    return false;
+                }
+                stack.push_back(args[instruction.operand]);
+                break;
+            case ProcedureOp::Dup:
+                stack.push_back(stack[top]);
+                break;
+            case ProcedureOp::Pop:
+                stack.pop_back();
+                break;
+            case ProcedureOp::Swap:
+                std::swap(stack[top], stack[top - 1]);
+                break;
+            case ProcedureOp::Concat:
+                stack[top - 1].insert(stack[top - 1].end(), stack[top].begin(), stack[top].end());
+                stack.pop_back();
+                break;
+            case ProcedureOp::Get: {
+                std::vector<uint8_t> value;
+                read(stack[top], value);
+                stack[top] = std::move(value);
+                break;
+            }
+            case ProcedureOp::Exists: {
+                std::vector<uint8_t> value;
+                stack[top] = procedure_slot(read(stack[top], value) ? 1 : 0);
+                break;
+            }
+            case ProcedureOp::Put:
+                bytes += stack[top - 1].size() + stack[top].size();
+                writes[std::move(stack[top - 1])] = {true, std::move(stack[top])};
+                stack.resize(top - 1);
+                break;
+            case ProcedureOp::Erase:
+                bytes += stack[top].size();
+                writes[std::move(stack[top])] = {false, {}};
+                stack.pop_back();
+                break;
+            case ProcedureOp::Add:
+            case ProcedureOp::Sub:
+            case ProcedureOp::Less: {
+                uint64_t a = procedure_number(stack[top - 1]);
+                uint64_t b = procedure_number(stack[top]);
+                uint64_t value = instruction.op == ProcedureOp::Add ? a + b :
+                                 instruction.op == ProcedureOp::Sub ? a - b : (a < b ? 1 : 0);
+                stack.pop_back();
+                stack[top - 1] = procedure_slot(value);
+                break;
+            }
+            case ProcedureOp::Jump:
+                pc = instruction.operand;
+                break;
+            case ProcedureOp::JumpIfZero: {
+                bool zero = procedure_number(stack[top]) == 0;
+                stack.pop_back();
+                if (zero) {
+                    pc = instruction.operand;
+                }
+                break;
+            }
+            case ProcedureOp::Abort:
+                return false;
+            case ProcedureOp::Return:
+                result = std::move(stack[top]);
+                return true;
+        }
+        for (size_t i = std::min(base, stack.size()); i < stack.size(); i++) {
+            bytes += stack[i].size();
+        }
+        if (stack.size() > procedure.max_stack || bytes > procedure.max_bytes) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// A tenant owns every key starting with `prefix`. Zero rates mean unlimited.
+struct TenantPolicy {
+    std::vector<uint8_t> prefix;
+    double ops_per_sec = 0;
+    double bytes_per_sec = 0;
+    double weight = 1;
+};
+
+struct TenantStats {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t throttled_us;
+};
+
+// Self-clocked weighted fair queueing in front of the tree. A request from tenant t with cost
+// c gets the finish tag max(virtual_time, last_finish[t]) + c / weight[t]; at most `slots`
+// requests run at once and a free slot always goes to the smallest waiting tag. Dispatching
+// a request advances virtual_time to its tag.
+class WeightedFairQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t slots;
+    size_t running = 0;
+    double virtual_time = 0;
+    std::vector<double> weights;
+    std::vector<double> last_finish;
+    std::set<std::pair<double, uint64_t> > waiting;
+    uint64_t next_ticket = 0;
+
+public:
+    WeightedFairQueue(const std::vector<double> &tenant_weights, size_t max_running)
+        : slots(max_running), weights(tenant_weights), last_finish(tenant_weights.size(), 0) {
+    }
+
+    void acquire(size_t tenant, double cost) {
+        std::unique_lock lock(mutex);
+        double finish = std::max(virtual_time, last_finish[tenant]) + cost / weights[tenant];
+        last_finish[tenant] = finish;
+        auto tag = std::make_pair(finish, next_ticket++);
+        waiting.insert(tag);
+        cv.wait(lock, [&]() { return running < slots && *waiting.begin() == tag; });
+        waiting.erase(waiting.begin());
+        virtual_time = finish;
+        running++;
+        cv.notify_all();
+    }
+
+    void release() {
+        {
+            std::lock_guard lock(mutex);
+            running--;
+        }
+        cv.notify_all();
+    }
+};
+
+// Serves a ConcurrentRedBlackTree over an already listening stream socket, one thread per
+// connection. Requests on a connection are answered in order. When tenants are configured,
+// every request is first paced by its tenant's ops/sec and bytes/sec quotas (response bytes
+// are charged after sending) and then runs through a WeightedFairQueue. Scans always run in
+// chunks of `scan_chunk_entries`, releasing the tree lock and queueing again between chunks.
+class YtdbServer {
+public:
+    struct Options {
+        bool gather_values = true;
+        size_t scan_chunk_entries = 256;
+        std::vector<TenantPolicy> tenants;
+        // Requests let through the fair queue at once; gets only share the tree lock, so one
+        // per core keeps the server from serializing them.
+        size_t max_concurrent_requests = std::max(1u, std::thread::hardware_concurrency());
+    };
+
+private:
+    struct Tenant {
+        TenantPolicy policy;
+        std::unique_ptr<TokenBucketRateLimiter> ops;
+        std::unique_ptr<TokenBucketRateLimiter> bytes;
+    };
+
+    ConcurrentRedBlackTree &tree;
+    Options options;
+    // Configured tenants, followed by an unlimited default tenant for unmatched keys.
+    std::vector<Tenant> tenants;
+    // Usage per tenant, counted whether or not the tenant has quotas.
+    std::vector<std::atomic<uint64_t> > charged_ops;
+    std::vector<std::atomic<uint64_t> > charged_bytes;
+    std::unique_ptr<WeightedFairQueue> fair_queue;
+    std::shared_mutex procedures_mutex;
+    std::map<std::string, Procedure> procedures;
+    int listen_fd = -1;
+    std::mutex mutex;
+    struct Connection {
+        int fd;
+        std::thread handler;
+        std::atomic<bool> done{false};
+    };
+    std::list<std::unique_ptr<Connection> > connections;
+    std::atomic<bool> stopping{false};
+
+    // Joins handlers whose clients have gone away. Caller holds `mutex`.
+    void reap_connections() {
+        for (auto it = connections.begin(); it != connections.end();) {
+            if ((*it)->done.load()) {
+                (*it)->handler.join();
+                close((*it)->fd);
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    size_t tenant_of(const WireMessage &request) const {
+        size_t best = tenants.size() - 1;
+        size_t best_len = 0;
+        // A procedure call belongs to the tenant of its first argument.
+        size_t first = static_cast<WireOp>(request.code) == WireOp::Call ? 1 : 0;
+        if (request.entries.size() <= first) {
+            return best;
+        }
+        const std::vector<uint8_t> &key = first == 0 ? request.entries[0].key : request.entries[1].value;
+        for (size_t i = 0; i + 1 < tenants.size(); i++) {
+            const std::vector<uint8_t> &prefix = tenants[i].policy.prefix;
+            if (prefix.size() >= best_len && prefix.size() <= key.size() &&
+                std::equal(prefix.begin(), prefix.end(), key.begin())) {
+                best = i;
+                best_len = prefix.size();
+            }
+        }
+        return best;
+    }
+
+    void charge(size_t tenant, size_t ops, size_t bytes) {
+        charged_ops[tenant].fetch_add(ops, std::memory_order_relaxed);
+        charged_bytes[tenant].fetch_add(bytes, std::memory_order_relaxed);
+        if (tenants[tenant].ops) {
+            tenants[tenant].ops->request(ops);
+        }
+        if (tenants[tenant].bytes) {
+            tenants[tenant].bytes->request(bytes);
+        }
+    }
+
+    void enter(size_t tenant, double cost) {
+        if (fair_queue) {
+            fair_queue->acquire(tenant, cost);
+        }
+    }
+
+    void leave() {
+        if (fair_queue) {
+            fair_queue->release();
+        }
+    }
+
+    void handle(const WireMessage &request, WireMessage &response, size_t tenant) {
+        response.code = static_cast<uint8_t>(WireStatus::Ok);
+        response.entries.clear();
+        switch (static_cast<WireOp>(request.code)) {
+            case WireOp::MultiGet:
+                response.entries.resize(request.entries.size());
+                enter(tenant, request.entries.size());
+                for (size_t i = 0; i < request.entries.size(); i++) {
+                    response.entries[i].found = tree.get(request.entries[i].key, response.entries[i].value);
+                }
+                leave();
+                break;
+            case WireOp::PutBatch:
+                enter(tenant, request.entries.size());
+                for (const WireEntry &entry: request.entries) {
+                    tree.put(entry.key, entry.value);
+                }
+                leave();
+                break;
+            case WireOp::PutIfAbsent:
+                response.entries.resize(request.entries.size());
+                enter(tenant, request.entries.size());
+                for (size_t i = 0; i < request.entries.size(); i++) {
+                    response.entries[i].found = !tree.put_if_absent(request.entries[i].key, request.entries[i].value);
+                }
+                leave();
+                break;
+            case WireOp::Erase:
+                response.entries.resize(request.entries.size());
+                enter(tenant, request.entries.size());
+                for (size_t i = 0; i < request.entries.size(); i++) {
+                    response.entries[i].found = tree.erase(request.entries[i].key);
+                }
+                leave();
+                break;
+            case WireOp::Scan: {
+                if (request.entries.size() != 1 || request.entries[0].value.size() != sizeof(uint32_t)) {
+                    response.code = static_cast<uint8_t>(WireStatus::Error);
+                    break;
+                }
+                std::vector<uint8_t> start = request.entries[0].key;
+                size_t remaining = load_u32(request.entries[0].value.data());
+                std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > entries;
+                while (remaining > 0) {
+                    size_t chunk = std::min(remaining, options.scan_chunk_entries);
+                    entries.clear();
+                    enter(tenant, chunk);
+                    tree.scan(start, chunk, entries);
+                    leave();
+                    if (entries.empty()) {
+                        break;
+                    }
+                    // The smallest key after the last one returned.
+                    start = entries.back().first;
+                    start.push_back(0);
+                    remaining = entries.size() < chunk ? 0 : remaining - chunk;
+                    for (auto &[key, value]: entries) {
+                        response.entries.push_back(WireEntry{std::move(key), std::move(value), true});
+                    }
+                }
+                break;
+            }
+            case WireOp::Call: {
+                std::shared_lock lock(procedures_mutex);
+                auto it = request.entries.empty() ? procedures.end() :
+                          procedures.find(std::string(request.entries[0].key.begin(), request.entries[0].key.end()));
+                if (it == procedures.end()) {
+                    response.code = static_cast<uint8_t>(WireStatus::Error);
+                    break;
+                }
+                std::vector<std::vector<uint8_t> > args;
+                for (size_t i = 1; i < request.entries.size(); i++) {
+                    args.push_back(request.entries[i].value);
+                }
+                WireEntry result;
+                enter(tenant, request.entries.size());
+                result.found = tree.transact([&](const RedBlackTree &t, ConcurrentRedBlackTree::WriteSet &writes) {
+                    return run_procedure(it->second, t, args, result.value, writes);
+                });
+                leave();
+                if (!result.found) {
+                    response.code = static_cast<uint8_t>(WireStatus::Error);
+                    break;
+                }
+                response.entries.push_back(std::move(result));
+                break;
+            }
+            default:
+                response.code = static_cast<uint8_t>(WireStatus::Error);
+                break;
+        }
+    }
+
+    // Answers a MultiGet without copying values: the frame is gathered by sendmsg from a
+    // buffer of entry headers and the tree's own value buffers, which `values` keeps alive
+    // until the send has returned.
+    bool send_multi_get(int fd, const WireMessage &request, size_t tenant, std::vector<uint8_t> &headers,
+                        std::vector<ValueRef> &values, std::vector<iovec> &iov) {
+        const size_t frame_header = 9;
+        const size_t entry_header = 9;
+        size_t count = request.entries.size();
+        values.assign(count, nullptr);
+        headers.clear();
+        append_u32(headers, 0);
+        headers.push_back(static_cast<uint8_t>(WireStatus::Ok));
+        append_u32(headers, count);
+        size_t payload_len = headers.size() - sizeof(uint32_t);
+        enter(tenant, count);
+        for (size_t i = 0; i < count; i++) {
+            bool found = tree.get_ref(request.entries[i].key, values[i]);
+            size_t value_len = found ? values[i]->size() : 0;
+            headers.push_back(found ? 1 : 0);
+            append_u32(headers, 0);
+            append_u32(headers, value_len);
+            payload_len += entry_header + value_len;
+        }
+        leave();
+        if (payload_len > MAX_FRAME_BYTES) {
+            return false;
+        }
+        uint32_t len = payload_len;
+        memcpy(headers.data(), &len, sizeof(len));
+
+        // Consecutive headers stay in one segment; each non-empty value gets its own.
+        iov.clear();
+        size_t run_start = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t header_end = frame_header + (i + 1) * entry_header;
+            if (values[i] != nullptr && !values[i]->empty()) {
+                iov.push_back(iovec{headers.data() + run_start, header_end - run_start});
+                iov.push_back(iovec{const_cast<uint8_t *>(values[i]->data()), values[i]->size()});
+                run_start = header_end;
+            }
+        }
+        if (run_start < headers.size()) {
+            iov.push_back(iovec{headers.data() + run_start, headers.size() - run_start});
+        }
+        bool ok = sendmsg_all(fd, iov);
+        values.clear();
+        charge(tenant, 0, payload_len);
+        return ok;
+    }
+
+    void serve_connection(int fd) {
+        WireMessage request;
+        WireMessage response;
+        std::vector<uint8_t> buffer;
+        std::vector<uint8_t> frame;
+        std::vector<ValueRef> values;
+        std::vector<iovec> iov;
+        while (read_message(fd, request, buffer)) {
+            size_t tenant = tenant_of(request);
+            charge(tenant, request.entries.size(), buffer.size());
+            if (options.gather_values && static_cast<WireOp>(request.code) == WireOp::MultiGet) {
+                if (!send_multi_get(fd, request, tenant, frame, values, iov)) {
+                    break;
+                }
+                continue;
+            }
+            handle(request, response, tenant);
+            frame.clear();
+            encode_message(response, frame);
+            if (!write_all(fd, frame.data(), frame.size())) {
+                break;
+            }
+            // Scanned entries count as ops too.
+            size_t scanned = static_cast<WireOp>(request.code) == WireOp::Scan ? response.entries.size() : 0;
+            charge(tenant, scanned, frame.size());
+        }
+    }
+
+public:
+    // With `gather_values` off, MultiGet values are copied into the response frame like every
+    // other response.
+    YtdbServer(ConcurrentRedBlackTree &t, const Options &opts) : tree(t), options(opts) {
+        std::vector<double> weights;
+        for (const TenantPolicy &policy: options.tenants) {
+            Tenant tenant;
+            tenant.policy = policy;
+            // Quotas allow bursts of a tenth of a second.
+            if (policy.ops_per_sec > 0) {
+                tenant.ops = std::make_unique<TokenBucketRateLimiter>(policy.ops_per_sec, policy.ops_per_sec / 10);
+            }
+            if (policy.bytes_per_sec > 0) {
+                tenant.bytes = std::make_unique<TokenBucketRateLimiter>(policy.bytes_per_sec,
+                                                                        policy.bytes_per_sec / 10);
+            }
+            tenants.push_back(std::move(tenant));
+            weights.push_back(policy.weight);
+        }
+        tenants.push_back(Tenant{});
+        weights.push_back(1);
+        charged_ops = std::vector<std::atomic<uint64_t> >(tenants.size());
+        charged_bytes = std::vector<std::atomic<uint64_t> >(tenants.size());
+        if (!options.tenants.empty()) {
+            fair_queue = std::make_unique<WeightedFairQueue>(weights,
+                                                             std::max<size_t>(1, options.max_concurrent_requests));
+        }
+    }
+
+    explicit YtdbServer(ConcurrentRedBlackTree &t) : YtdbServer(t, Options()) {
+    }
+
+    // Makes `procedure` callable as `name` through WireOp::Call, replacing any previous one.
+    bool register_procedure(const std::string &name, const Procedure &procedure) {
+        if (!validate_procedure(procedure)) {
+            return false;
+        }
+        std::unique_lock lock(procedures_mutex);
+        procedures[name] = procedure;
+        return true;
+    }
+
+    ~YtdbServer() {
+        stop();
+    }
+
+    // Blocks accepting connections until stop() is called or the socket fails.
+    void serve(int fd) {
+        listen_fd = fd;
+        while (!stopping.load()) {
+            int client = accept(listen_fd, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            std::lock_guard lock(mutex);
+            if (stopping.load()) {
+                close(client);
+                break;
+            }
+            reap_connections();
+            connections.emplace_back(new Connection());
+            Connection *connection = connections.back().get();
+            connection->fd = client;
+            connection->handler = std::thread([this, connection]() {
+                serve_connection(connection->fd);
+                connection->done = true;
+            });
+        }
+    }
+
+    void stop() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        if (listen_fd >= 0) {
+            shutdown(listen_fd, SHUT_RDWR);
+        }
+        std::lock_guard lock(mutex);
+        for (auto &connection: connections) {
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+        for (auto &connection: connections) {
+            connection->handler.join();
+            close(connection->fd);
+        }
+        connections.clear();
+    }
+
+    // Usage charged to the i-th configured tenant.
+    TenantStats tenant_stats(size_t i) const {
+        TenantStats stats{charged_ops[i].load(), charged_bytes[i].load(), 0};
+        const Tenant &tenant = tenants[i];
+        if (tenant.ops) {
+            stats.throttled_us += tenant.ops->get_total_wait_us();
+        }
+        if (tenant.bytes) {
+            stats.throttled_us += tenant.bytes->get_total_wait_us();
+        }
+        return stats;
+    }
+};
+
+class ConsistentHashRing {
+private:
+    size_t virtual_nodes;
+    std::vector<std::pair<uint64_t, int> > points;
+
+public:
+    explicit ConsistentHashRing(size_t vnodes_per_node = 128) : virtual_nodes(vnodes_per_node) {
+    }
+
+    void add_node(int node_id) {
+        for (size_t i = 0; i < virtual_nodes; i++) {
+            uint64_t label[2] = {static_cast<uint64_t>(node_id), i};
+            points.emplace_back(hash_bytes(reinterpret_cast<const uint8_t *>(label), sizeof(label)), node_id);
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    int owner(const std::vector<uint8_t> &key) const {
+        if (points.empty()) {
+            return -1;
+        }
+        uint64_t hash = hash_bytes(key.data(), key.size());
+        auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(hash, INT32_MIN));
+        return it == points.end() ? points.front().second : it->second;
+    }
+};
+
+// Fans requests out to YTDB server processes chosen by consistent hashing. Batch calls are
+// coalesced into one frame per backend and the per-backend frames are issued concurrently.
+// Adding a node migrates the affected keys incrementally through migrate_step(); until a key
+// has moved, reads fall back to its previous owner.
+class ClusterRouter {
+public:
+    enum class MigrationStatus {
+        InProgress,
+        Finished,
+        // A backend call failed; the chunk is retried by the next step.
+        Failed
+    };
+
+private:
+    struct Backend {
+        std::string path;
+        int fd = -1;
+        std::mutex mutex;
+    };
+
+    struct Migration {
+        int target = -1;
+        std::vector<int> sources;
+        size_t source_index = 0;
+        std::vector<uint8_t> cursor;
+    };
+
+    std::map<int, std::unique_ptr<Backend> > backends;
+    ConsistentHashRing ring;
+    ConsistentHashRing previous_ring;
+    bool migrating = false;
+    Migration migration;
+    // Client operations hold this shared. Migration steps hold it shared too and take it
+    // exclusively only to finish, so routing never waits for migration I/O.
+    mutable std::shared_mutex ring_mutex;
+    // Held exclusively by a migration step and shared by erase(), which must not remove a key
+    // between a step scanning it and copying it to the new owner. Taken before ring_mutex.
+    std::shared_mutex step_mutex;
+
+    // A connection that failed mid-frame is out of step with the server, so it is reopened.
+    static bool call(Backend &backend, const WireMessage &request, WireMessage &response) {
+        std::lock_guard lock(backend.mutex);
+        std::vector<uint8_t> buffer;
+        if (!send_message(backend.fd, request) || !read_message(backend.fd, response, buffer)) {
+            close(backend.fd);
+            backend.fd = connect_unix(backend.path);
+            return false;
+        }
+        return response.code == static_cast<uint8_t>(WireStatus::Ok);
+    }
+
+    // Sends one frame per backend before reading any response, so the backends work in
+    // parallel without a thread per call; `groups` maps backend id -> request. Backends are
+    // locked in id order, so concurrent fan-outs cannot deadlock.
+    bool fan_out(std::map<int, WireMessage> &groups, std::map<int, WireMessage> &responses) {
+        std::vector<std::unique_lock<std::mutex> > locks;
+        std::vector<int> sent;
+        bool ok = true;
+        for (auto &[id, request]: groups) {
+            Backend &backend = *backends.at(id);
+            locks.emplace_back(backend.mutex);
+            if (!send_message(backend.fd, request)) {
+                ok = false;
+                break;
+            }
+            sent.push_back(id);
+        }
+        std::vector<uint8_t> buffer;
+        for (int id: sent) {
+            WireMessage &response = responses[id];
+            ok = read_message(backends.at(id)->fd, response, buffer) &&
+                 response.code == static_cast<uint8_t>(WireStatus::Ok) && ok;
+        }
+        return ok;
+    }
+
+public:
+    explicit ClusterRouter(size_t vnodes_per_node = 128) : ring(vnodes_per_node), previous_ring(vnodes_per_node) {
+    }
+
+    ~ClusterRouter() {
+        for (auto &[id, backend]: backends) {
+            close(backend->fd);
+        }
+    }
+
+    bool add_initial_node(int node_id, const std::string &path) {
+        std::unique_lock lock(ring_mutex);
+        auto backend = std::make_unique<Backend>();
+        backend->path = path;
+        backend->fd = connect_unix(path);
+        if (backend->fd < 0) {
+            return false;
+        }
+        backends[node_id] = std::move(backend);
+        ring.add_node(node_id);
+        previous_ring.add_node(node_id);
+        return true;
+    }
+
+    // Puts the node on the ring immediately; keys move over as migrate_step() is called.
+    bool add_node(int node_id, const std::string &path) {
+        std::unique_lock lock(ring_mutex);
+        if (migrating) {
+            return false;
+        }
+        auto backend = std::make_unique<Backend>();
+        backend->path = path;
+        backend->fd = connect_unix(path);
+        if (backend->fd < 0) {
+            return false;
+        }
+        migration = Migration{};
+        migration.target = node_id;
+        for (auto &[id, existing]: backends) {
+            migration.sources.push_back(id);
+        }
+        backends[node_id] = std::move(backend);
+        ring.add_node(node_id);
+        migrating = true;
+        return true;
+    }
+
+    // Moves the keys owned by the new node out of the next `chunk` scanned source entries.
+    // Client writes already go to the new owner, so a copied entry never replaces one the
+    // target has; erase() removes keys from the old owner too, so they cannot be copied back.
+    // Entries are copied before they are erased from the source, so a key is always on one of
+    // its two owners.
+    MigrationStatus migrate_step(size_t chunk = 256) {
+        std::unique_lock step(step_mutex);
+        std::shared_lock lock(ring_mutex);
+        if (!migrating) {
+            return MigrationStatus::Finished;
+        }
+        Backend &source = *backends.at(migration.sources[migration.source_index]);
+        Backend &target = *backends.at(migration.target);
+
+        WireMessage scan;
+        scan.code = static_cast<uint8_t>(WireOp::Scan);
+        scan.entries.resize(1);
+        scan.entries[0].key = migration.cursor;
+        append_u32(scan.entries[0].value, chunk);
+        WireMessage scanned;
+        if (!call(source, scan, scanned)) {
+            return MigrationStatus::Failed;
+        }
+
+        WireMessage put;
+        put.code = static_cast<uint8_t>(WireOp::PutIfAbsent);
+        WireMessage erase;
+        erase.code = static_cast<uint8_t>(WireOp::Erase);
+        for (WireEntry &entry: scanned.entries) {
+            if (ring.owner(entry.key) == migration.target) {
+                erase.entries.push_back(WireEntry{entry.key, {}, false});
+                put.entries.push_back(std::move(entry));
+            }
+        }
+        WireMessage ignored;
+        if (!put.entries.empty() && (!call(target, put, ignored) || !call(source, erase, ignored))) {
+            return MigrationStatus::Failed;
+        }
+
+        if (scanned.entries.size() < chunk) {
+            migration.cursor.clear();
+            if (++migration.source_index == migration.sources.size()) {
+                lock.unlock();
+                std::unique_lock exclusive(ring_mutex);
+                previous_ring = ring;
+                migrating = false;
+                return MigrationStatus::Finished;
+            }
+        } else {
+            // Resume just after the last scanned key.
+            migration.cursor = scanned.entries.back().key;
+            migration.cursor.push_back(0);
+        }
+        return MigrationStatus::InProgress;
+    }
+
+    // Runs migrate_step until the migration finishes; false after `max_failures` failed steps
+    // in a row, with the migration left where it stopped.
+    bool migrate(size_t chunk = 256, int max_failures = 3, size_t *steps = nullptr) {
+        int failures = 0;
+        while (true) {
+            MigrationStatus status = migrate_step(chunk);
+            if (status == MigrationStatus::Finished) {
+                return true;
+            }
+            if (steps != nullptr) {
+                ++*steps;
+            }
+            failures = status == MigrationStatus::Failed ? failures + 1 : 0;
+            if (failures >= max_failures) {
+                return false;
+            }
+        }
+    }
+
+    bool is_migrating() const {
+        std::shared_lock lock(ring_mutex);
+        return migrating;
+    }
+
+    bool put_batch(const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > &entries) {
+        std::shared_lock lock(ring_mutex);
+        std::map<int, WireMessage> groups;
+        for (const auto &[key, value]: entries) {
+            WireMessage &request = groups[ring.owner(key)];
+            request.code = static_cast<uint8_t>(WireOp::PutBatch);
+            request.entries.push_back(WireEntry{key, value, false});
+        }
+        std::map<int, WireMessage> responses;
+        return fan_out(groups, responses);
+    }
+
+    bool multi_get(const std::vector<std::vector<uint8_t> > &keys, std::vector<WireEntry> &results) {
+        std::shared_lock lock(ring_mutex);
+        results.assign(keys.size(), WireEntry{});
+        std::map<int, WireMessage> groups;
+        std::map<int, std::vector<size_t> > positions;
+        for (size_t i = 0; i < keys.size(); i++) {
+            int owner = ring.owner(keys[i]);
+            groups[owner].code = static_cast<uint8_t>(WireOp::MultiGet);
+            groups[owner].entries.push_back(WireEntry{keys[i], {}, false});
+            positions[owner].push_back(i);
+        }
+        std::map<int, WireMessage> responses;
+        if (!fan_out(groups, responses)) {
+            return false;
+        }
+
+        std::map<int, WireMessage> fallback;
+        std::map<int, std::vector<size_t> > fallback_positions;
+        for (auto &[id, response]: responses) {
+            for (size_t i = 0; i < response.entries.size(); i++) {
+                size_t pos = positions[id][i];
+                results[pos] = std::move(response.entries[i]);
+                results[pos].key = keys[pos];
+                int previous = migrating ? previous_ring.owner(keys[pos]) : id;
+                if (!results[pos].found && previous != id) {
+                    fallback[previous].code = static_cast<uint8_t>(WireOp::MultiGet);
+                    fallback[previous].entries.push_back(WireEntry{keys[pos], {}, false});
+                    fallback_positions[previous].push_back(pos);
+                }
+            }
+        }
+        if (fallback.empty()) {
+            return true;
+        }
+        responses.clear();
+        if (!fan_out(fallback, responses)) {
+            return false;
+        }
+        // A step may have moved the key between the two reads; it copies before it erases, so
+        // a key missing from its previous owner is on the new one if it exists at all.
+        std::map<int, WireMessage> again;
+        std::map<int, std::vector<size_t> > again_positions;
+        for (auto &[id, response]: responses) {
+            for (size_t i = 0; i < response.entries.size(); i++) {
+                size_t pos = fallback_positions[id][i];
+                results[pos].found = response.entries[i].found;
+                results[pos].value = std::move(response.entries[i].value);
+                if (!results[pos].found) {
+                    int owner = ring.owner(keys[pos]);
+                    again[owner].code = static_cast<uint8_t>(WireOp::MultiGet);
+                    again[owner].entries.push_back(WireEntry{keys[pos], {}, false});
+                    again_positions[owner].push_back(pos);
+                }
+            }
+        }
+        if (again.empty()) {
+            return true;
+        }
+        responses.clear();
+        if (!fan_out(again, responses)) {
+            return false;
+        }
+        for (auto &[id, response]: responses) {
+            for (size_t i = 0; i < response.entries.size(); i++) {
+                size_t pos = again_positions[id][i];
+                results[pos].found = response.entries[i].found;
+                results[pos].value = std::move(response.entries[i].value);
+            }
+        }
+        return true;
+    }
+
+    bool put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        return put_batch({{key, value}});
+    }
+
+    // While migrating, the key is also erased from its previous owner, which may still hold it.
+    bool erase(const std::vector<uint8_t> &key) {
+        std::shared_lock step(step_mutex);
+        std::shared_lock lock(ring_mutex);
+        std::map<int, WireMessage> groups;
+        groups[ring.owner(key)].entries.push_back(WireEntry{key, {}, false});
+        if (migrating) {
+            groups[previous_ring.owner(key)].entries.push_back(WireEntry{key, {}, false});
+        }
+        for (auto &[id, request]: groups) {
+            request.code = static_cast<uint8_t>(WireOp::Erase);
+            request.entries.resize(1);
+        }
+        std::map<int, WireMessage> responses;
+        return fan_out(groups, responses);
+    }
+
+    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) {
+        std::vector<WireEntry> results;
+        if (!multi_get({key}, results) || !results[0].found) {
+            return false;
+        }
+        out_value = std::move(results[0].value);
+        return true;
+    }
+};
+
+// Forks a YTDB server process listening on `path`. The listening socket is bound before the
+// fork so clients can connect as soon as this returns.
+static pid_t spawn_server_process(const std::string &path) {
+    int listen_fd = listen_unix(path);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        ConcurrentRedBlackTree tree;
+        YtdbServer server(tree);
+        server.serve(listen_fd);
+        _exit(0);
+    }
+    close(listen_fd);
+    return pid;
+}
+
+static void stop_server_process(pid_t pid, const std::string &path) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    unlink(path.c_str());
+}
+
+struct YtdbResult {
+    bool ok = false;
+    bool found = false;
+    std::vector<uint8_t> value;
+};
+
+// Asynchronous client for YtdbServer. Every call returns a future at once. Requests are
+// spread over a pool of connections by key hash, so operations on one key stay in order.
+// On each connection, consecutive requests of the same kind are coalesced into a single
+// MultiGet/PutBatch/Erase frame, and up to `pipeline_depth` frames are sent before the
+// first response is read.
+class YtdbClient {
+public:
+    struct Options {
+        size_t connections = 1;
+        size_t pipeline_depth = 16;
+        size_t max_batch_entries = 128;
+    };
+
+private:
+    struct Request {
+        WireOp op;
+        std::vector<uint8_t> key;
+        std::vector<uint8_t> value;
+        std::promise<YtdbResult> result;
+        std::vector<std::vector<uint8_t> > args;
+    };
+
+    struct Frame {
+        WireOp op;
+        std::vector<std::promise<YtdbResult> > results;
+    };
+
+    struct Connection {
+        int fd = -1;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Request> queue;
+        // Frames written to the socket and not answered yet, oldest first.
+        std::deque<Frame> inflight;
+        bool closing = false;
+        bool failed = false;
+        std::thread sender;
+        std::thread receiver;
+    };
+
+    Options options;
+    std::vector<std::unique_ptr<Connection> > pool;
+    std::atomic<uint64_t> frames_sent{0};
+
+    void send_loop(Connection &conn) {
+        std::vector<uint8_t> bytes;
+        while (true) {
+            WireMessage message;
+            {
+                std::unique_lock lock(conn.mutex);
+                conn.cv.wait(lock, [&]() {
+                    return conn.failed || (conn.closing && conn.queue.empty()) ||
+                           (!conn.queue.empty() && conn.inflight.size() < options.pipeline_depth);
+                });
+                if (conn.failed || conn.queue.empty()) {
+                    break;
+                }
+                Frame frame;
+                frame.op = conn.queue.front().op;
+                message.code = static_cast<uint8_t>(frame.op);
+                // A procedure call takes a whole frame.
+                size_t limit = frame.op == WireOp::Call ? 1 : options.max_batch_entries;
+                while (!conn.queue.empty() && conn.queue.front().op == frame.op && frame.results.size() < limit) {
+                    Request &request = conn.queue.front();
+                    message.entries.push_back(WireEntry{std::move(request.key), std::move(request.value), false});
+                    for (auto &arg: request.args) {
+                        message.entries.push_back(WireEntry{{}, std::move(arg), false});
+                    }
+                    frame.results.push_back(std::move(request.result));
+                    conn.queue.pop_front();
+                }
+                conn.inflight.push_back(std::move(frame));
+            }
+            bytes.clear();
+            encode_message(message, bytes);
+            if (!write_all(conn.fd, bytes.data(), bytes.size())) {
+                // The receiver wakes up and fails everything still pending.
+                shutdown(conn.fd, SHUT_RDWR);
+                break;
+            }
+            frames_sent++;
+        }
+    }
+
+    void receive_loop(Connection &conn) {
+        WireMessage response;
+        std::vector<uint8_t> buffer;
+        while (read_message(conn.fd, response, buffer)) {
+            Frame frame;
+            {
+                std::lock_guard lock(conn.mutex);
+                if (conn.inflight.empty()) {
+                    break;
+                }
+                frame = std::move(conn.inflight.front());
+                conn.inflight.pop_front();
+            }
+            conn.cv.notify_all();
+            bool ok = response.code == static_cast<uint8_t>(WireStatus::Ok) &&
+                      (frame.op == WireOp::PutBatch || response.entries.size() == frame.results.size());
+            for (size_t i = 0; i < frame.results.size(); i++) {
+                YtdbResult result;
+                result.ok = ok;
+                if (ok && frame.op == WireOp::PutBatch) {
+                    result.found = true;
+                } else if (ok) {
+                    result.found = response.entries[i].found;
+                    result.value = std::move(response.entries[i].value);
+                }
+                frame.results[i].set_value(std::move(result));
+            }
+        }
+        std::lock_guard lock(conn.mutex);
+        conn.failed = true;
+        for (Frame &frame: conn.inflight) {
+            for (auto &result: frame.results) {
+                result.set_value(YtdbResult{});
+            }
+        }
+        conn.inflight.clear();
+        for (Request &request: conn.queue) {
+            request.result.set_value(YtdbResult{});
+        }
+        conn.queue.clear();
+        conn.cv.notify_all();
+    }
+
+    std::future<YtdbResult> submit(WireOp op, const std::vector<uint8_t> &key, const std::vector<uint8_t> &value,
+                                   std::vector<std::vector<uint8_t> > args = {}) {
+        Request request{op, key, value, std::promise<YtdbResult>(), std::move(args)};
+        std::future<YtdbResult> future = request.result.get_future();
+        // Not connected, connecting failed or already closed.
+        if (pool.empty()) {
+            request.result.set_value(YtdbResult{});
+            return future;
+        }
+        const std::vector<uint8_t> &route = request.args.empty() ? request.key : request.args[0];
+        Connection &conn = *pool[hash_bytes(route.data(), route.size()) % pool.size()];
+        std::lock_guard lock(conn.mutex);
+        if (conn.failed || conn.closing) {
+            request.result.set_value(YtdbResult{});
+            return future;
+        }
+        conn.queue.push_back(std::move(request));
+        conn.cv.notify_all();
+        return future;
+    }
+
+public:
+    explicit YtdbClient(const Options &opts) : options(opts) {
+    }
+
+    YtdbClient(const YtdbClient &) = delete;
+    YtdbClient &operator=(const YtdbClient &) = delete;
+
+    ~YtdbClient() {
+        close();
+    }
+
+    bool connect(const std::string &path) {
+        for (size_t i = 0; i < options.connections; i++) {
+            int fd = connect_unix(path);
+            if (fd < 0) {
+                close();
+                return false;
+            }
+            auto conn = std::make_unique<Connection>();
+            conn->fd = fd;
+            Connection *raw = conn.get();
+            conn->sender = std::thread([this, raw]() { send_loop(*raw); });
+            conn->receiver = std::thread([this, raw]() { receive_loop(*raw); });
+            pool.push_back(std::move(conn));
+        }
+        return !pool.empty();
+    }
+
+    // Flushes queued requests, waits for their responses and closes the pool.
+    void close() {
+        for (auto &conn: pool) {
+            {
+                std::lock_guard lock(conn->mutex);
+                conn->closing = true;
+            }
+            conn->cv.notify_all();
+            conn->sender.join();
+            {
+                std::unique_lock lock(conn->mutex);
+                conn->cv.wait(lock, [&]() { return conn->failed || conn->inflight.empty(); });
+            }
+            shutdown(conn->fd, SHUT_RDWR);
+            conn->receiver.join();
+            ::close(conn->fd);
+        }
+        pool.clear();
+    }
+
+    std::future<YtdbResult> get(const std::vector<uint8_t> &key) {
+        return submit(WireOp::MultiGet, key, {});
+    }
+
+    std::future<YtdbResult> put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        return submit(WireOp::PutBatch, key, value);
+    }
+
+    // `found` reports whether the key existed.
+    std::future<YtdbResult> erase(const std::vector<uint8_t> &key) {
+        return submit(WireOp::Erase, key, {});
+    }
+
+    // Runs a stored procedure on the server; `value` is its result. Calls are routed by the
+    // first argument so calls on the same key stay ordered.
+    std::future<YtdbResult> call(const std::string &name, const std::vector<std::vector<uint8_t> > &args) {
+        return submit(WireOp::Call, std::vector<uint8_t>(name.begin(), name.end()), {}, args);
+    }
+
+    uint64_t get_frames_sent() const {
+        return frames_sent.load();
+    }
+};
+
+enum class RaftCommandType : uint8_t {
+    Noop = 0,
+    Put = 1,
+    Erase = 2
+};
+
+// Replicated command: [u8 type][u32 key_len][key][u32 value_len][value].
+static std::vector<uint8_t> encode_raft_command(RaftCommandType type, const std::vector<uint8_t> &key,
+                                                const std::vector<uint8_t> &value) {
+    std::vector<uint8_t> out;
+    out.push_back(static_cast<uint8_t>(type));
+    append_u32(out, key.size());
+    out.insert(out.end(), key.begin(), key.end());
+    append_u32(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+    return out;
+}
+
+static void apply_raft_command(ConcurrentRedBlackTree &tree, const std::vector<uint8_t> &command) {
+    if (command.size() < 9 || command[0] == static_cast<uint8_t>(RaftCommandType::Noop)) {
+        return;
+    }
+    uint32_t key_len = load_u32(command.data() + 1);
+    if (key_len > command.size() - 9 || load_u32(command.data() + 5 + key_len) != command.size() - 9 - key_len) {
+        return;
+    }
+    std::vector<uint8_t> key(command.begin() + 5, command.begin() + 5 + key_len);
+    if (command[0] == static_cast<uint8_t>(RaftCommandType::Erase)) {
+        tree.erase(key);
+        return;
+    }
+    std::vector<uint8_t> value(command.begin() + 9 + key_len, command.end());
+    tree.put(key, value);
+}
+
+enum class RaftRole {
+    Follower,
+    Candidate,
+    Leader
+};
+
+enum class RaftMessageType : uint8_t {
+    RequestVote = 1,
+    VoteResponse = 2,
+    AppendEntries = 3,
+    AppendResponse = 4,
+    InstallSnapshot = 5,
+    ReadIndex = 6,
+    ReadIndexResponse = 7
+};
+
+struct RaftEntry {
+    uint64_t term = 0;
+    std::vector<uint8_t> command;
+};
+
+struct RaftMessage {
+    RaftMessageType type = RaftMessageType::AppendEntries;
+    int from = -1;
+    int to = -1;
+    uint64_t term = 0;
+    // AppendEntries: prev log index; responses: match index or rejection hint;
+    // RequestVote: last log index; InstallSnapshot: snapshot index; ReadIndex: read index.
+    uint64_t index = 0;
+    // Term of `index` (prev log term, last log term or snapshot term).
+    uint64_t log_term = 0;
+    uint64_t commit = 0;
+    // Leader heartbeat round for AppendEntries and its acks; request id for ReadIndex.
+    uint64_t seq = 0;
+    bool success = false;
+    std::vector<RaftEntry> entries;
+    std::vector<uint8_t> snapshot;
+};
+
+// Frames a Raft message as [u32 payload_len][payload] for stream transports.
+static void encode_raft_message(const RaftMessage &message, std::vector<uint8_t> &out) {
+    size_t frame_start = out.size();
+    append_u32(out, 0);
+    out.push_back(static_cast<uint8_t>(message.type));
+    append_u32(out, message.from);
+    append_u32(out, message.to);
+    append_u64(out, message.term);
+    append_u64(out, message.index);
+    append_u64(out, message.log_term);
+    append_u64(out, message.commit);
+    append_u64(out, message.seq);
+    out.push_back(message.success ? 1 : 0);
+    append_u32(out, message.entries.size());
+    for (const RaftEntry &entry: message.entries) {
+        append_u64(out, entry.term);
+        append_u32(out, entry.command.size());
+        out.insert(out.end(), entry.command.begin(), entry.command.end());
+    }
+    append_u32(out, message.snapshot.size());
+    out.insert(out.end(), message.snapshot.begin(), message.snapshot.end());
+    uint32_t payload_len = out.size() - frame_start - sizeof(uint32_t);
+    memcpy(out.data() + frame_start, &payload_len, sizeof(payload_len));
+}
+
+static bool decode_raft_message(const uint8_t *data, size_t len, RaftMessage &message) {
+    const size_t header = 1 + 4 + 4 + 8 * 5 + 1 + 4;
+    if (len < header) {
+        return false;
+    }
+    message.type = static_cast<RaftMessageType>(data[0]);
+    message.from = static_cast<int>(load_u32(data + 1));
+    message.to = static_cast<int>(load_u32(data + 5));
+    message.term = load_u64(data + 9);
+    message.index = load_u64(data + 17);
+    message.log_term = load_u64(data + 25);
+    message.commit = load_u64(data + 33);
+    message.seq = load_u64(data + 41);
+    message.success = data[49] != 0;
+    uint32_t count = load_u32(data + 50);
+    size_t offset = header;
+    message.entries.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        if (len - offset < 12) {
+            return false;
+        }
+        RaftEntry entry;
+        entry.term = load_u64(data + offset);
+        uint32_t command_len = load_u32(data + offset + 8);
+        offset += 12;
+        if (len - offset < command_len) {
+            return false;
+        }
+        entry.command.assign(data + offset, data + offset + command_len);
+        offset += command_len;
+        message.entries.push_back(std::move(entry));
+    }
+    if (len - offset < sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t snapshot_len = load_u32(data + offset);
+    offset += sizeof(uint32_t);
+    if (len - offset != snapshot_len) {
+        return false;
+    }
+    message.snapshot.assign(data + offset, data + len);
+    return true;
+}
+
+// A Raft replica that applies committed put/erase commands to its own ConcurrentRedBlackTree.
+// The node is a deterministic state machine: time advances only through tick(), input arrives
+// through step(), and output is collected with take_messages(). Proposals made between two
+// ticks go out together in one AppendEntries, and up to `max_inflight` AppendEntries may be
+// outstanding per follower. Linearizable reads use the leader lease when it is valid and
+// read-index confirmation otherwise; all reads waiting on the same heartbeat round share it.
+// Followers forward one ReadIndex request per batch of reads to the leader and serve the batch
+// locally once they have applied up to the returned index. Lagging followers
+// are caught up with a serialized snapshot of the tree.
+class RaftNode {
+public:
+    struct Options {
+        uint64_t election_timeout_min = 10;
+        uint64_t election_timeout_max = 20;
+        uint64_t heartbeat_interval = 2;
+        // Must stay below election_timeout_min: followers refuse to vote for that long after
+        // hearing from a leader, which is what makes the lease safe.
+        uint64_t lease_ticks = 8;
+        // Bound on the relative rate difference between two nodes' clocks. The lease is
+        // shortened so that it expires before any follower's vote refusal can.
+        double max_clock_drift = 0;
+        size_t max_batch_entries = 256;
+        size_t max_inflight = 4;
+        // Applied entries kept in the log before it is compacted into a snapshot.
+        size_t snapshot_threshold = 1024;
+        uint64_t seed = 1;
+    };
+
+    using ProposeCallback = std::function<void(bool committed)>;
+    using ReadCallback = std::function<void(bool ok, bool found, const std::vector<uint8_t> &value)>;
+
+private:
+    struct Peer {
+        uint64_t next_index = 1;
+        uint64_t match_index = 0;
+        size_t inflight = 0;
+        uint64_t acked_seq = 0;
+        // Tick at which the leader sent the newest heartbeat round this peer acknowledged.
+        uint64_t acked_send_tick = 0;
+        bool snapshot_inflight = false;
+        uint64_t snapshot_sent_tick = 0;
+        // Last tick match_index advanced; stalled pipelines are rewound from here.
+        uint64_t progress_tick = 0;
+    };
+
+    struct PendingRead {
+        uint64_t seq;
+        uint64_t index;
+        std::function<void(bool ok, uint64_t index)> ready;
+    };
+
+    struct WaitingRead {
+        uint64_t index;
+        std::vector<uint8_t> key;
+        ReadCallback callback;
+    };
+
+    // Follower reads issued between two take_messages() calls share one ReadIndex request.
+    struct ForwardedBatch {
+        std::vector<WaitingRead> reads;
+        uint64_t sent_tick = 0;
+    };
+
+    int id;
+    std::vector<int> peer_ids;
+    ConcurrentRedBlackTree &tree;
+    Options options;
+    std::mt19937_64 rng;
+
+    RaftRole role = RaftRole::Follower;
+    uint64_t current_term = 0;
+    int voted_for = -1;
+    int leader_id = -1;
+    size_t votes = 0;
+
+    std::vector<RaftEntry> log;
+    uint64_t snapshot_index = 0;
+    uint64_t snapshot_term = 0;
+    // Serialized state for InstallSnapshot, made only when a follower needs it. It covers the
+    // log up to snapshot_bytes_index, which is at least snapshot_index while it is usable.
+    std::vector<uint8_t> snapshot;
+    uint64_t snapshot_bytes_index = 0;
+    uint64_t snapshot_bytes_term = 0;
+    uint64_t commit_index = 0;
+    uint64_t last_applied = 0;
+
+    uint64_t now = 0;
+    uint64_t election_elapsed = 0;
+    uint64_t election_timeout = 0;
+    uint64_t heartbeat_elapsed = 0;
+    uint64_t last_leader_contact = 0;
+    bool heard_from_leader = false;
+
+    std::map<int, Peer> peers;
+    uint64_t heartbeat_seq = 0;
+    std::map<uint64_t, uint64_t> seq_send_tick;
+    bool broadcast_requested = false;
+    uint64_t term_start_index = 0;
+    uint64_t lease_expiry = 0;
+
+    std::map<uint64_t, ProposeCallback> proposals;
+    std::vector<PendingRead> pending_reads;
+    std::vector<WaitingRead> waiting_reads;
+    std::map<uint64_t, ForwardedBatch> forwarded_reads;
+    uint64_t open_read_batch = 0;
+    uint64_t next_read_id = 1;
+    uint64_t lease_reads = 0;
+    uint64_t read_index_requests = 0;
+
+    std::vector<RaftMessage> outbox;
+
+    uint64_t last_index() const {
+        return snapshot_index + log.size();
+    }
+
+    uint64_t term_at(uint64_t index) const {
+        if (index == snapshot_index) {
+            return snapshot_term;
+        }
+        if (index < snapshot_index || index > last_index()) {
+            return 0;
+        }
+        return log[index - snapshot_index - 1].term;
+    }
+
+    const RaftEntry &entry_at(uint64_t index) const {
+        return log[index - snapshot_index - 1];
+    }
+
+    size_t quorum() const {
+        return (peer_ids.size() + 1) / 2 + 1;
+    }
+
+    void reset_election_timer() {
+        election_elapsed = 0;
+        std::uniform_int_distribution<uint64_t> dis(options.election_timeout_min, options.election_timeout_max);
+        election_timeout = dis(rng);
+    }
+
+    void send(RaftMessage message) {
+        message.from = id;
+        message.term = current_term;
+        outbox.push_back(std::move(message));
+    }
+
+    void fail_pending() {
+        for (auto &[index, callback]: proposals) {
+            callback(false);
+        }
+        proposals.clear();
+        for (auto &read: pending_reads) {
+            read.ready(false, 0);
+        }
+        pending_reads.clear();
+    }
+
+    void become_follower(uint64_t term, int leader) {
+        if (role == RaftRole::Leader) {
+            fail_pending();
+        }
+        if (term > current_term) {
+            current_term = term;
+            voted_for = -1;
+        }
+        role = RaftRole::Follower;
+        leader_id = leader;
+        reset_election_timer();
+    }
+
+    void start_election() {
+        current_term++;
+        role = RaftRole::Candidate;
+        voted_for = id;
+        leader_id = -1;
+        votes = 1;
+        reset_election_timer();
+        if (votes >= quorum()) {
+            become_leader();
+            return;
+        }
+        for (int peer: peer_ids) {
+            RaftMessage message;
+            message.type = RaftMessageType::RequestVote;
+            message.to = peer;
+            message.index = last_index();
+            message.log_term = term_at(last_index());
+            send(std::move(message));
+        }
+    }
+
+    void become_leader() {
+        role = RaftRole::Leader;
+        leader_id = id;
+        heartbeat_elapsed = 0;
+        lease_expiry = 0;
+        for (int peer: peer_ids) {
+            peers[peer] = Peer{};
+            peers[peer].next_index = last_index() + 1;
+            peers[peer].progress_tick = now;
+        }
+        // Commit an entry from this term before serving reads or trusting commit_index.
+        log.push_back(RaftEntry{current_term, encode_raft_command(RaftCommandType::Noop, {}, {})});
+        term_start_index = last_index();
+        broadcast_append();
+        maybe_commit();
+    }
+
+    void send_snapshot(int peer_id, Peer &peer) {
+        // The tree holds the state at last_applied, which may be past snapshot_index.
+        if (snapshot.empty() || snapshot_bytes_index < snapshot_index) {
+            snapshot.clear();
+            tree.serialize(snapshot);
+            snapshot_bytes_index = last_applied;
+            snapshot_bytes_term = term_at(last_applied);
+        }
+        RaftMessage message;
+        message.type = RaftMessageType::InstallSnapshot;
+        message.to = peer_id;
+        message.index = snapshot_bytes_index;
+        message.log_term = snapshot_bytes_term;
+        message.seq = heartbeat_seq;
+        message.snapshot = snapshot;
+        peer.snapshot_inflight = true;
+        peer.snapshot_sent_tick = now;
+        send(std::move(message));
+    }
+
+    void send_append(int peer_id, bool heartbeat) {
+        Peer &peer = peers[peer_id];
+        if (peer.next_index <= snapshot_index) {
+            if (!peer.snapshot_inflight || now - peer.snapshot_sent_tick > options.election_timeout_min) {
+                send_snapshot(peer_id, peer);
+            }
+            return;
+        }
+        bool has_entries = peer.next_index <= last_index() && peer.inflight < options.max_inflight;
+        if (!has_entries && !heartbeat) {
+            return;
+        }
+
+        RaftMessage message;
+        message.type = RaftMessageType::AppendEntries;
+        message.to = peer_id;
+        message.seq = heartbeat_seq;
+        message.commit = commit_index;
+        if (has_entries) {
+            message.index = peer.next_index - 1;
+            uint64_t end = std::min(last_index(), peer.next_index + options.max_batch_entries - 1);
+            for (uint64_t i = peer.next_index; i <= end; i++) {
+                message.entries.push_back(entry_at(i));
+            }
+            // Pipelining: assume delivery and keep going; a rejection rewinds next_index.
+            peer.next_index = end + 1;
+            peer.inflight++;
+        } else {
+            // Empty heartbeats anchor at the last known match so reordering cannot reject them.
+            message.index = std::max(peer.match_index, snapshot_index);
+        }
+        message.log_term = term_at(message.index);
+        send(std::move(message));
+    }
+
+    void broadcast_append() {
+        heartbeat_seq++;
+        seq_send_tick[heartbeat_seq] = now;
+        heartbeat_elapsed = 0;
+        broadcast_requested = false;
+        for (int peer_id: peer_ids) {
+            Peer &peer = peers[peer_id];
+            // An AppendEntries in the pipeline was lost: resend everything after the last match.
+            if (peer.next_index > peer.match_index + 1 && now - peer.progress_tick > options.election_timeout_min / 2) {
+                peer.next_index = peer.match_index + 1;
+                peer.inflight = 0;
+                peer.progress_tick = now;
+            }
+            send_append(peer_id, true);
+        }
+        if (peer_ids.empty()) {
+            confirm_reads();
+        }
+    }
+
+    void maybe_commit() {
+        for (uint64_t n = last_index(); n > commit_index && term_at(n) == current_term; n--) {
+            size_t replicated = 1;
+            for (auto &[peer_id, peer]: peers) {
+                if (peer.match_index >= n) {
+                    replicated++;
+                }
+            }
+            if (replicated >= quorum()) {
+                commit_index = n;
+                apply();
+                return;
+            }
+        }
+    }
+
+    // Highest heartbeat round acknowledged by a quorum (the leader counts itself).
+    uint64_t confirmed_seq() const {
+        std::vector<uint64_t> acked = {heartbeat_seq};
+        for (const auto &[peer_id, peer]: peers) {
+            acked.push_back(peer.acked_seq);
+        }
+        std::sort(acked.rbegin(), acked.rend());
+        return acked[quorum() - 1];
+    }
+
+    uint64_t lease_duration() const {
+        // A follower refuses votes for at least election_timeout_min - 1 of its own ticks after
+        // it hears from us; measured on our clock that can be shorter by the drift ratio.
+        double drift = options.max_clock_drift;
+        auto bound = static_cast<uint64_t>((options.election_timeout_min - 1) * (1 - drift) / (1 + drift));
+        return std::min(options.lease_ticks, bound);
+    }
+
+    // The lease starts at the send tick of the newest heartbeat round acknowledged by a quorum.
+    // The leader's own entry is always `now`, the largest, so only peers need to be ranked.
+    void update_lease() {
+        if (peers.empty()) {
+            return;
+        }
+        std::vector<uint64_t> ticks;
+        for (const auto &[peer_id, peer]: peers) {
+            ticks.push_back(peer.acked_send_tick);
+        }
+        std::sort(ticks.rbegin(), ticks.rend());
+        lease_expiry = ticks[quorum() - 2] + lease_duration();
+    }
+
+    bool lease_valid() const {
+        if (role != RaftRole::Leader || commit_index < term_start_index || heartbeat_seq == 0) {
+            return false;
+        }
+        return peers.empty() || now < lease_expiry;
+    }
+
+    void confirm_reads() {
+        uint64_t confirmed = confirmed_seq();
+        std::vector<PendingRead> still_pending;
+        for (auto &read: pending_reads) {
+            if (read.seq <= confirmed) {
+                read.ready(true, std::max(read.index, term_start_index));
+            } else {
+                still_pending.push_back(std::move(read));
+            }
+        }
+        pending_reads = std::move(still_pending);
+        while (!seq_send_tick.empty() && seq_send_tick.begin()->first + 64 < heartbeat_seq) {
+            seq_send_tick.erase(seq_send_tick.begin());
+        }
+    }
+
+    // Registers a leader-side read at the current commit index.
+    void leader_read_index(std::function<void(bool ok, uint64_t index)> ready) {
+        if (lease_valid()) {
+            ready(true, commit_index);
+            return;
+        }
+        // Every read queued before the next broadcast shares that round's confirmation.
+        pending_reads.push_back(PendingRead{heartbeat_seq + 1, commit_index, std::move(ready)});
+        broadcast_requested = true;
+    }
+
+    void serve_waiting_reads() {
+        std::vector<WaitingRead> still_waiting;
+        for (auto &read: waiting_reads) {
+            if (read.index <= last_applied) {
+                std::vector<uint8_t> value;
+                bool found = tree.get(read.key, value);
+                read.callback(true, found, value);
+            } else {
+                still_waiting.push_back(std::move(read));
+            }
+        }
+        waiting_reads = std::move(still_waiting);
+    }
+
+    void apply() {
+        while (last_applied < commit_index) {
+            last_applied++;
+            apply_raft_command(tree, entry_at(last_applied).command);
+            auto it = proposals.find(last_applied);
+            if (it != proposals.end()) {
+                it->second(true);
+                proposals.erase(it);
+            }
+        }
+        serve_waiting_reads();
+        if (last_applied - snapshot_index > options.snapshot_threshold) {
+            compact();
+        }
+    }
+
+    // Drops applied entries from the log. The tree already is the state they produced, so
+    // nothing is serialized until a lagging follower asks for a snapshot.
+    void compact() {
+        snapshot_term = term_at(last_applied);
+        log.erase(log.begin(), log.begin() + (last_applied - snapshot_index));
+        snapshot_index = last_applied;
+    }
+
+    void handle_request_vote(const RaftMessage &message) {
+        // Leader stickiness: while a leader is alive its lease must not be undercut.
+        if (heard_from_leader && leader_id != -1 && now - last_leader_contact < options.election_timeout_min) {
+            return;
+        }
+        if (message.term > current_term) {
+            become_follower(message.term, -1);
+        }
+        bool up_to_date = message.log_term > term_at(last_index()) ||
+                          (message.log_term == term_at(last_index()) && message.index >= last_index());
+        RaftMessage response;
+        response.type = RaftMessageType::VoteResponse;
+        response.to = message.from;
+        response.success = message.term == current_term && up_to_date &&
+                           (voted_for == -1 || voted_for == message.from);
+        if (response.success) {
+            voted_for = message.from;
+            reset_election_timer();
+        }
+        send(std::move(response));
+    }
+
+    void handle_append_entries(const RaftMessage &message) {
+        RaftMessage response;
+        response.type = RaftMessageType::AppendResponse;
+        response.to = message.from;
+        response.seq = message.seq;
+        if (message.term < current_term) {
+            send(std::move(response));
+            return;
+        }
+        become_follower(message.term, message.from);
+        heard_from_leader = true;
+        last_leader_contact = now;
+
+        uint64_t prev = message.index;
+        uint64_t prev_term = message.log_term;
+        size_t skip = 0;
+        if (prev < snapshot_index) {
+            // Entries covered by our snapshot are committed and therefore identical.
+            skip = std::min<uint64_t>(message.entries.size(), snapshot_index - prev);
+            if (prev + skip < snapshot_index) {
+                response.success = true;
+                response.index = snapshot_index;
+                send(std::move(response));
+                return;
+            }
+            prev = snapshot_index;
+            prev_term = snapshot_term;
+        }
+        if (prev > last_index() || term_at(prev) != prev_term) {
+            response.index = std::min(last_index(), prev - 1);
+            send(std::move(response));
+            return;
+        }
+
+        uint64_t index = prev;
+        for (size_t i = skip; i < message.entries.size(); i++) {
+            index++;
+            if (index <= last_index()) {
+                if (term_at(index) == message.entries[i].term) {
+                    continue;
+                }
+                log.resize(index - snapshot_index - 1);
+            }
+            log.push_back(message.entries[i]);
+        }
+        // A message built from a stale next_index may end below what is already committed.
+        if (message.commit > commit_index) {
+            commit_index = std::max(commit_index, std::min(message.commit, index));
+            apply();
+        }
+        response.success = true;
+        response.index = index;
+        send(std::move(response));
+    }
+
+    void handle_append_response(const RaftMessage &message) {
+        if (role != RaftRole::Leader || message.term != current_term) {
+            return;
+        }
+        Peer &peer = peers[message.from];
+        if (message.seq > peer.acked_seq) {
+            peer.acked_seq = message.seq;
+            auto sent = seq_send_tick.find(message.seq);
+            if (sent != seq_send_tick.end()) {
+                peer.acked_send_tick = std::max(peer.acked_send_tick, sent->second);
+                update_lease();
+            }
+        }
+        if (message.success) {
+            peer.snapshot_inflight = false;
+            if (message.index > peer.match_index) {
+                peer.match_index = message.index;
+                peer.progress_tick = now;
+                if (peer.inflight > 0) {
+                    peer.inflight--;
+                }
+            }
+            peer.next_index = std::max(peer.next_index, peer.match_index + 1);
+            maybe_commit();
+            send_append(message.from, false);
+        } else {
+            peer.next_index = std::max(peer.match_index + 1, std::min(peer.next_index, message.index + 1));
+            peer.inflight = 0;
+            send_append(message.from, true);
+        }
+        confirm_reads();
+    }
+
+    void handle_install_snapshot(const RaftMessage &message) {
+        RaftMessage response;
+        response.type = RaftMessageType::AppendResponse;
+        response.to = message.from;
+        response.seq = message.seq;
+        if (message.term < current_term) {
+            send(std::move(response));
+            return;
+        }
+        become_follower(message.term, message.from);
+        heard_from_leader = true;
+        last_leader_contact = now;
+        if (message.index > commit_index && tree.restore(message.snapshot.data(), message.snapshot.size())) {
+            // Keep any suffix we already acknowledged; the leader's match index relies on it.
+            if (message.index < last_index() && term_at(message.index) == message.log_term) {
+                log.erase(log.begin(), log.begin() + (message.index - snapshot_index));
+            } else {
+                log.clear();
+            }
+            snapshot = message.snapshot;
+            snapshot_bytes_index = message.index;
+            snapshot_bytes_term = message.log_term;
+            snapshot_index = message.index;
+            snapshot_term = message.log_term;
+            commit_index = message.index;
+            last_applied = message.index;
+            serve_waiting_reads();
+        }
+        response.success = true;
+        response.index = std::max(commit_index, message.index);
+        send(std::move(response));
+    }
+
+    void send_read_index(uint64_t request) {
+        read_index_requests++;
+        RaftMessage message;
+        message.type = RaftMessageType::ReadIndex;
+        message.to = leader_id;
+        message.seq = request;
+        send(std::move(message));
+    }
+
+    // ReadIndex requests and responses can be lost; re-ask whoever is leader now.
+    void retry_forwarded_reads() {
+        if (leader_id == -1 || leader_id == id) {
+            return;
+        }
+        for (auto &[request, batch]: forwarded_reads) {
+            if (request != open_read_batch && now - batch.sent_tick >= options.election_timeout_min / 2) {
+                batch.sent_tick = now;
+                send_read_index(request);
+            }
+        }
+    }
+
+    void handle_read_index(const RaftMessage &message) {
+        int follower = message.from;
+        uint64_t request = message.seq;
+        if (role != RaftRole::Leader) {
+            RaftMessage response;
+            response.type = RaftMessageType::ReadIndexResponse;
+            response.to = follower;
+            response.seq = request;
+            send(std::move(response));
+            return;
+        }
+        leader_read_index([this, follower, request](bool ok, uint64_t index) {
+            RaftMessage response;
+            response.type = RaftMessageType::ReadIndexResponse;
+            response.to = follower;
+            response.seq = request;
+            response.success = ok;
+            response.index = index;
+            send(std::move(response));
+        });
+    }
+
+    void handle_read_index_response(const RaftMessage &message) {
+        auto it = forwarded_reads.find(message.seq);
+        if (it == forwarded_reads.end()) {
+            return;
+        }
+        ForwardedBatch batch = std::move(it->second);
+        forwarded_reads.erase(it);
+        for (auto &read: batch.reads) {
+            if (!message.success) {
+                read.callback(false, false, {});
+                continue;
+            }
+            read.index = message.index;
+            waiting_reads.push_back(std::move(read));
+        }
+        serve_waiting_reads();
+    }
+
+public:
+    RaftNode(int node_id, const std::vector<int> &cluster, ConcurrentRedBlackTree &state, const Options &opts)
+        : id(node_id), tree(state), options(opts), rng(opts.seed * 7919 + node_id) {
+        for (int member: cluster) {
+            if (member != id) {
+                peer_ids.push_back(member);
+            }
+        }
+        reset_election_timer();
+    }
+
+    void tick() {
+        now++;
+        if (role == RaftRole::Leader) {
+            heartbeat_elapsed++;
+            bool unsent = false;
+            for (auto &[peer_id, peer]: peers) {
+                unsent = unsent || (peer.next_index <= last_index() && peer.inflight < options.max_inflight);
+            }
+            if (heartbeat_elapsed >= options.heartbeat_interval || broadcast_requested || unsent) {
+                broadcast_append();
+            }
+            return;
+        }
+        retry_forwarded_reads();
+        if (++election_elapsed >= election_timeout) {
+            start_election();
+        }
+    }
+
+    void step(const RaftMessage &message) {
+        if (message.term > current_term && message.type != RaftMessageType::RequestVote) {
+            int leader = message.type == RaftMessageType::AppendEntries ||
+                         message.type == RaftMessageType::InstallSnapshot ? message.from : -1;
+            become_follower(message.term, leader);
+        }
+        switch (message.type) {
+            case RaftMessageType::RequestVote:
+                handle_request_vote(message);
+                break;
+            case RaftMessageType::VoteResponse:
+                if (role == RaftRole::Candidate && message.term == current_term && message.success &&
+                    ++votes >= quorum()) {
+                    become_leader();
+                }
+                break;
+            case RaftMessageType::AppendEntries:
+                handle_append_entries(message);
+                break;
+            case RaftMessageType::AppendResponse:
+                handle_append_response(message);
+                break;
+            case RaftMessageType::InstallSnapshot:
+                handle_install_snapshot(message);
+                break;
+            case RaftMessageType::ReadIndex:
+                handle_read_index(message);
+                break;
+            case RaftMessageType::ReadIndexResponse:
+                handle_read_index_response(message);
+                break;
+        }
+    }
+
+    // Appends a command on the leader; it is shipped with the next tick's AppendEntries batch.
+    bool propose(const std::vector<uint8_t> &command, ProposeCallback callback = nullptr) {
+        if (role != RaftRole::Leader) {
+            return false;
+        }
+        log.push_back(RaftEntry{current_term, command});
+        if (callback) {
+            proposals[last_index()] = std::move(callback);
+        }
+        maybe_commit();
+        return true;
+    }
+
+    bool propose_put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value,
+                     ProposeCallback callback = nullptr) {
+        return propose(encode_raft_command(RaftCommandType::Put, key, value), std::move(callback));
+    }
+
+    bool propose_erase(const std::vector<uint8_t> &key, ProposeCallback callback = nullptr) {
+        return propose(encode_raft_command(RaftCommandType::Erase, key, {}), std::move(callback));
+    }
+
+    // Linearizable get, served by the leader or by a follower via read-index. Under a valid
+    // lease the leader answers straight from its tree.
+    void read(const std::vector<uint8_t> &key, ReadCallback callback) {
+        if (lease_valid() && last_applied >= commit_index) {
+            lease_reads++;
+            std::vector<uint8_t> value;
+            bool found = tree.get(key, value);
+            callback(true, found, value);
+            return;
+        }
+        if (role == RaftRole::Leader) {
+            leader_read_index([this, key, callback](bool ok, uint64_t index) {
+                if (!ok) {
+                    callback(false, false, {});
+                    return;
+                }
+                waiting_reads.push_back(WaitingRead{index, key, callback});
+                serve_waiting_reads();
+            });
+            return;
+        }
+        if (leader_id == -1) {
+            callback(false, false, {});
+            return;
+        }
+        if (open_read_batch == 0) {
+            open_read_batch = next_read_id++;
+            forwarded_reads[open_read_batch].sent_tick = now;
+        }
+        forwarded_reads[open_read_batch].reads.push_back(WaitingRead{0, key, std::move(callback)});
+    }
+
+    std::vector<RaftMessage> take_messages() {
+        if (open_read_batch != 0) {
+            if (leader_id != -1 && leader_id != id) {
+                send_read_index(open_read_batch);
+            }
+            open_read_batch = 0;
+        }
+        std::vector<RaftMessage> messages;
+        messages.swap(outbox);
+        return messages;
+    }
+
+    int get_id() const {
+        return id;
+    }
+
+    RaftRole get_role() const {
+        return role;
+    }
+
+    int get_leader() const {
+        return leader_id;
+    }
+
+    uint64_t get_term() const {
+        return current_term;
+    }
+
+    uint64_t get_commit_index() const {
+        return commit_index;
+    }
+
+    uint64_t get_last_applied() const {
+        return last_applied;
+    }
+
+    uint64_t get_snapshot_index() const {
+        return snapshot_index;
+    }
+
+    bool has_valid_lease() const {
+        return lease_valid();
+    }
+
+    uint64_t get_lease_reads() const {
+        return lease_reads;
+    }
+
+    uint64_t get_read_index_requests() const {
+        return read_index_requests;
+    }
+};
+
+// Deterministic in-process network for RaftNode: seeded latency and loss, and nodes can be
+// isolated to simulate crashes or partitioned (still running, but unreachable). Each node's
+// clock runs at its own rate within +/- clock_skew of the network's tick.
+class SimulatedRaftNetwork {
+public:
+    struct Options {
+        size_t num_nodes = 3;
+        uint64_t min_latency = 1;
+        uint64_t max_latency = 3;
+        double drop_rate = 0;
+        double clock_skew = 0;
+        uint64_t seed = 1;
+        RaftNode::Options raft;
+    };
+
+private:
+    Options options;
+    std::mt19937_64 rng;
+    uint64_t now = 0;
+    std::multimap<uint64_t, RaftMessage> in_flight;
+    std::vector<bool> isolated;
+    std::vector<bool> partitioned;
+    std::vector<double> clock_rate;
+    std::vector<double> clock_phase;
+    uint64_t delivered = 0;
+
+    bool reachable(int node) const {
+        return !isolated[node] && !partitioned[node];
+    }
+
+    void collect(RaftNode &node) {
+        std::uniform_int_distribution<uint64_t> latency(options.min_latency, options.max_latency);
+        std::uniform_real_distribution<double> loss(0, 1);
+        for (RaftMessage &message: node.take_messages()) {
+            if (options.drop_rate > 0 && loss(rng) < options.drop_rate) {
+                continue;
+            }
+            in_flight.emplace(now + latency(rng), std::move(message));
+        }
+    }
+
+public:
+    std::vector<std::unique_ptr<ConcurrentRedBlackTree> > trees;
+    std::vector<std::unique_ptr<RaftNode> > nodes;
+
+    explicit SimulatedRaftNetwork(const Options &opts)
+        : options(opts), rng(opts.seed), isolated(opts.num_nodes), partitioned(opts.num_nodes),
+          clock_rate(opts.num_nodes, 1.0), clock_phase(opts.num_nodes, 0.0) {
+        std::uniform_real_distribution<double> skew(1 - opts.clock_skew, 1 + opts.clock_skew);
+        for (size_t i = 0; i < options.num_nodes && opts.clock_skew > 0; i++) {
+            clock_rate[i] = skew(rng);
+        }
+        std::vector<int> cluster;
+        for (size_t i = 0; i < options.num_nodes; i++) {
+            cluster.push_back(i);
+        }
+        for (size_t i = 0; i < options.num_nodes; i++) {
+            RaftNode::Options raft = options.raft;
+            raft.seed = options.seed;
+            trees.push_back(std::make_unique<ConcurrentRedBlackTree>());
+            nodes.push_back(std::make_unique<RaftNode>(i, cluster, *trees[i], raft));
+        }
+    }
+
+    void tick() {
+        now++;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (!isolated[i]) {
+                for (clock_phase[i] += clock_rate[i]; clock_phase[i] >= 1; clock_phase[i] -= 1) {
+                    nodes[i]->tick();
+                }
+            }
+            collect(*nodes[i]);
+        }
+        while (!in_flight.empty() && in_flight.begin()->first <= now) {
+            RaftMessage message = std::move(in_flight.begin()->second);
+            in_flight.erase(in_flight.begin());
+            if (!reachable(message.from) || !reachable(message.to)) {
+                continue;
+            }
+            nodes[message.to]->step(message);
+            delivered++;
+            collect(*nodes[message.to]);
+        }
+    }
+
+    // Flushes messages produced by calls made on nodes outside of tick().
+    void flush() {
+        for (auto &node: nodes) {
+            collect(*node);
+        }
+    }
+
+    bool run_until(const std::function<bool()> &done, uint64_t max_ticks) {
+        for (uint64_t i = 0; i < max_ticks; i++) {
+            if (done()) {
+                return true;
+            }
+            tick();
+        }
+        return done();
+    }
+
+    void set_isolated(int node, bool value) {
+        isolated[node] = value;
+    }
+
+    void set_partitioned(int node, bool value) {
+        partitioned[node] = value;
+    }
+
+    void set_clock_rate(int node, double rate) {
+        clock_rate[node] = rate;
+    }
+
+    int leader() const {
+        int result = -1;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (reachable(i) && nodes[i]->get_role() == RaftRole::Leader &&
+                (result == -1 || nodes[i]->get_term() > nodes[result]->get_term())) {
+                result = i;
+            }
+        }
+        return result;
+    }
+
+    uint64_t get_now() const {
+        return now;
+    }
+
+    uint64_t get_delivered() const {
+        return delivered;
+    }
+};
+
+// Runs one RaftNode in the current process, exchanging framed messages with its peers over
+// `peer_fds` (indexed by node id, -1 for itself) and serving WireMessage requests from
+// `control_fd`: PutBatch is proposed and answered once applied, MultiGet is answered with
+// linearizable reads. Peer sockets are non-blocking with per-peer buffers, so two nodes
+// flooding each other can never deadlock on full socket buffers. Returns when the control
+// socket is closed.
+static void run_raft_process(int id, const std::vector<int> &peer_fds, int control_fd,
+                             const RaftNode::Options &options, std::chrono::milliseconds tick_interval) {
+    ConcurrentRedBlackTree tree;
+    std::vector<int> cluster;
+    for (size_t i = 0; i < peer_fds.size(); i++) {
+        cluster.push_back(i);
+    }
+    RaftNode node(id, cluster, tree, options);
+
+    struct PeerLink {
+        int fd;
+        std::vector<uint8_t> inbound;
+        std::vector<uint8_t> outbound;
+    };
+    std::vector<PeerLink> links(peer_fds.size());
+    for (size_t i = 0; i < peer_fds.size(); i++) {
+        links[i].fd = peer_fds[i];
+        if (peer_fds[i] >= 0) {
+            fcntl(peer_fds[i], F_SETFL, fcntl(peer_fds[i], F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    auto flush = [&]() {
+        for (RaftMessage &message: node.take_messages()) {
+            if (links[message.to].fd >= 0) {
+                encode_raft_message(message, links[message.to].outbound);
+            }
+        }
+        for (PeerLink &link: links) {
+            while (link.fd >= 0 && !link.outbound.empty()) {
+                ssize_t n = send(link.fd, link.outbound.data(), link.outbound.size(), MSG_NOSIGNAL);
+                if (n > 0) {
+                    link.outbound.erase(link.outbound.begin(), link.outbound.begin() + n);
+                } else if (n < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        link.outbound.clear();
+                    }
+                    break;
+                }
+            }
+        }
+    };
+
+    auto receive = [&](PeerLink &link) {
+        uint8_t chunk[64 * 1024];
+        while (true) {
+            ssize_t n = recv(link.fd, chunk, sizeof(chunk), 0);
+            if (n > 0) {
+                link.inbound.insert(link.inbound.end(), chunk, chunk + n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                // Peer is gone; keep running so the survivors can still form a quorum.
+                close(link.fd);
+                link.fd = -1;
+            }
+            break;
+        }
+        size_t offset = 0;
+        RaftMessage message;
+        while (link.inbound.size() - offset >= sizeof(uint32_t)) {
+            uint32_t len = load_u32(link.inbound.data() + offset);
+            if (link.inbound.size() - offset - sizeof(uint32_t) < len) {
+                break;
+            }
+            if (decode_raft_message(link.inbound.data() + offset + sizeof(uint32_t), len, message)) {
+                node.step(message);
+            }
+            offset += sizeof(uint32_t) + len;
+        }
+        link.inbound.erase(link.inbound.begin(), link.inbound.begin() + offset);
+    };
+
+    auto handle_control = [&](const WireMessage &request) {
+        auto response = std::make_shared<WireMessage>();
+        auto remaining = std::make_shared<size_t>(request.entries.size());
+        auto failed = std::make_shared<bool>(false);
+        auto complete = [control_fd, response, remaining, failed]() {
+            if (--*remaining == 0) {
+                response->code = static_cast<uint8_t>(*failed ? WireStatus::Error : WireStatus::Ok);
+                send_message(control_fd, *response);
+            }
+        };
+        WireOp op = static_cast<WireOp>(request.code);
+        if (request.entries.empty() || (op != WireOp::PutBatch && op != WireOp::MultiGet)) {
+            response->code = static_cast<uint8_t>(WireStatus::Error);
+            send_message(control_fd, *response);
+            return;
+        }
+        if (op == WireOp::PutBatch) {
+            for (const WireEntry &entry: request.entries) {
+                auto done = [failed, complete](bool committed) {
+                    *failed = *failed || !committed;
+                    complete();
+                };
+                if (!node.propose_put(entry.key, entry.value, done)) {
+                    done(false);
+                }
+            }
+            return;
+        }
+        response->entries.resize(request.entries.size());
+        for (size_t e = 0; e < request.entries.size(); e++) {
+            node.read(request.entries[e].key,
+                      [response, failed, complete, e](bool ok, bool found, const std::vector<uint8_t> &value) {
+                          *failed = *failed || !ok;
+                          response->entries[e].found = found;
+                          response->entries[e].value = value;
+                          complete();
+                      });
+        }
+    };
+
+    auto next_tick = std::chrono::steady_clock::now() + tick_interval;
+    std::vector<uint8_t> buffer;
+    std::vector<pollfd> fds;
+    while (true) {
+        fds.clear();
+        for (const PeerLink &link: links) {
+            if (link.fd >= 0) {
+                fds.push_back(pollfd{link.fd, static_cast<short>(POLLIN | (link.outbound.empty() ? 0 : POLLOUT)), 0});
+            }
+        }
+        fds.push_back(pollfd{control_fd, POLLIN, 0});
+        int timeout = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                               next_tick - std::chrono::steady_clock::now()).count());
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            break;
+        }
+        while (std::chrono::steady_clock::now() >= next_tick) {
+            node.tick();
+            next_tick += tick_interval;
+        }
+        for (PeerLink &link: links) {
+            if (link.fd >= 0) {
+                receive(link);
+            }
+        }
+        if (fds.back().revents != 0) {
+            WireMessage request;
+            if (!read_message(control_fd, request, buffer)) {
+                break;
+            }
+            handle_control(request);
+        }
+        flush();
+    }
+}
+
+// Anti-caching on top of RedBlackTree: RAM holds values only for the working set. Hot
+// entries live in `hot` and are tracked in LRU order. Once they exceed `max_hot_bytes`, the
+// least recently used ones are written sorted by key to a new run file and replaced in
+// `cold` by a 16-byte stub (run id, value length, file offset). A get that lands on a stub
+// reads the value back and promotes it to hot again; scans read cold values without
+// promoting them. A run file is deleted once none of its values is still live.
+class TieredRedBlackTree {
+public:
+    struct Options {
+        std::string path_prefix = "ytdb_tier";
+        size_t max_hot_bytes = 64 * 1024 * 1024;
+        // Eviction brings hot bytes down to this fraction of max_hot_bytes.
+        double evict_to = 0.9;
+        // Writers wait for the evictor once hot bytes pass this multiple of max_hot_bytes.
+        double stall_at = 1.5;
+        // More run files than this and the smallest are merged into one.
+        size_t max_runs = 8;
+    };
+
+private:
+    struct KeyHash {
+        size_t operator()(const std::vector<uint8_t> &key) const {
+            return hash_bytes(key.data(), key.size());
+        }
+    };
+
+    struct Run {
+        int fd;
+        std::string path;
+        size_t live;
+        // Being read or written by a merge, which deletes it itself.
+        bool merging;
+    };
+
+    // Sequential reader over one run file during a merge.
+    struct RunCursor {
+        uint32_t id = 0;
+        FILE *file = nullptr;
+        uint64_t position = 0;
+        bool valid = false;
+        std::vector<uint8_t> key;
+        std::vector<uint8_t> value;
+        uint64_t value_offset = 0;
+
+        // Loads the next entry; false on a read error, with valid cleared at end of file.
+        bool advance() {
+            uint8_t length[4];
+            if (fread(length, 1, 4, file) != 4) {
+                valid = false;
+                return feof(file) != 0;
+            }
+            key.resize(load_u32(length));
+            if (fread(key.data(), 1, key.size(), file) != key.size() || fread(length, 1, 4, file) != 4) {
+                return false;
+            }
+            value.resize(load_u32(length));
+            value_offset = position + 8 + key.size();
+            if (fread(value.data(), 1, value.size(), file) != value.size()) {
+                return false;
+            }
+            position = value_offset + value.size();
+            valid = true;
+            return true;
+        }
+    };
+
+    Options options;
+    mutable std::mutex mutex;
+    RedBlackTree hot;
+    RedBlackTree cold;
+    // Most recently used first.
+    std::list<std::vector<uint8_t> > lru;
+    std::unordered_map<std::vector<uint8_t>, std::list<std::vector<uint8_t> >::iterator, KeyHash> lru_index;
+    size_t hot_bytes = 0;
+    std::map<uint32_t, Run> runs;
+    uint32_t next_run = 0;
+    uint64_t evictions = 0;
+    uint64_t promotions = 0;
+    uint64_t merges = 0;
+
+    // Eviction and merging run here, so put and get never sort, serialize or write a run.
+    std::thread worker;
+    std::condition_variable work_cv;
+    // Signalled after every eviction or merge, for stalled writers and settle().
+    std::condition_variable space_cv;
+    bool stopping = false;
+    bool idle = true;
+    // Set when a run file could not be written or read; the worker stops evicting.
+    bool io_error = false;
+
+    void touch(const std::vector<uint8_t> &key) {
+        auto it = lru_index.find(key);
+        if (it != lru_index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        lru.push_front(key);
+        lru_index.emplace(key, lru.begin());
+    }
+
+    bool erase_hot(const std::vector<uint8_t> &key) {
+        ValueRef old;
+        if (!hot.get_ref(key, old)) {
+            return false;
+        }
+        hot_bytes -= key.size() + old->size();
+        hot.erase(key);
+        auto it = lru_index.find(key);
+        lru.erase(it->second);
+        lru_index.erase(it);
+        return true;
+    }
+
+    void insert_hot(const std::vector<uint8_t> &key, ValueRef value) {
+        hot_bytes += key.size() + value->size();
+        hot.put(key, std::move(value));
+        touch(key);
+        if (hot_bytes > options.max_hot_bytes) {
+            work_cv.notify_one();
+        }
+    }
+
+    static std::vector<uint8_t> make_stub(uint32_t run, uint32_t length, uint64_t offset) {
+        std::vector<uint8_t> stub;
+        append_u32(stub, run);
+        append_u32(stub, length);
+        append_u64(stub, offset);
+        return stub;
+    }
+
+    bool read_cold(const std::vector<uint8_t> &stub, std::vector<uint8_t> &value) const {
+        const Run &run = runs.at(load_u32(stub.data()));
+        value.resize(load_u32(stub.data() + 4));
+        return pread(run.fd, value.data(), value.size(), load_u64(stub.data() + 8)) ==
+               static_cast<ssize_t>(value.size());
+    }
+
+    void release_run(std::map<uint32_t, Run>::iterator it) {
+        close(it->second.fd);
+        unlink(it->second.path.c_str());
+        runs.erase(it);
+    }
+
+    bool erase_cold(const std::vector<uint8_t> &key) {
+        std::vector<uint8_t> stub;
+        if (!cold.get(key, stub)) {
+            return false;
+        }
+        cold.erase(key);
+        auto it = runs.find(load_u32(stub.data()));
+        if (--it->second.live == 0 && !it->second.merging) {
+            release_run(it);
+        }
+        return true;
+    }
+
+    // Picks the least recently used entries under the lock, writes them to a run file without
+    // it, then swaps in stubs for those still holding the value that was written.
+    void evict(std::unique_lock<std::mutex> &lock) {
+        size_t target = options.max_hot_bytes * options.evict_to;
+        std::vector<std::pair<std::vector<uint8_t>, ValueRef> > victims;
+        size_t freed = 0;
+        for (auto it = lru.rbegin(); it != lru.rend() && hot_bytes - freed > target; ++it) {
+            ValueRef value;
+            hot.get_ref(*it, value);
+            freed += it->size() + value->size();
+            victims.emplace_back(*it, std::move(value));
+        }
+        uint32_t id = next_run++;
+        std::string path = options.path_prefix + "." + std::to_string(id);
+        lock.unlock();
+
+        std::sort(victims.begin(), victims.end(),
+                  [](const auto &a, const auto &b) { return compare_keys(a.first, b.first) < 0; });
+        // Run file layout: (u32 key_len, key, u32 value_len, value) in key order.
+        std::vector<uint8_t> buffer;
+        std::vector<uint64_t> offsets;
+        for (const auto &[key, value]: victims) {
+            append_u32(buffer, key.size());
+            buffer.insert(buffer.end(), key.begin(), key.end());
+            append_u32(buffer, value->size());
+            offsets.push_back(buffer.size());
+            buffer.insert(buffer.end(), value->begin(), value->end());
+        }
+        FILE *file = fopen(path.c_str(), "wb");
+        bool ok = file != nullptr && fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        ok = file != nullptr && fclose(file) == 0 && ok;
+        int fd = ok ? open(path.c_str(), O_RDONLY) : -1;
+
+        lock.lock();
+        if (fd < 0) {
+            unlink(path.c_str());
+            io_error = true;
+            return;
+        }
+        auto run = runs.emplace(id, Run{fd, path, 0, false}).first;
+        for (size_t i = 0; i < victims.size(); i++) {
+            ValueRef current;
+            if (!hot.get_ref(victims[i].first, current) || current != victims[i].second) {
+                continue;
+            }
+            erase_hot(victims[i].first);
+            cold.put(victims[i].first, make_stub(id, victims[i].second->size(), offsets[i]));
+            run->second.live++;
+        }
+        evictions += run->second.live;
+        if (run->second.live == 0) {
+            release_run(run);
+        }
+    }
+
+    // Merges the smallest runs into one, a batch of entries at a time: entries are checked for
+    // liveness under the lock, written without it, then repointed if still unchanged.
+    void merge(std::unique_lock<std::mutex> &lock) {
+        static constexpr size_t BATCH = 256;
+        std::vector<std::pair<size_t, uint32_t> > by_size;
+        for (const auto &[id, run]: runs) {
+            by_size.emplace_back(run.live, id);
+        }
+        std::sort(by_size.begin(), by_size.end());
+        by_size.resize(std::min(by_size.size(), std::max<size_t>(2, options.max_runs / 2)));
+        std::vector<RunCursor> cursors;
+        std::vector<std::string> paths;
+        for (const auto &[live, id]: by_size) {
+            runs[id].merging = true;
+            cursors.emplace_back();
+            cursors.back().id = id;
+            paths.push_back(runs[id].path);
+        }
+        uint32_t id = next_run++;
+        std::string path = options.path_prefix + "." + std::to_string(id);
+        lock.unlock();
+
+        FILE *out = fopen(path.c_str(), "wb");
+        int fd = out != nullptr ? open(path.c_str(), O_RDONLY) : -1;
+        bool ok = fd >= 0;
+        for (size_t i = 0; i < cursors.size() && ok; i++) {
+            cursors[i].file = fopen(paths[i].c_str(), "rb");
+            ok = cursors[i].file != nullptr && cursors[i].advance();
+        }
+        lock.lock();
+        if (ok) {
+            runs.emplace(id, Run{fd, path, 0, true});
+        }
+        lock.unlock();
+
+        // (key, value, stub in its source run, stub in the merged run)
+        struct Entry {
+            std::vector<uint8_t> key;
+            std::vector<uint8_t> value;
+            std::vector<uint8_t> source;
+            std::vector<uint8_t> target;
+        };
+        std::vector<Entry> batch;
+        uint64_t position = 0;
+        while (ok) {
+            batch.clear();
+            while (batch.size() < BATCH && ok) {
+                RunCursor *next = nullptr;
+                for (RunCursor &cursor: cursors) {
+                    if (cursor.valid && (next == nullptr || compare_keys(cursor.key, next->key) < 0)) {
+                        next = &cursor;
+                    }
+                }
+                if (next == nullptr) {
+                    break;
+                }
+                batch.push_back(Entry{next->key, next->value, make_stub(next->id, next->value.size(), next->value_offset),
+                                      {}});
+                ok = next->advance();
+            }
+            if (batch.empty()) {
+                break;
+            }
+            lock.lock();
+            std::vector<uint8_t> stub;
+            for (Entry &entry: batch) {
+                if (!cold.get(entry.key, stub) || stub != entry.source) {
+                    entry.source.clear();
+                }
+            }
+            lock.unlock();
+            std::vector<uint8_t> buffer;
+            for (Entry &entry: batch) {
+                if (entry.source.empty()) {
+                    continue;
+                }
+                append_u32(buffer, entry.key.size());
+                buffer.insert(buffer.end(), entry.key.begin(), entry.key.end());
+                append_u32(buffer, entry.value.size());
+                entry.target = make_stub(id, entry.value.size(), position + buffer.size());
+                buffer.insert(buffer.end(), entry.value.begin(), entry.value.end());
+            }
+            position += buffer.size();
+            ok = ok && (buffer.empty() || fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size()) &&
+                 fflush(out) == 0;
+            if (!ok) {
+                break;
+            }
+            lock.lock();
+            for (Entry &entry: batch) {
+                if (entry.target.empty() || !cold.get(entry.key, stub) || stub != entry.source) {
+                    continue;
+                }
+                cold.put(entry.key, entry.target);
+                runs[load_u32(entry.source.data())].live--;
+                runs[id].live++;
+            }
+            lock.unlock();
+        }
+        for (RunCursor &cursor: cursors) {
+            if (cursor.file != nullptr) {
+                fclose(cursor.file);
+            }
+        }
+        if (out != nullptr) {
+            fclose(out);
+        }
+
+        // A failed merge leaves every entry readable from wherever it was last repointed.
+        lock.lock();
+        if (!ok) {
+            io_error = true;
+            if (runs.count(id) == 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                unlink(path.c_str());
+            }
+        }
+        by_size.emplace_back(0, id);
+        for (const auto &[live, run_id]: by_size) {
+            auto it = runs.find(run_id);
+            if (it == runs.end()) {
+                continue;
+            }
+            it->second.merging = false;
+            if (it->second.live == 0) {
+                release_run(it);
+            }
+        }
+        merges++;
+    }
+
+    void work() {
+        std::unique_lock lock(mutex);
+        while (!stopping) {
+            if (!io_error && hot_bytes > options.max_hot_bytes) {
+                evict(lock);
+            } else if (!io_error && runs.size() > options.max_runs) {
+                merge(lock);
+            } else {
+                idle = true;
+                space_cv.notify_all();
+                work_cv.wait(lock);
+                idle = false;
+                continue;
+            }
+            space_cv.notify_all();
+        }
+    }
+
+    // Called by writers: waits while the evictor is too far behind.
+    void wait_for_space(std::unique_lock<std::mutex> &lock) {
+        size_t stall = options.max_hot_bytes * options.stall_at;
+        space_cv.wait(lock, [this, stall] { return hot_bytes <= stall || io_error || stopping; });
+    }
+
+public:
+    explicit TieredRedBlackTree(const Options &opts) : options(opts) {
+        worker = std::thread([this] { work(); });
+    }
+
+    TieredRedBlackTree() : TieredRedBlackTree(Options()) {
+    }
+
+    ~TieredRedBlackTree() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        space_cv.notify_all();
+        worker.join();
+        for (auto &[id, run]: runs) {
+            close(run.fd);
+            unlink(run.path.c_str());
+        }
+    }
+
+    // Returns false once a run file could not be written; the entry is stored either way.
+    bool put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        ValueRef ref = std::make_shared<const std::vector<uint8_t> >(value);
+        std::unique_lock lock(mutex);
+        erase_cold(key);
+        erase_hot(key);
+        insert_hot(key, std::move(ref));
+        wait_for_space(lock);
+        return !io_error;
+    }
+
+    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) {
+        std::lock_guard lock(mutex);
+        if (hot.get(key, out_value)) {
+            touch(key);
+            return true;
+        }
+        std::vector<uint8_t> stub;
+        if (!cold.get(key, stub) || !read_cold(stub, out_value)) {
+            return false;
+        }
+        erase_cold(key);
+        insert_hot(key, std::make_shared<const std::vector<uint8_t> >(out_value));
+        promotions++;
+        return true;
+    }
+
+    bool erase(const std::vector<uint8_t> &key) {
+        std::lock_guard lock(mutex);
+        return erase_hot(key) || erase_cold(key);
+    }
+
+    // Waits until the background worker is idle: hot bytes within max_hot_bytes and no more
+    // than max_runs run files. Returns false if it stopped on an I/O error.
+    bool settle() {
+        std::unique_lock lock(mutex);
+        work_cv.notify_one();
+        space_cv.wait(lock, [this] {
+            return io_error || (idle && hot_bytes <= options.max_hot_bytes && runs.size() <= options.max_runs);
+        });
+        return !io_error;
+    }
+
+    // Copies up to `limit` entries with key >= start, merging hot and cold entries in key order.
+    bool scan(const std::vector<uint8_t> &start, size_t limit,
+              std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > &out) const {
+        std::lock_guard lock(mutex);
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > hot_part;
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > cold_part;
+        auto collect = [limit](std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > &part) {
+            return [&part, limit](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+                part.emplace_back(key, value);
+                return part.size() < limit;
+            };
+        };
+        hot.scan(start, collect(hot_part));
+        cold.scan(start, collect(cold_part));
+        size_t h = 0;
+        size_t c = 0;
+        while (out.size() < limit && (h < hot_part.size() || c < cold_part.size())) {
+            if (c == cold_part.size() || (h < hot_part.size() && compare_keys(hot_part[h].first, cold_part[c].first) < 0)) {
+                out.push_back(std::move(hot_part[h++]));
+                continue;
+            }
+            std::vector<uint8_t> value;
+            if (!read_cold(cold_part[c].second, value)) {
+                return false;
+            }
+            out.emplace_back(std::move(cold_part[c++].first), std::move(value));
+        }
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard lock(mutex);
+        return hot.size() + cold.size();
+    }
+
+    size_t hot_entries() const {
+        std::lock_guard lock(mutex);
+        return hot.size();
+    }
+
+    size_t get_hot_bytes() const {
+        std::lock_guard lock(mutex);
+        return hot_bytes;
+    }
+
+    size_t run_files() const {
+        std::lock_guard lock(mutex);
+        return runs.size();
+    }
+
+    uint64_t get_evictions() const {
+        std::lock_guard lock(mutex);
+        return evictions;
+    }
+
+    uint64_t get_promotions() const {
+        std::lock_guard lock(mutex);
+        return promotions;
+    }
+
+    uint64_t get_merges() const {
+        std::lock_guard lock(mutex);
+        return merges;
+    }
+};
+
+// FSST-style static symbol table for short strings. Up to 255 symbols of 1-8 bytes are each
+// encoded as a one-byte code; any byte not covered by a symbol is written as ESCAPE followed
+// by the literal byte. Training starts from an empty table and, for a few rounds, encodes a
+// sample with the current table and keeps the 255 symbols (used symbols and concatenations of
+// adjacent ones) with the highest count x length.
+class SymbolTable {
+public:
+    static constexpr uint8_t ESCAPE = 255;
+    static constexpr size_t MAX_SYMBOLS = 255;
+    static constexpr size_t MAX_SYMBOL_LEN = 8;
+
+private:
+    std::vector<std::string> symbols;
+    // Codes of the symbols starting with each byte, longest first.
+    std::vector<uint8_t> by_first[256];
+
+    void build_index() {
+        for (auto &codes: by_first) {
+            codes.clear();
+        }
+        for (size_t code = 0; code < symbols.size(); code++) {
+            by_first[static_cast<uint8_t>(symbols[code][0])].push_back(code);
+        }
+        for (auto &codes: by_first) {
+            std::stable_sort(codes.begin(), codes.end(),
+                             [this](uint8_t a, uint8_t b) { return symbols[a].size() > symbols[b].size(); });
+        }
+    }
+
+    int match(const uint8_t *data, size_t len) const {
+        for (uint8_t code: by_first[data[0]]) {
+            const std::string &symbol = symbols[code];
+            if (symbol.size() <= len && memcmp(symbol.data(), data, symbol.size()) == 0) {
+                return code;
+            }
+        }
+        return -1;
+    }
+
+public:
+    static SymbolTable train(const std::vector<std::vector<uint8_t> > &samples, int rounds = 5) {
+        SymbolTable table;
+        for (int round = 0; round < rounds; round++) {
+            std::unordered_map<std::string, uint64_t> counts;
+            for (const auto &sample: samples) {
+                std::string previous;
+                for (size_t i = 0; i < sample.size();) {
+                    int code = table.match(sample.data() + i, sample.size() - i);
+                    std::string token = code >= 0 ? table.symbols[code]
+                                                  : std::string(1, static_cast<char>(sample[i]));
+                    i += token.size();
+                    counts[token]++;
+                    if (!previous.empty() && previous.size() + token.size() <= MAX_SYMBOL_LEN) {
+                        counts[previous + token]++;
+                    }
+                    previous = std::move(token);
+                }
+            }
+            std::vector<std::pair<uint64_t, std::string> > ranked;
+            for (auto &[symbol, count]: counts) {
+                ranked.emplace_back(count * symbol.size(), symbol);
+            }
+            size_t keep = std::min(ranked.size(), MAX_SYMBOLS);
+            std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                              [](const auto &a, const auto &b) { return a.first > b.first; });
+            table.symbols.clear();
+            for (size_t i = 0; i < keep; i++) {
+                table.symbols.push_back(std::move(ranked[i].second));
+            }
+            table.build_index();
+        }
+        return table;
+    }
+
+    void compress(const uint8_t *data, size_t len, std::vector<uint8_t> &out) const {
+        for (size_t i = 0; i < len;) {
+            int code = match(data + i, len - i);
+            if (code >= 0) {
+                out.push_back(code);
+                i += symbols[code].size();
+            } else {
+                out.push_back(ESCAPE);
+                out.push_back(data[i++]);
+            }
+        }
+    }
+
+    bool decompress(const uint8_t *data, size_t len, std::vector<uint8_t> &out) const {
+        out.clear();
+        for (size_t i = 0; i < len; i++) {
+            if (data[i] == ESCAPE) {
+                if (++i == len) {
+                    return false;
+                }
+                out.push_back(data[i]);
+            } else if (data[i] < symbols.size()) {
+                out.insert(out.end(), symbols[data[i]].begin(), symbols[data[i]].end());
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for (const std::string &symbol: symbols) {
+            bytes += symbol.size();
+        }
+        return bytes;
+    }
+};
+
+struct CompressionStats {
+    size_t entries;
+    size_t raw_bytes;
+    size_t stored_bytes;
+    size_t dictionary_bytes;
+    size_t dictionaries;
+    uint64_t compress_ns;
+    uint64_t decompress_ns;
+};
+
+// ConcurrentRedBlackTree that stores values compressed with a trained SymbolTable. Every
+// stored value starts with the id of the table that encoded it (0 = stored raw, used before
+// the first training or when compression would not help). Retraining installs a new table for
+// future puts, re-encodes values still on older tables, then frees those tables so their ids
+// can be reused. Every `sample_every`-th put copies its value into a small ring that retrain()
+// trains on, so tables follow the current workload.
+class CompressedRedBlackTree {
+public:
+    struct Options {
+        size_t sample_every = 16;
+        size_t sample_values = 512;
+        // A retrained table is installed only if it shrinks the sample by this much more.
+        double min_improvement = 0.05;
+    };
+
+private:
+    Options options;
+    ConcurrentRedBlackTree tree;
+    // Held shared by put from choosing a table until the value is stored, and by get from
+    // loading a value until it is decoded, so installing or freeing a table under the
+    // exclusive lock never races a value in flight.
+    mutable std::shared_mutex tables_mutex;
+    // tables[id - 1], null once freed.
+    std::vector<std::shared_ptr<const SymbolTable> > tables;
+    uint8_t current = 0;
+    std::mutex retrain_mutex;
+    uint64_t retrains = 0;
+
+    std::mutex samples_mutex;
+    std::vector<std::vector<uint8_t> > samples;
+    size_t sample_next = 0;
+    std::atomic<uint64_t> puts{0};
+
+    std::atomic<uint64_t> compress_ns{0};
+    mutable std::atomic<uint64_t> decompress_ns{0};
+
+    std::thread trainer;
+    std::mutex trainer_mutex;
+    std::condition_variable trainer_cv;
+    bool trainer_stopping = false;
+
+    // Callers hold tables_mutex.
+    const SymbolTable *table(uint8_t id) const {
+        return id == 0 || id > tables.size() ? nullptr : tables[id - 1].get();
+    }
+
+    static size_t encoded_size(const SymbolTable *symbols, const std::vector<std::vector<uint8_t> > &values) {
+        size_t total = 0;
+        std::vector<uint8_t> out;
+        for (const auto &value: values) {
+            out.clear();
+            if (symbols != nullptr) {
+                symbols->compress(value.data(), value.size(), out);
+            }
+            total += symbols == nullptr ? value.size() : std::min(out.size(), value.size());
+        }
+        return total;
+    }
+
+    // Callers hold tables_mutex.
+    bool decode(const std::vector<uint8_t> &stored, std::vector<uint8_t> &out_value) const {
+        if (stored.empty()) {
+            return false;
+        }
+        if (stored[0] == 0) {
+            out_value.assign(stored.begin() + 1, stored.end());
+            return true;
+        }
+        const SymbolTable *symbols = table(stored[0]);
+        return symbols != nullptr && symbols->decompress(stored.data() + 1, stored.size() - 1, out_value);
+    }
+
+    // Encodes with the current table, or raw if that would not be smaller. Callers hold
+    // tables_mutex.
+    std::vector<uint8_t> encode(const std::vector<uint8_t> &value) const {
+        const SymbolTable *symbols = table(current);
+        std::vector<uint8_t> stored = {current};
+        if (symbols != nullptr) {
+            symbols->compress(value.data(), value.size(), stored);
+        }
+        if (symbols == nullptr || stored.size() > value.size() + 1) {
+            stored.assign(1, 0);
+            stored.insert(stored.end(), value.begin(), value.end());
+        }
+        return stored;
+    }
+
+    // Rewrites every value encoded with a table other than the current one, a batch at a
+    // time. A value is replaced only if it is unchanged; one overwritten meanwhile was
+    // encoded with the current table anyway. Called with retrain_mutex held.
+    void reencode() {
+        static constexpr size_t BATCH = 256;
+        struct Rewrite {
+            std::vector<uint8_t> key;
+            std::vector<uint8_t> old;
+            std::vector<uint8_t> encoded;
+        };
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > entries;
+        std::vector<Rewrite> rewrites;
+        std::vector<uint8_t> start;
+        std::vector<uint8_t> value;
+        do {
+            entries.clear();
+            tree.scan(start, BATCH, entries);
+            rewrites.clear();
+            {
+                std::shared_lock lock(tables_mutex);
+                for (auto &[key, stored]: entries) {
+                    if (!stored.empty() && stored[0] != 0 && stored[0] != current && decode(stored, value)) {
+                        rewrites.push_back(Rewrite{key, std::move(stored), encode(value)});
+                    }
+                }
+            }
+            if (!rewrites.empty()) {
+                tree.transact([&rewrites](const RedBlackTree &t, ConcurrentRedBlackTree::WriteSet &writes) {
+                    std::vector<uint8_t> now;
+                    for (Rewrite &rewrite: rewrites) {
+                        if (t.get(rewrite.key, now) && now == rewrite.old) {
+                            writes[rewrite.key] = {true, std::move(rewrite.encoded)};
+                        }
+                    }
+                    return true;
+                });
+            }
+            if (!entries.empty()) {
+                start = entries.back().first;
+                start.push_back(0);
+            }
+        } while (entries.size() == BATCH);
+    }
+
+public:
+    explicit CompressedRedBlackTree(const Options &opts) : options(opts) {
+    }
+
+    CompressedRedBlackTree() : CompressedRedBlackTree(Options()) {
+    }
+
+    ~CompressedRedBlackTree() {
+        stop_retraining();
+    }
+
+    void put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        if (puts++ % options.sample_every == 0) {
+            std::lock_guard lock(samples_mutex);
+            if (samples.size() < options.sample_values) {
+                samples.push_back(value);
+            } else {
+                samples[sample_next++ % samples.size()] = value;
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::shared_lock lock(tables_mutex);
+        std::vector<uint8_t> stored = encode(value);
+        compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        tree.put(key, std::make_shared<const std::vector<uint8_t> >(std::move(stored)));
+    }
+
+    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) const {
+        ValueRef stored;
+        std::shared_lock lock(tables_mutex);
+        if (!tree.get_ref(key, stored)) {
+            return false;
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool ok = decode(*stored, out_value);
+        decompress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return ok;
+    }
+
+    bool erase(const std::vector<uint8_t> &key) {
+        return tree.erase(key);
+    }
+
+    size_t size() const {
+        return tree.size();
+    }
+
+    // Trains a table on the sampled values and installs it if it beats the current one, then
+    // re-encodes the values on older tables and frees them.
+    bool retrain() {
+        std::lock_guard retraining(retrain_mutex);
+        std::vector<std::vector<uint8_t> > sample;
+        {
+            std::lock_guard lock(samples_mutex);
+            sample = samples;
+        }
+        if (sample.empty()) {
+            return false;
+        }
+        auto candidate = std::make_shared<const SymbolTable>(SymbolTable::train(sample));
+        std::shared_ptr<const SymbolTable> installed;
+        {
+            std::shared_lock lock(tables_mutex);
+            if (current != 0) {
+                installed = tables[current - 1];
+            }
+        }
+        size_t before = encoded_size(installed.get(), sample);
+        size_t after = encoded_size(candidate.get(), sample);
+        if (after > before * (1 - options.min_improvement)) {
+            return false;
+        }
+        {
+            // Only the current table survives a retrain, so a free id always exists.
+            std::unique_lock lock(tables_mutex);
+            size_t slot = std::find(tables.begin(), tables.end(), nullptr) - tables.begin();
+            if (slot == tables.size()) {
+                tables.emplace_back();
+            }
+            tables[slot] = std::move(candidate);
+            current = slot + 1;
+        }
+        // Puts from here on use the new table, so one pass catches every older value.
+        reencode();
+        std::unique_lock lock(tables_mutex);
+        for (size_t i = 0; i < tables.size(); i++) {
+            if (i + 1 != current) {
+                tables[i] = nullptr;
+            }
+        }
+        retrains++;
+        return true;
+    }
+
+    uint64_t get_retrains() {
+        std::lock_guard lock(retrain_mutex);
+        return retrains;
+    }
+
+    // False if retraining is already running.
+    bool start_retraining(std::chrono::milliseconds interval) {
+        if (trainer.joinable()) {
+            return false;
+        }
+        trainer = std::thread([this, interval]() {
+            std::unique_lock lock(trainer_mutex);
+            while (!trainer_cv.wait_for(lock, interval, [this]() { return trainer_stopping; })) {
+                lock.unlock();
+                retrain();
+                lock.lock();
+            }
+        });
+        return true;
+    }
+
+    void stop_retraining() {
+        if (!trainer.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard lock(trainer_mutex);
+            trainer_stopping = true;
+        }
+        trainer_cv.notify_all();
+        trainer.join();
+        trainer_stopping = false;
+    }
+
+    // Walks every value, so meant for reporting rather than the hot path. Holds only shared
+    // locks: readers continue, and writers wait for the walk.
+    CompressionStats stats() {
+        CompressionStats result{0, 0, 0, 0, 0, compress_ns.load(), decompress_ns.load()};
+        std::shared_lock lock(tables_mutex);
+        for (const auto &symbols: tables) {
+            if (symbols != nullptr) {
+                result.dictionaries++;
+                result.dictionary_bytes += symbols->memory_bytes();
+            }
+        }
+        std::vector<uint8_t> value;
+        tree.visit([&](const RedBlackTree &t) {
+            t.for_each([&](const std::vector<uint8_t> &, const std::vector<uint8_t> &stored) {
+                result.entries++;
+                result.stored_bytes += stored.size();
+                if (decode(stored, value)) {
+                    result.raw_bytes += value.size();
+                }
+            });
+        });
+        return result;
+    }
+};
+
+// PGM-index (piecewise geometric model) over a sorted array of u64 keys. Level 0 is a list of
+// segments (first key, slope, intercept) whose predicted position for every key is within
+// `epsilon` of its real position; each level above does the same for the first keys of the
+// segments below, until a single segment remains. A lookup walks down the levels, searching
+// only a window of 2 * epsilon + 2 entries at each.
+class PgmIndex {
+public:
+    struct Segment {
+        uint64_t key;
+        double slope;
+        double intercept;
+    };
+
+private:
+    size_t epsilon;
+    size_t size = 0;
+    // levels[0] indexes the data, levels.back() holds a single segment.
+    std::vector<std::vector<Segment> > levels;
+
+    // Greedy shrinking-cone fit: extend a segment while some slope keeps every key so far
+    // within epsilon, otherwise start a new one. Duplicates map to their first position.
+    template<typename KeyAt>
+    static std::vector<Segment> fit(size_t n, KeyAt key_at, size_t eps) {
+        std::vector<Segment> segments;
+        size_t i = 0;
+        while (i < n) {
+            uint64_t x0 = key_at(i);
+            double lo = 0;
+            double hi = std::numeric_limits<double>::infinity();
+            size_t j = i + 1;
+            for (; j < n; j++) {
+                uint64_t x = key_at(j);
+                if (x == key_at(j - 1)) {
+                    continue;
+                }
+                double dx = static_cast<double>(x - x0);
+                double dy = static_cast<double>(j - i);
+                double new_lo = (dy - eps) / dx;
+                double new_hi = (dy + eps) / dx;
+                if (new_lo > hi || new_hi < lo) {
+                    break;
+                }
+                lo = std::max(lo, new_lo);
+                hi = std::min(hi, new_hi);
+            }
+            double slope = hi == std::numeric_limits<double>::infinity() ? 0 : (lo + hi) / 2;
+            segments.push_back(Segment{x0, slope, static_cast<double>(i)});
+            i = j;
+        }
+        return segments;
+    }
+
+    // Keys past a segment's last point (gaps between segments) clamp to where the next one starts.
+    static size_t predict(const std::vector<Segment> &level, size_t segment, uint64_t key, size_t n) {
+        const Segment &s = level[segment];
+        double position = s.intercept + s.slope * static_cast<double>(key - std::min(key, s.key));
+        double limit = segment + 1 < level.size() ? level[segment + 1].intercept : static_cast<double>(n - 1);
+        return static_cast<size_t>(std::min(position, limit));
+    }
+
+    // lower_bound over n entries near `guess`, widening the window if the prediction was off
+    // (only possible for keys that are not in the set).
+    template<typename KeyAt>
+    size_t search(size_t n, KeyAt key_at, uint64_t key, size_t guess) const {
+        size_t lo = guess > epsilon + 1 ? guess - epsilon - 1 : 0;
+        size_t hi = std::min(n, guess + epsilon + 2);
+        for (size_t step = epsilon + 1; lo > 0 && key_at(lo - 1) >= key; step *= 2) {
+            lo = lo > step ? lo - step : 0;
+        }
+        for (size_t step = epsilon + 1; hi < n && key_at(hi - 1) < key; step *= 2) {
+            hi = std::min(n, hi + step);
+        }
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (key_at(mid) < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+public:
+    explicit PgmIndex(size_t eps = 32) : epsilon(eps) {
+    }
+
+    void build(const std::vector<uint64_t> &keys) {
+        size = keys.size();
+        levels.clear();
+        if (keys.empty()) {
+            return;
+        }
+        levels.push_back(fit(keys.size(), [&keys](size_t i) { return keys[i]; }, epsilon));
+        while (levels.back().size() > 1) {
+            const std::vector<Segment> &below = levels.back();
+            levels.push_back(fit(below.size(), [&below](size_t i) { return below[i].key; }, epsilon));
+        }
+    }
+
+    // Position of the first key >= `key` in the array the index was built from.
+    size_t lower_bound(const std::vector<uint64_t> &keys, uint64_t key) const {
+        if (size == 0) {
+            return 0;
+        }
+        size_t segment = 0;
+        for (size_t level = levels.size() - 1; level > 0; level--) {
+            const std::vector<Segment> &below = levels[level - 1];
+            size_t guess = predict(levels[level], segment, key, below.size());
+            size_t pos = search(below.size(), [&below](size_t i) { return below[i].key; }, key, guess);
+            // The segment responsible for `key` is the last one starting at or before it.
+            segment = pos < below.size() && below[pos].key == key ? pos : (pos > 0 ? pos - 1 : 0);
+        }
+        size_t guess = predict(levels[0], segment, key, size);
+        return search(size, [&keys](size_t i) { return keys[i]; }, key, guess);
+    }
+
+    size_t segment_count() const {
+        size_t total = 0;
+        for (const auto &level: levels) {
+            total += level.size();
+        }
+        return total;
+    }
+
+    size_t level_count() const {
+        return levels.size();
+    }
+
+    size_t memory_bytes() const {
+        return segment_count() * sizeof(Segment);
+    }
+};
+
+// Sorted u64 keys in Eytzinger (BFS) order: a lower_bound walks an implicit binary tree whose
+// first levels share cache lines, which beats a plain binary search on large arrays.
+class EytzingerIndex {
+private:
+    // Slot 0 is unused; slot k has children 2k and 2k + 1.
+    std::vector<uint64_t> layout;
+
+    size_t fill(const std::vector<uint64_t> &keys, size_t i, size_t k) {
+        if (k < layout.size()) {
+            i = fill(keys, i, 2 * k);
+            layout[k] = keys[i++];
+            i = fill(keys, i, 2 * k + 1);
+        }
+        return i;
+    }
+
+public:
+    void build(const std::vector<uint64_t> &keys) {
+        layout.assign(keys.size() + 1, 0);
+        fill(keys, 0, 1);
+    }
+
+    // Smallest key >= `key`; false if there is none.
+    bool lower_bound(uint64_t key, uint64_t &out_key) const {
+        size_t k = 1;
+        while (k < layout.size()) {
+            k = 2 * k + (layout[k] < key);
+        }
+        k >>= __builtin_ffsll(~k);
+        if (k == 0) {
+            return false;
+        }
+        out_key = layout[k];
+        return true;
+    }
+};
+
+// Immutable, sorted copy of a tree for read-only serving, located with a PgmIndex. Keys are
+// projected to u64 from the 8 bytes after the prefix all keys share (big-endian, so the
+// projection keeps key order); keys with equal projections are told apart by a short scan.
+class FrozenSnapshot {
+private:
+    std::vector<std::vector<uint8_t> > keys;
+    std::vector<std::vector<uint8_t> > values;
+    std::vector<uint64_t> projected;
+    size_t common_prefix = 0;
+    PgmIndex index;
+
+    uint64_t project(const std::vector<uint8_t> &key) const {
+        uint64_t value = 0;
+        for (size_t i = 0; i < sizeof(uint64_t); i++) {
+            size_t at = common_prefix + i;
+            value = (value << 8) | (at < key.size() ? key[at] : 0);
+        }
+        return value;
+    }
+
+    // Indexes `keys`, which are sorted.
+    void index_keys() {
+        common_prefix = 0;
+        if (!keys.empty()) {
+            const std::vector<uint8_t> &first = keys.front();
+            const std::vector<uint8_t> &last = keys.back();
+            while (common_prefix < first.size() && common_prefix < last.size() &&
+                   first[common_prefix] == last[common_prefix]) {
+                common_prefix++;
+            }
+        }
+        projected.clear();
+        for (const auto &key: keys) {
+            projected.push_back(project(key));
+        }
+        index.build(projected);
+    }
+
+public:
+    explicit FrozenSnapshot(size_t epsilon = 32) : index(epsilon) {
+    }
+
+    void build(const RedBlackTree &tree) {
+        keys.clear();
+        values.clear();
+        tree.for_each([this](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            keys.push_back(key);
+            values.push_back(value);
+        });
+        index_keys();
+    }
+
+    // Reads a file written by RedBlackTree::save_snapshot straight into the sorted arrays; the
+    // file is already in key order, so no tree is built. Unchanged if the file is unreadable
+    // or out of order.
+    bool load(const std::string &path) {
+        std::vector<std::vector<uint8_t> > loaded_keys;
+        std::vector<std::vector<uint8_t> > loaded_values;
+        auto append = [&](std::vector<uint8_t> &key, std::vector<uint8_t> &value) {
+            if (!loaded_keys.empty() && compare_keys(loaded_keys.back(), key) >= 0) {
+                return false;
+            }
+            loaded_keys.push_back(std::move(key));
+            loaded_values.push_back(std::move(value));
+            return true;
+        };
+        if (!RedBlackTree::read_snapshot_file(path, append)) {
+            return false;
+        }
+        keys.swap(loaded_keys);
+        values.swap(loaded_values);
+        index_keys();
+        return true;
+    }
+
+    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) const {
+        // Every key between the first and the last shares their common prefix.
+        if (keys.empty() || compare_keys(key, keys.front()) < 0 || compare_keys(key, keys.back()) > 0) {
+            return false;
+        }
+        // Keys agreeing on all 8 projected bytes are told apart by binary search, so long
+        // shared prefixes cost O(log n) compares rather than a scan.
+        uint64_t target = project(key);
+        auto first = projected.begin() + index.lower_bound(projected, target);
+        auto last = std::upper_bound(first, projected.end(), target);
+        auto it = std::lower_bound(keys.begin() + (first - projected.begin()), keys.begin() + (last - projected.begin()),
+                                   key, [](const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+                                       return compare_keys(a, b) < 0;
+                                   });
+        if (it == keys.begin() + (last - projected.begin()) || *it != key) {
+            return false;
+        }
+        out_value = values[it - keys.begin()];
+        return true;
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    const PgmIndex &get_index() const {
+        return index;
+    }
+};
+
+// Key of exactly N bytes stored inline. N is a compile-time constant, so compare() unrolls into
+// N / 8 big-endian 64-bit compares plus at most one short tail, with no length checks.
+template<size_t N>
+struct FixedKey {
+    uint8_t bytes[N];
+
+    static bool from(const std::vector<uint8_t> &key, FixedKey &out) {
+        if (key.size() != N) {
+            return false;
+        }
+        memcpy(out.bytes, key.data(), N);
+        return true;
+    }
+
+    std::vector<uint8_t> to_vector() const {
+        return std::vector<uint8_t>(bytes, bytes + N);
+    }
+
+    const uint8_t *data() const {
+        return bytes;
+    }
+
+    static constexpr size_t size() {
+        return N;
+    }
+
+    int compare(const FixedKey &other) const {
+        for (size_t i = 0; i + sizeof(uint64_t) <= N; i += sizeof(uint64_t)) {
+            uint64_t a;
+            uint64_t b;
+            memcpy(&a, bytes + i, sizeof(a));
+            memcpy(&b, other.bytes + i, sizeof(b));
+            if (a != b) {
+                if constexpr (std::endian::native == std::endian::little) {
+                    a = __builtin_bswap64(a);
+                    b = __builtin_bswap64(b);
+                }
+                return a < b ? -1 : 1;
+            }
+        }
+        if constexpr (N % sizeof(uint64_t) != 0) {
+            size_t tail = N - N % sizeof(uint64_t);
+            return memcmp(bytes + tail, other.bytes + tail, N - tail);
+        }
+        return 0;
+    }
+};
+
+template<size_t N>
+int compare_keys(const FixedKey<N> &a, const FixedKey<N> &b) {
+    return a.compare(b);
+}
+
+// The tree specialized for FixedKey<N> keys (UUIDs, hashes, packed integers). Keys live in the
+// node instead of a separate heap buffer, so a lookup touches one allocation per level.
+template<size_t N>
+using FixedKeyRedBlackTree = BasicRedBlackTree<FixedKey<N> >;
+
+// Bounded single-producer single-consumer ring. Head and tail sit on their own cache lines, and
+// each side caches the other's index so it only reads the shared one when the ring looks full
+// (producer) or empty (consumer).
+template<typename T>
+class SpscRing {
+private:
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t cached_head = 0;
+    alignas(64) std::atomic<size_t> head{0};
+    size_t cached_tail = 0;
+
+public:
+    // Capacity is rounded up to a power of two.
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Producer only. Moves up to n items in; returns how many fit.
+    size_t try_push_batch(T *items, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t + n - cached_head > slots.size()) {
+            cached_head = head.load(std::memory_order_acquire);
+        }
+        n = std::min(n, slots.size() - (t - cached_head));
+        for (size_t i = 0; i < n; i++) {
+            slots[(t + i) & mask] = std::move(items[i]);
+        }
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    bool try_push(T &&item) {
+        return try_push_batch(&item, 1) == 1;
+    }
+
+    // Consumer only. Moves up to `max` items out; returns how many there were.
+    size_t try_pop_batch(T *out, size_t max) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (cached_tail - h < max) {
+            cached_tail = tail.load(std::memory_order_acquire);
+        }
+        size_t n = std::min(max, cached_tail - h);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = std::move(slots[(h + i) & mask]);
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    bool try_pop(T &out) {
+        return try_pop_batch(&out, 1) == 1;
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+};
+
+// Bounded multi-producer single-consumer ring (Vyukov's sequence-numbered slots). A producer
+// claims positions with one CAS on tail and publishes each slot by bumping its sequence; the
+// consumer frees slots in order, so a free last slot means the whole claimed range is free.
+template<typename T>
+class MpscRing {
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t size;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0;
+
+public:
+    // Capacity is rounded up to a power of two, and to at least two slots: with one, a published
+    // slot's sequence would equal a free one's.
+    explicit MpscRing(size_t capacity) {
+        size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        mask = size - 1;
+        slots.reset(new Slot[size]);
+        for (size_t i = 0; i < size; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. Moves all n items in as one contiguous run, or none if they do not fit.
+    bool try_push_batch(T *items, size_t n) {
+        if (n == 0 || n > size) {
+            return n == 0;
+        }
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (true) {
+            size_t last = position + n - 1;
+            size_t sequence = slots[last & mask].sequence.load(std::memory_order_acquire);
+            if (sequence == last) {
+                if (tail.compare_exchange_weak(position, position + n, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (sequence < last) {
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            Slot &slot = slots[(position + i) & mask];
+            slot.value = std::move(items[i]);
+            slot.sequence.store(position + i + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+    bool try_push(T &&item) {
+        return try_push_batch(&item, 1);
+    }
+
+    // Consumer only. Stops at the first slot a producer has claimed but not yet published.
+    size_t try_pop_batch(T *out, size_t max) {
+        size_t n = 0;
+        while (n < max) {
+            Slot &slot = slots[head & mask];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+                break;
+            }
+            out[n++] = std::move(slot.value);
+            slot.sequence.store(head + size, std::memory_order_release);
+            head++;
+        }
+        return n;
+    }
+
+    bool try_pop(T &out) {
+        return try_pop_batch(&out, 1) == 1;
+    }
+
+    // Consumer only. True when the next slot has not been published yet.
+    bool empty() const {
+        return slots[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+    }
+
+    size_t capacity() const {
+        return size;
+    }
+};
+
+// Pipelined ingest: producer threads parse and encode entries and hand them to submit();
+// applier threads drain the rings in mini-batches and write each with one put_batch, which
+// sorts it and merges it under a single lock acquisition. A key always goes to the same
+// applier, so writes to it from one producer are applied in order.
+class IngestPipeline {
+public:
+    struct Options {
+        size_t ring_capacity = 8192;
+        size_t max_batch = 1024;
+        unsigned appliers = 1;
+    };
+
+private:
+    struct Applier {
+        MpscRing<KeyValue> ring;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<bool> sleeping{false};
+
+        explicit Applier(size_t capacity) : ring(capacity) {
+        }
+    };
+
+    ConcurrentRedBlackTree &tree;
+    Options options;
+    std::vector<std::unique_ptr<Applier> > appliers;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> applied{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> full_waits{0};
+
+    size_t route(const std::vector<uint8_t> &key) const {
+        return appliers.size() == 1 ? 0 : hash_bytes(key.data(), key.size()) % appliers.size();
+    }
+
+    static void wake(Applier &applier) {
+        if (applier.sleeping.load(std::memory_order_acquire)) {
+            std::lock_guard lock(applier.mutex);
+            applier.cv.notify_one();
+        }
+    }
+
+    void apply_loop(Applier &applier) {
+        std::vector<KeyValue> batch(options.max_batch);
+        std::vector<KeyValue> pending;
+        int idle = 0;
+        while (true) {
+            // Read stopping first: anything submitted before close() is in the ring by then.
+            bool last_round = stopping.load(std::memory_order_acquire);
+            size_t n = applier.ring.try_pop_batch(batch.data(), batch.size());
+            if (n == 0) {
+                if (last_round) {
+                    return;
+                }
+                if (++idle < 64) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                // Park. Timed so a submit that races with going to sleep costs at most a millisecond.
+                std::unique_lock lock(applier.mutex);
+                applier.sleeping = true;
+                applier.cv.wait_for(lock, std::chrono::milliseconds(1), [&] {
+                    return stopping.load() || !applier.ring.empty();
+                });
+                applier.sleeping = false;
+                idle = 0;
+                continue;
+            }
+            idle = 0;
+            pending.assign(std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.begin() + n));
+            tree.put_batch(pending, 1);
+            applied += n;
+            batches++;
+        }
+    }
+
+public:
+    IngestPipeline(ConcurrentRedBlackTree &t, const Options &opts) : tree(t), options(opts) {
+        for (unsigned i = 0; i < std::max(1u, options.appliers); i++) {
+            appliers.emplace_back(new Applier(options.ring_capacity));
+        }
+        for (auto &applier: appliers) {
+            Applier *a = applier.get();
+            a->thread = std::thread([this, a] { apply_loop(*a); });
+        }
+    }
+
+    explicit IngestPipeline(ConcurrentRedBlackTree &t) : IngestPipeline(t, Options()) {
+    }
+
+    IngestPipeline(const IngestPipeline &) = delete;
+    IngestPipeline &operator=(const IngestPipeline &) = delete;
+
+    ~IngestPipeline() {
+        close();
+    }
+
+    // Any thread. Waits while the applier's ring is full.
+    void submit(KeyValue &&entry) {
+        Applier &applier = *appliers[route(entry.first)];
+        while (!applier.ring.try_push(std::move(entry))) {
+            full_waits++;
+            std::this_thread::yield();
+        }
+        wake(applier);
+    }
+
+    // Any thread. Entries for the same applier are enqueued as one run.
+    void submit_batch(std::vector<KeyValue> &entries) {
+        std::vector<std::vector<KeyValue> > groups(appliers.size());
+        for (auto &entry: entries) {
+            groups[route(entry.first)].push_back(std::move(entry));
+        }
+        for (size_t i = 0; i < groups.size(); i++) {
+            std::vector<KeyValue> &group = groups[i];
+            Applier &applier = *appliers[i];
+            size_t chunk = std::max<size_t>(1, applier.ring.capacity() / 2);
+            for (size_t offset = 0; offset < group.size();) {
+                size_t n = std::min(group.size() - offset, chunk);
+                if (applier.ring.try_push_batch(group.data() + offset, n)) {
+                    offset += n;
+                    wake(applier);
+                } else {
+                    full_waits++;
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    // Applies everything submitted so far and stops the appliers.
+    void close() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        for (auto &applier: appliers) {
+            {
+                std::lock_guard lock(applier->mutex);
+                applier->cv.notify_one();
+            }
+            applier->thread.join();
+        }
+    }
+
+    uint64_t get_applied() const {
+        return applied.load();
+    }
+
+    uint64_t get_batches() const {
+        return batches.load();
+    }
+
+    uint64_t get_full_waits() const {
+        return full_waits.load();
+    }
+};
+
+struct TraceRecord {
+    uint64_t ns;
+    uint32_t thread;
+    TraceOp op;
+    uint64_t value_size;
+    std::vector<uint8_t> key;
+};
+
+// Reads a capture into records ordered by time; records of one thread keep their order.
+static bool load_trace(const std::string &path, std::vector<TraceRecord> &out) {
+    out.clear();
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    // Block headers are untrusted: a payload must fit in the rest of the file before it is
+    // allocated, and every record takes at least 4 bytes.
+    off_t size = fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : -1;
+    uint32_t header[2];
+    bool ok = size >= 0 && fseeko(file, 0, SEEK_SET) == 0 && fread(header, sizeof(header), 1, file) == 1 &&
+              header[0] == TRACE_MAGIC && header[1] == TRACE_VERSION;
+    std::vector<uint8_t> payload;
+    while (ok) {
+        uint32_t block[3];
+        uint64_t base_ns;
+        if (fread(block, sizeof(block), 1, file) != 1) {
+            break;
+        }
+        off_t remaining = size - ftello(file) - static_cast<off_t>(sizeof(base_ns));
+        if (remaining < static_cast<off_t>(block[2]) || block[1] > block[2] / 4) {
+            ok = false;
+            break;
+        }
+        payload.resize(block[2]);
+        if (fread(&base_ns, sizeof(base_ns), 1, file) != 1 ||
+            fread(payload.data(), 1, payload.size(), file) != payload.size()) {
+            ok = false;
+            break;
+        }
+        const uint8_t *data = payload.data();
+        const uint8_t *end = data + payload.size();
+        uint64_t ns = base_ns;
+        for (uint32_t i = 0; i < block[1] && ok; i++) {
+            TraceRecord record;
+            uint64_t delta;
+            uint64_t key_len;
+            ok = data < end && *data >= static_cast<uint8_t>(TraceOp::PUT) &&
+                 *data <= static_cast<uint8_t>(TraceOp::SCAN);
+            if (!ok) {
+                break;
+            }
+            record.op = static_cast<TraceOp>(*data++);
+            ok = read_varint(data, end, delta) && read_varint(data, end, key_len) &&
+                 key_len <= static_cast<uint64_t>(end - data);
+            if (!ok) {
+                break;
+            }
+            record.key.assign(data, data + key_len);
+            data += key_len;
+            ok = read_varint(data, end, record.value_size);
+            ns += delta;
+            record.ns = ns;
+            record.thread = block[0];
+            out.push_back(std::move(record));
+        }
+        ok = ok && data == end;
+    }
+    fclose(file);
+    std::stable_sort(out.begin(), out.end(), [](const TraceRecord &a, const TraceRecord &b) {
+        return a.ns < b.ns;
+    });
+    return ok;
+}
+
+struct LatencySummary {
+    uint64_t count = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p90_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t p999_ns = 0;
+    uint64_t max_ns = 0;
+
+    static LatencySummary of(std::vector<uint64_t> &samples) {
+        LatencySummary summary;
+        summary.count = samples.size();
+        if (samples.empty()) {
+            return summary;
+        }
+        std::sort(samples.begin(), samples.end());
+        auto at = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+        };
+        summary.p50_ns = at(0.50);
+        summary.p90_ns = at(0.90);
+        summary.p99_ns = at(0.99);
+        summary.p999_ns = at(0.999);
+        summary.max_ns = samples.back();
+        return summary;
+    }
+};
+
+struct ReplayReport {
+    uint64_t ops = 0;
+    uint64_t skipped = 0;
+    uint64_t elapsed_us = 0;
+    uint64_t trace_us = 0;
+    double ops_per_sec = 0;
+    // Indexed by TraceOp; slot 0 covers every operation.
+    LatencySummary latency[5];
+};
+
+struct ReplayOptions {
+    // 1 replays at the captured rate, 4 four times faster, 0 as fast as possible.
+    double speed = 1.0;
+};
+
+// Re-issues a trace against any engine with put/get and optionally erase/scan. Each captured
+// thread gets its own replay thread and issues its records in the captured order, so runs
+// see the same per-thread operation streams; values are filled with a byte derived from the
+// key. When paced, latency is measured from the scheduled time, so an engine that falls
+// behind is charged for the queueing it causes rather than only for service time.
+template<typename Engine>
+ReplayReport replay_trace(Engine &engine, const std::vector<TraceRecord> &trace, const ReplayOptions &options) {
+    uint32_t num_threads = 0;
+    for (const TraceRecord &record: trace) {
+        num_threads = std::max(num_threads, record.thread + 1);
+    }
+    std::vector<std::vector<const TraceRecord *> > streams(num_threads);
+    for (const TraceRecord &record: trace) {
+        streams[record.thread].push_back(&record);
+    }
+    std::vector<std::array<std::vector<uint64_t>, 5> > latencies(num_threads);
+    std::atomic<uint64_t> skipped{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::vector<uint8_t> value;
+            std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > scanned;
+            for (const TraceRecord *record: streams[t]) {
+                auto issue = std::chrono::steady_clock::now();
+                if (options.speed > 0) {
+                    auto due = start + std::chrono::nanoseconds(static_cast<uint64_t>(record->ns / options.speed));
+                    while (issue < due) {
+                        if (due - issue > std::chrono::microseconds(100)) {
+                            std::this_thread::sleep_for(due - issue - std::chrono::microseconds(50));
+                        } else {
+                            std::this_thread::yield();
+                        }
+                        issue = std::chrono::steady_clock::now();
+                    }
+                    issue = due;
+                }
+                bool done = true;
+                switch (record->op) {
+                    case TraceOp::PUT:
+                        value.assign(record->value_size,
+                                     static_cast<uint8_t>(hash_bytes(record->key.data(), record->key.size())));
+                        engine.put(record->key, value);
+                        break;
+                    case TraceOp::GET:
+                        engine.get(record->key, value);
+                        break;
+                    case TraceOp::ERASE:
+                        if constexpr (requires { engine.erase(record->key); }) {
+                            engine.erase(record->key);
+                        } else {
+                            done = false;
+                        }
+                        break;
+                    case TraceOp::SCAN:
+                        if constexpr (requires { engine.scan(record->key, size_t(), scanned); }) {
+                            scanned.clear();
+                            engine.scan(record->key, record->value_size, scanned);
+                        } else {
+                            done = false;
+                        }
+                        break;
+                }
+                if (!done) {
+                    skipped++;
+                    continue;
+                }
+                uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - issue).count();
+                latencies[t][static_cast<size_t>(record->op)].push_back(ns);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    ReplayReport report;
+    report.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    report.trace_us = trace.empty() ? 0 : trace.back().ns / 1000;
+    report.skipped = skipped.load();
+    std::vector<uint64_t> all;
+    for (size_t op = 1; op < 5; op++) {
+        std::vector<uint64_t> samples;
+        for (auto &per_thread: latencies) {
+            samples.insert(samples.end(), per_thread[op].begin(), per_thread[op].end());
+        }
+        all.insert(all.end(), samples.begin(), samples.end());
+        report.latency[op] = LatencySummary::of(samples);
+    }
+    report.latency[0] = LatencySummary::of(all);
+    report.ops = report.latency[0].count;
+    report.ops_per_sec = report.ops * 1e6 / std::max<uint64_t>(1, report.elapsed_us);
+    return report;
+}
+
+static void print_replay_report(const ReplayReport &report) {
+    printf("Replayed %llu ops in %.1f ms (trace spans %.1f ms): %.0f ops/s, %llu skipped\n",
+           (unsigned long long) report.ops, report.elapsed_us / 1000.0, report.trace_us / 1000.0,
+           report.ops_per_sec, (unsigned long long) report.skipped);
+    const char *names[5] = {"all", "put", "get", "erase", "scan"};
+    for (size_t op = 0; op < 5; op++) {
+        const LatencySummary &l = report.latency[op];
+        if (l.count == 0) {
+            continue;
+        }
+        printf("  %-5s %8llu ops  p50 %7.1f us  p90 %7.1f us  p99 %7.1f us  p99.9 %7.1f us  max %8.1f us\n",
+               names[op], (unsigned long long) l.count, l.p50_ns / 1000.0, l.p90_ns / 1000.0,
+               l.p99_ns / 1000.0, l.p999_ns / 1000.0, l.max_ns / 1000.0);
+    }
+}
+
+// `ytdb replay <trace> [--speed X] [--engine concurrent|sharded] [--snapshot path]`: loads an
+// optional snapshot into the chosen engine, replays the trace and prints the report.
+static int replay_main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s replay <trace> [--speed X] [--engine concurrent|sharded] [--snapshot path]\n",
+                argv[0]);
+        return 2;
+    }
+    ReplayOptions options;
+    std::string engine_name = "concurrent";
+    std::string snapshot;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--speed") == 0) {
+            options.speed = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--engine") == 0) {
+            engine_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            snapshot = argv[i + 1];
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    std::vector<TraceRecord> trace;
+    if (!load_trace(argv[2], trace)) {
+        fprintf(stderr, "cannot read trace %s\n", argv[2]);
+        return 1;
+    }
+    RedBlackTree initial;
+    if (!snapshot.empty() && !initial.load_snapshot(snapshot)) {
+        fprintf(stderr, "cannot read snapshot %s\n", snapshot.c_str());
+        return 1;
+    }
+    printf("Trace %s: %zu records, engine %s, speed %g\n", argv[2], trace.size(), engine_name.c_str(), options.speed);
+    if (engine_name == "concurrent") {
+        ConcurrentRedBlackTree engine;
+        engine.atomically([&initial](RedBlackTree &tree) { tree.copy_from(initial); });
+        print_replay_report(replay_trace(engine, trace, options));
+    } else if (engine_name == "sharded") {
+        ShardedRedBlackTree engine;
+        initial.for_each([&engine](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            engine.put(key, value);
+        });
+        print_replay_report(replay_trace(engine, trace, options));
+    } else {
+        fprintf(stderr, "unknown engine %s\n", engine_name.c_str());
+        return 2;
+    }
+    return 0;
+}
+
+void test_concurrent_writes() {
+    printf("Test 1: Concurrent Writes\n");
+    ConcurrentRedBlackTree tree;
+    const int num_threads = 8;
+    const int ops_per_thread = 1000;
+
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&tree, t, ops_per_thread]() {
+            for (int i = 0; i < ops_per_thread; i++) {
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(t),
+                    static_cast<uint8_t>(i >> 8),
+                    static_cast<uint8_t>(i & 0xFF)
+                };
+                std::vector<uint8_t> value = {
+                    static_cast<uint8_t>(t * 100 + i)
+                };
+                tree.put(key, value);
+            }
+        });
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    // Verify all keys are present
+    int verified = 0;
+    for (int t = 0; t < num_threads; t++) {
+        for (int i = 0; i < ops_per_thread; i++) {
+            std::vector<uint8_t> key = {
+                static_cast<uint8_t>(t),
+                static_cast<uint8_t>(i >> 8),
+                static_cast<uint8_t>(i & 0xFF)
+            };
+            std::vector<uint8_t> result;
+            assert(tree.get(key, result) == true);
+            verified++;
+        }
+    }
+
+    printf("%d concurrent writes completed in %lld ms\n", num_threads * ops_per_thread, duration.count());
+    printf("All %d keys verified\n\n", verified);
+}
+
+void test_concurrent_reads() {
+    printf("Test 2: Concurrent Reads\n");
+    ConcurrentRedBlackTree tree;
+    const int num_keys = 1000;
+    const int num_reader_threads = 16;
+    const int reads_per_thread = 10000;
+
+    // Pre-populate tree
+    for (int i = 0; i < num_keys; i++) {
+        std::vector<uint8_t> key = {
+            static_cast<uint8_t>(i >> 8),
+            static_cast<uint8_t>(i & 0xFF)
+        };
+        std::vector<uint8_t> value = {
+            static_cast<uint8_t>(i)
+        };
+        tree.put(key, value);
+    }
+
+    std::atomic<int> successful_reads{0};
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (int t = 0; t < num_reader_threads; t++) {
+        threads.emplace_back([&tree, &successful_reads, num_keys, reads_per_thread, t]() {
+            for (int i = 0; i < reads_per_thread; i++) {
+                int idx = (t * 7919 + i * 31) % num_keys;
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(idx >> 8),
+                    static_cast<uint8_t>(idx & 0xFF)
+                };
+                std::vector<uint8_t> result;
+                if (tree.get(key, result)) {
+                    ++successful_reads;
+                }
+            }
+        });
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    printf("%d concurrent reads completed in %lld ms\n",
+           num_reader_threads * reads_per_thread, duration.count());
+    printf("%d successful reads\n\n", successful_reads.load());
+}
+
+void test_mixed_read_write() {
+    printf("Test 3: Mixed Read/Write Operations\n");
+    ConcurrentRedBlackTree tree;
+    const int num_writer_threads = 4;
+    const int num_reader_threads = 12;
+    const int ops_per_thread = 5000;
+
+    std::atomic<int> writes{0};
+    std::atomic<int> reads{0};
+
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Writer threads
+    for (int t = 0; t < num_writer_threads; t++) {
+        threads.emplace_back([&, t]() {
+            std::random_device rd;
+            std::mt19937 gen(rd());
+            std::uniform_int_distribution<> dis(0, 255);
+
+            for (int i = 0; i < ops_per_thread; i++) {
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(dis(gen)),
+                    static_cast<uint8_t>(dis(gen))
+                };
+                std::vector<uint8_t> value = {
+                    static_cast<uint8_t>(t),
+                    static_cast<uint8_t>(i & 0xFF)
+                };
+                tree.put(key, value);
+                ++writes;
+            }
+        });
+    }
+
+    // Reader threads
+    for (int t = 0; t < num_reader_threads; t++) {
+        threads.emplace_back([&]() {
+            std::random_device rd;
+            std::mt19937 gen(rd());
+            std::uniform_int_distribution<> dis(0, 255);
+
+            for (int i = 0; i < ops_per_thread; i++) {
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(dis(gen)),
+                    static_cast<uint8_t>(dis(gen))
+                };
+                std::vector<uint8_t> result;
+                tree.get(key, result);
+                ++reads;
+            }
+        });
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    printf("Mixed operations completed in %lld ms\n", duration.count());
+    printf("Writes: %d, Reads: %d, Ops/ms: %lld\n\n", writes.load(), reads.load(),
+           (writes.load() + reads.load()) / duration.count());
+}
+
+void test_background_snapshot() {
+    printf("Test 4: Background Snapshot (fork + copy-on-write)\n");
+    ConcurrentRedBlackTree tree;
+    const int num_keys = 200000;
+    const std::string path = "ytdb_snapshot.bin";
+
+    for (int i = 0; i < num_keys; i++) {
+        std::vector<uint8_t> key = {
+            static_cast<uint8_t>(i >> 16),
+            static_cast<uint8_t>(i >> 8),
+            static_cast<uint8_t>(i & 0xFF)
+        };
+        std::vector<uint8_t> value(32, static_cast<uint8_t>(i));
+        tree.put(key, value);
+    }
+
+    bool started = tree.start_background_save(path);
+    assert(started);
+
+    // Keep serving writes while the child serializes; these overwrite the first half of
+    // the keys and add new ones, none of which may appear in the snapshot.
+    auto write_start = std::chrono::high_resolution_clock::now();
+    int writes = 0;
+    for (int i = 0; i < num_keys / 2; i++) {
+        std::vector<uint8_t> key = {
+            static_cast<uint8_t>(i >> 16),
+            static_cast<uint8_t>(i >> 8),
+            static_cast<uint8_t>(i & 0xFF)
+        };
+        std::vector<uint8_t> value(32, 0xEE);
+        tree.put(key, value);
+        writes++;
+    }
+    for (int i = 0; i < 1000; i++) {
+        std::vector<uint8_t> key = {0xFF, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        tree.put(key, key);
+        writes++;
+    }
+    auto write_end = std::chrono::high_resolution_clock::now();
+    auto write_duration = std::chrono::duration_cast<std::chrono::milliseconds>(write_end - write_start);
+
+    SnapshotStats stats;
+    bool finished = tree.finish_background_save(stats);
+    assert(finished);
+    assert(stats.ok);
+    assert(stats.keys == static_cast<size_t>(num_keys));
+
+    RedBlackTree loaded;
+    bool loaded_ok = loaded.load_snapshot(path);
+    assert(loaded_ok);
+    assert(loaded.size() == static_cast<size_t>(num_keys));
+    for (int i = 0; i < num_keys; i += 997) {
+        std::vector<uint8_t> key = {
+            static_cast<uint8_t>(i >> 16),
+            static_cast<uint8_t>(i >> 8),
+            static_cast<uint8_t>(i & 0xFF)
+        };
+        std::vector<uint8_t> result;
+        assert(loaded.get(key, result));
+        assert(result == std::vector<uint8_t>(32, static_cast<uint8_t>(i)));
+    }
+    std::remove(path.c_str());
+
+    // A truncated snapshot, or one whose length field claims ~4 GB, is rejected without
+    // touching the tree or allocating for the bogus length.
+    std::vector<uint8_t> bytes;
+    loaded.serialize(bytes);
+    for (size_t cut: {size_t(0), size_t(10), bytes.size() / 2, bytes.size() - 1}) {
+        assert(!loaded.deserialize(bytes.data(), cut) && loaded.size() == static_cast<size_t>(num_keys));
+    }
+    std::vector<uint8_t> corrupt(bytes.begin(), bytes.begin() + 16);
+    corrupt.insert(corrupt.end(), {0xFF, 0xFF, 0xFF, 0xFF});
+    assert(!loaded.deserialize(corrupt.data(), corrupt.size()) && loaded.size() == static_cast<size_t>(num_keys));
+    assert(loaded.deserialize(bytes.data(), bytes.size()) && loaded.size() == static_cast<size_t>(num_keys));
+
+    printf("Snapshot of %zu keys: fork %llu us, save %llu ms, %zu bytes written\n",
+           stats.keys, (unsigned long long) stats.fork_us, (unsigned long long) (stats.duration_us / 1000),
+           stats.bytes_written);
+    printf("%d writes served during save in %lld ms, copy-on-write overhead %zu KB\n",
+           writes, write_duration.count(), stats.cow_bytes / 1024);
+    printf("Snapshot contents verified\n\n");
+}
+
+void test_background_scheduler() {
+    printf("Test 5: Background I/O Scheduler\n");
+    BackgroundScheduler::Options options;
+    options.num_threads = 1;
+    options.io_bytes_per_sec = 4.0 * 1024 * 1024;
+    options.io_burst_bytes = 256 * 1024;
+    options.target_p99_us = 500;
+    options.min_io_bytes_per_sec = 512 * 1024;
+    options.throttle_interval = std::chrono::milliseconds(10000);
+    BackgroundScheduler scheduler(options);
+
+    // Hold the only worker so the queued jobs are all ready when it frees up.
+    std::mutex gate;
+    gate.lock();
+    scheduler.submit(JobPriority::Backup, [&gate](TokenBucketRateLimiter &) {
+        std::lock_guard lock(gate);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    std::mutex order_mutex;
+    std::vector<JobPriority> order;
+    const JobPriority submitted[] = {
+        JobPriority::Backup, JobPriority::Compaction, JobPriority::Flush,
+        JobPriority::Backup, JobPriority::Flush, JobPriority::Compaction
+    };
+    for (JobPriority priority: submitted) {
+        scheduler.submit(priority, [&order_mutex, &order, priority](TokenBucketRateLimiter &) {
+            std::lock_guard lock(order_mutex);
+            order.push_back(priority);
+        });
+    }
+    gate.unlock();
+    scheduler.wait_idle();
+    assert(order.size() == 6);
+    for (size_t i = 1; i < order.size(); i++) {
+        assert(order[i - 1] <= order[i]);
+    }
+
+    // Flush jobs writing to a local directory through the token bucket.
+    const size_t file_size = 1024 * 1024;
+    const int num_files = 2;
+    std::vector<uint8_t> data(file_size, 0xAB);
+    std::atomic<int> files_written{0};
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_files; i++) {
+        std::string path = "ytdb_flush_" + std::to_string(i) + ".sst";
+        scheduler.submit(JobPriority::Flush, [&data, &files_written, path](TokenBucketRateLimiter &limiter) {
+            if (write_file_rate_limited(path, data, limiter)) {
+                ++files_written;
+            }
+            std::remove(path.c_str());
+        });
+    }
+    scheduler.wait_idle();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    assert(files_written.load() == num_files);
+    // 2 MB at 4 MB/s with a 256 KB burst cannot finish much faster than ~440 ms.
+    assert(duration.count() >= 350);
+
+    // Foreground p99 over target throttles background I/O, then it recovers.
+    for (int i = 0; i < 1000; i++) {
+        scheduler.record_foreground_latency(i % 50 == 0 ? 5000 : 100);
+    }
+    scheduler.adjust_throttle();
+    scheduler.adjust_throttle();
+    double throttled_rate = scheduler.rate_limiter().get_rate();
+    assert(throttled_rate == options.io_bytes_per_sec / 4);
+    for (int i = 0; i < 4096; i++) {
+        scheduler.record_foreground_latency(100);
+    }
+    for (int i = 0; i < 10; i++) {
+        scheduler.adjust_throttle();
+    }
+    assert(scheduler.rate_limiter().get_rate() == options.io_bytes_per_sec);
+
+    printf("Priority order verified for %zu jobs\n", order.size());
+    printf("%d MB of rate-limited flush writes at 4 MB/s took %lld ms\n",
+           static_cast<int>(num_files * file_size / (1024 * 1024)), duration.count());
+    printf("Throttled to %.0f KB/s under p99 pressure (%llu throttle events), recovered to %.0f KB/s\n\n",
+           throttled_rate / 1024, (unsigned long long) scheduler.get_throttle_events(),
+           scheduler.rate_limiter().get_rate() / 1024);
+}
+
+void test_write_stall() {
+    printf("Test 6: Write Stall and Backpressure\n");
+
+    WriteController::Options options;
+    options.slowdown_memtables = 2;
+    options.stop_memtables = 4;
+    options.slowdown_pending_bytes = 256 * 1024;
+    options.stop_pending_bytes = 1024 * 1024;
+    options.slowdown_l0_files = 4;
+    options.stop_l0_files = 8;
+    options.delayed_write_rate = 2.0 * 1024 * 1024;
+    WriteController controller(options);
+
+    // Pressure maps smoothly onto the delayed write rate.
+    controller.update(0, 0, 0);
+    assert(controller.get_state() == WriteController::State::Normal);
+    controller.update(3, 0, 0);
+    assert(controller.get_state() == WriteController::State::Delayed);
+    assert(controller.get_write_rate() == options.delayed_write_rate / 2);
+    controller.update(0, 0, 6);
+    assert(controller.get_write_rate() == options.delayed_write_rate / 2);
+    controller.update(0, 0, 8);
+    assert(controller.get_state() == WriteController::State::Stopped);
+    controller.update(0, 0, 0);
+    {
+        WriteController::Options equal = options;
+        equal.slowdown_l0_files = 8;
+        WriteController abrupt(equal);
+        abrupt.update(0, 0, 7);
+        assert(abrupt.get_state() == WriteController::State::Normal);
+        abrupt.update(0, 0, 8);
+        assert(abrupt.get_state() == WriteController::State::Stopped);
+    }
+
+    // Writers fill 64 KB memtables; a single flush job drains them into "level-0" files that
+    // a compaction job later merges away. The flush is far slower than the writers.
+    const size_t memtable_limit = 64 * 1024;
+    const int num_writers = 4;
+    const int writes_per_thread = 4000;
+    const size_t value_size = 64;
+
+    BackgroundScheduler::Options sched_options;
+    sched_options.num_threads = 1;
+    sched_options.io_bytes_per_sec = 1024.0 * 1024;
+    sched_options.io_burst_bytes = 64 * 1024;
+    BackgroundScheduler scheduler(sched_options);
+
+    std::mutex pipeline_mutex;
+    auto active = std::make_shared<ConcurrentRedBlackTree>();
+    std::atomic<size_t> active_bytes{0};
+    size_t immutable_memtables = 0;
+    size_t pending_flush_bytes = 0;
+    size_t l0_files = 0;
+    size_t max_memtables = 0;
+
+    auto publish = [&]() {
+        max_memtables = std::max(max_memtables, immutable_memtables + 1);
+        controller.update(immutable_memtables + 1, pending_flush_bytes, l0_files);
+    };
+
+    std::function<void(std::shared_ptr<ConcurrentRedBlackTree>, size_t)> schedule_flush;
+    schedule_flush = [&](std::shared_ptr<ConcurrentRedBlackTree> memtable, size_t bytes) {
+        scheduler.submit(JobPriority::Flush, [&, memtable, bytes](TokenBucketRateLimiter &limiter) {
+            limiter.request(bytes);
+            std::lock_guard lock(pipeline_mutex);
+            immutable_memtables--;
+            pending_flush_bytes -= bytes;
+            l0_files++;
+            if (l0_files >= options.slowdown_l0_files) {
+                scheduler.submit(JobPriority::Compaction, [&](TokenBucketRateLimiter &) {
+                    std::lock_guard compact_lock(pipeline_mutex);
+                    l0_files = 0;
+                    publish();
+                });
+            }
+            publish();
+        });
+    };
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < num_writers; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < writes_per_thread; i++) {
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(t),
+                    static_cast<uint8_t>(i >> 8),
+                    static_cast<uint8_t>(i & 0xFF)
+                };
+                std::vector<uint8_t> value(value_size, static_cast<uint8_t>(i));
+                controller.delay_write(key.size() + value.size());
+
+                std::lock_guard lock(pipeline_mutex);
+                active->put(key, value);
+                active_bytes += key.size() + value.size();
+                if (active_bytes.load() >= memtable_limit) {
+                    size_t bytes = active_bytes.exchange(0);
+                    immutable_memtables++;
+                    pending_flush_bytes += bytes;
+                    schedule_flush(active, bytes);
+                    active = std::make_shared<ConcurrentRedBlackTree>();
+                    publish();
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    scheduler.wait_idle();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    // Stopped writers only resume once a flush completes, so at most one extra memtable
+    // can be sealed beyond the stop threshold.
+    assert(max_memtables <= options.stop_memtables + 1);
+    assert(controller.get_stall_us() > 0);
+
+    size_t total_bytes = num_writers * writes_per_thread * (3 + value_size);
+    printf("%zu KB ingested in %lld ms (flush limited to 1 MB/s)\n", total_bytes / 1024, duration.count());
+    printf("Peak memtables: %zu, delayed writes: %llu, stopped writes: %llu, total stall: %llu ms\n\n",
+           max_memtables, (unsigned long long) controller.get_delayed_writes(),
+           (unsigned long long) controller.get_stopped_writes(),
+           (unsigned long long) (controller.get_stall_us() / 1000));
+}
+
+void test_shard_rebalancing() {
+    printf("Test 7: Dynamic Shard Rebalancing\n");
+    ShardedRedBlackTree::Options options;
+    options.split_ops_per_sec = 20000;
+    options.split_min_entries = 256;
+    options.merge_ops_per_sec = 100;
+    ShardedRedBlackTree tree(options);
+    const int num_writer_threads = 4;
+    const int num_reader_threads = 4;
+    const int ops_per_thread = 50000;
+
+    tree.start_monitor(std::chrono::milliseconds(10));
+
+    std::atomic<int> successful_reads{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Writers each own a slice of a hot key range; readers re-read what has been written.
+    for (int t = 0; t < num_writer_threads; t++) {
+        threads.emplace_back([&tree, t, ops_per_thread]() {
+            for (int i = 0; i < ops_per_thread; i++) {
+                int idx = i % 4096;
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(t),
+                    static_cast<uint8_t>(idx >> 8),
+                    static_cast<uint8_t>(idx & 0xFF)
+                };
+                std::vector<uint8_t> value = {static_cast<uint8_t>(t), static_cast<uint8_t>(idx)};
+                tree.put(key, value);
+            }
+        });
+    }
+    for (int t = 0; t < num_reader_threads; t++) {
+        threads.emplace_back([&tree, &successful_reads, t, ops_per_thread]() {
+            for (int i = 0; i < ops_per_thread; i++) {
+                int idx = (i * 31) % 4096;
+                std::vector<uint8_t> key = {
+                    static_cast<uint8_t>(t),
+                    static_cast<uint8_t>(idx >> 8),
+                    static_cast<uint8_t>(idx & 0xFF)
+                };
+                std::vector<uint8_t> result;
+                if (tree.get(key, result)) {
+                    assert(result.size() == 2 && result[0] == t && result[1] == static_cast<uint8_t>(idx));
+                    ++successful_reads;
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    tree.stop_monitor();
+
+    size_t hot_shards = tree.shard_count();
+    assert(tree.get_splits() > 0);
+    assert(hot_shards > 1);
+
+    // Every key written must still be reachable through the final routing table.
+    for (int t = 0; t < num_writer_threads; t++) {
+        for (int idx = 0; idx < 4096; idx++) {
+            std::vector<uint8_t> key = {
+                static_cast<uint8_t>(t),
+                static_cast<uint8_t>(idx >> 8),
+                static_cast<uint8_t>(idx & 0xFF)
+            };
+            std::vector<uint8_t> result;
+            assert(tree.get(key, result));
+        }
+    }
+
+    // Splits move nodes instead of copying them; the entry counts they hand over stay exact.
+    size_t split_entries = 0;
+    for (const auto &shard: tree.stats()) {
+        split_entries += shard.entries;
+    }
+    assert(split_entries == static_cast<size_t>(num_writer_threads * 4096));
+    {
+        RedBlackTree lower;
+        RedBlackTree upper;
+        for (int i = 0; i < 1000; i++) {
+            lower.put({static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)}, {'v'});
+        }
+        lower.split_at({1, 0}, 256, upper);
+        std::vector<uint8_t> value;
+        assert(lower.size() == 256 && upper.size() == 744 && lower.check_invariants() && upper.check_invariants());
+        assert(upper.get({1, 0}, value) && !lower.get({1, 0}, value) && lower.get({0, 255}, value));
+        lower.append(upper);
+        assert(lower.size() == 1000 && upper.size() == 0 && lower.check_invariants());
+    }
+
+    // With traffic gone, cold neighbours are merged back together.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (int i = 0; i < 64 && tree.shard_count() > 1; i++) {
+        tree.rebalance();
+    }
+    assert(tree.shard_count() == 1);
+    size_t total_entries = 0;
+    for (const auto &shard: tree.stats()) {
+        total_entries += shard.entries;
+    }
+    assert(total_entries == static_cast<size_t>(num_writer_threads * 4096));
+
+    printf("%d mixed operations completed in %lld ms\n",
+           (num_writer_threads + num_reader_threads) * ops_per_thread, duration.count());
+    printf("Hot range split into %zu shards (%llu splits), merged back with %llu merges, routing version %llu\n",
+           hot_shards, (unsigned long long) tree.get_splits(), (unsigned long long) tree.get_merges(),
+           (unsigned long long) tree.routing_version());
+    printf("%d successful reads, %zu entries verified\n\n", successful_reads.load(), total_entries);
+}
+
+void test_erase() {
+    printf("Test 8: Erase\n");
+    RedBlackTree tree;
+    const int num_keys = 20000;
+    std::mt19937 gen(42);
+    std::vector<int> order(num_keys);
+    for (int i = 0; i < num_keys; i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), gen);
+
+    for (int i: order) {
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        tree.put(key, key);
+    }
+    std::shuffle(order.begin(), order.end(), gen);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int n = 0; n < num_keys / 2; n++) {
+        int i = order[n];
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        assert(tree.erase(key));
+        assert(!tree.erase(key));
+        if (n % 1000 == 0) {
+            assert(tree.check_invariants());
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    assert(tree.check_invariants());
+    assert(tree.size() == static_cast<size_t>(num_keys - num_keys / 2));
+
+    for (int n = 0; n < num_keys; n++) {
+        int i = order[n];
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        std::vector<uint8_t> result;
+        assert(tree.get(key, result) == (n >= num_keys / 2));
+    }
+
+    printf("%d erases completed in %lld ms\n", num_keys / 2, duration.count());
+    printf("Red-black invariants and remaining %zu keys verified\n\n", tree.size());
+}
+
+void test_cluster_router() {
+    printf("Test 9: Consistent-Hashing Cluster\n");
+    const int initial_nodes = 3;
+    const int num_keys = 20000;
+    const int batch_size = 100;
+    std::vector<std::string> paths;
+    std::vector<pid_t> pids;
+    for (int i = 0; i <= initial_nodes; i++) {
+        paths.push_back("ytdb_node_" + std::to_string(i) + ".sock");
+        pids.push_back(spawn_server_process(paths[i]));
+        assert(pids[i] > 0);
+    }
+
+    {
+        ClusterRouter router;
+        for (int i = 0; i < initial_nodes; i++) {
+            assert(router.add_initial_node(i, paths[i]));
+        }
+
+        auto make_key = [](int i) {
+            return std::vector<uint8_t>{
+                static_cast<uint8_t>(i >> 16), static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)
+            };
+        };
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_keys; i += batch_size) {
+            std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > batch;
+            for (int j = i; j < i + batch_size; j++) {
+                batch.emplace_back(make_key(j), std::vector<uint8_t>(16, static_cast<uint8_t>(j)));
+            }
+            assert(router.put_batch(batch));
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto load_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+        // Add a node and keep reading, updating and erasing while keys migrate in small chunks.
+        // Updated values carry a marker, so a stale copy from the old owner would show.
+        assert(router.add_node(initial_nodes, paths[initial_nodes]));
+        std::atomic<bool> migrating{true};
+        std::atomic<int> misses{0};
+        std::vector<uint8_t> state(num_keys, 0);
+        enum { ORIGINAL, UPDATED, ERASED };
+        auto updated_value = [](int i) {
+            std::vector<uint8_t> value(16, static_cast<uint8_t>(i));
+            value[1] = 0xAB;
+            return value;
+        };
+        std::thread client([&]() {
+            int i = 0;
+            while (migrating.load()) {
+                std::vector<uint8_t> result;
+                bool found = router.get(make_key(i), result);
+                if (state[i] == ERASED ? found : !found || result[0] != static_cast<uint8_t>(i) ||
+                                                 (state[i] == UPDATED && result[1] != 0xAB)) {
+                    ++misses;
+                }
+                if (state[i] != ERASED && i % 11 == 0) {
+                    assert(router.erase(make_key(i)));
+                    state[i] = ERASED;
+                } else if (state[i] != ERASED) {
+                    assert(router.put(make_key(i), updated_value(i)));
+                    state[i] = UPDATED;
+                }
+                i = (i + 7) % num_keys;
+            }
+        });
+        size_t steps = 0;
+        start = std::chrono::high_resolution_clock::now();
+        assert(router.migrate(512, 3, &steps));
+        assert(router.migrate_step() == ClusterRouter::MigrationStatus::Finished);
+        end = std::chrono::high_resolution_clock::now();
+        migrating = false;
+        client.join();
+        auto migrate_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+        assert(misses.load() == 0);
+
+        std::vector<std::vector<uint8_t> > keys;
+        for (int i = 0; i < num_keys; i++) {
+            keys.push_back(make_key(i));
+        }
+        std::vector<WireEntry> results;
+        start = std::chrono::high_resolution_clock::now();
+        assert(router.multi_get(keys, results));
+        end = std::chrono::high_resolution_clock::now();
+        auto read_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+        int updated = 0;
+        int erased = 0;
+        for (int i = 0; i < num_keys; i++) {
+            if (state[i] == ERASED) {
+                assert(!results[i].found);
+                erased++;
+                continue;
+            }
+            assert(results[i].found && results[i].value[0] == static_cast<uint8_t>(i));
+            assert(results[i].value[1] == (state[i] == UPDATED ? 0xAB : static_cast<uint8_t>(i)));
+            updated += state[i] == UPDATED;
+        }
+
+        // The new node should own roughly a quarter of the keys, all of them moved off the others.
+        int moved = 0;
+        int new_node_fd = connect_unix(paths[initial_nodes]);
+        WireMessage scan;
+        scan.code = static_cast<uint8_t>(WireOp::Scan);
+        scan.entries.resize(1);
+        append_u32(scan.entries[0].value, num_keys);
+        WireMessage scanned;
+        std::vector<uint8_t> buffer;
+        assert(send_message(new_node_fd, scan) && read_message(new_node_fd, scanned, buffer));
+        moved = scanned.entries.size();
+        close(new_node_fd);
+        assert(moved > num_keys / 8 && moved < num_keys / 2);
+
+        printf("%d keys loaded across %d nodes in %lld ms using %d-key batches\n",
+               num_keys, initial_nodes, load_duration.count(), batch_size);
+        printf("Added node 4: %d keys migrated in %zu steps over %lld ms with no missed reads\n",
+               moved, steps, migrate_duration.count());
+        printf("%d keys updated and %d erased during migration kept their latest state\n", updated, erased);
+        printf("%d-key multi_get across 4 nodes in %lld ms, all values verified\n", num_keys,
+               read_duration.count());
+    }
+
+    // A new node that dies fails each step instead of spinning.
+    {
+        const std::string dead_path = "ytdb_node_dead.sock";
+        pid_t dead_pid = spawn_server_process(dead_path);
+        assert(dead_pid > 0);
+        ClusterRouter router;
+        for (int i = 0; i < initial_nodes; i++) {
+            assert(router.add_initial_node(i, paths[i]));
+        }
+        assert(router.add_node(initial_nodes + 1, dead_path));
+        stop_server_process(dead_pid, dead_path);
+        assert(router.migrate_step() == ClusterRouter::MigrationStatus::Failed);
+        assert(!router.migrate(256, 3) && router.is_migrating());
+        printf("Migration to a stopped node gave up after 3 failed steps\n\n");
+    }
+
+    for (size_t i = 0; i < pids.size(); i++) {
+        stop_server_process(pids[i], paths[i]);
+    }
+}
+
+void test_raft_simulated() {
+    printf("Test 10: Raft Replication (simulated network)\n");
+    SimulatedRaftNetwork::Options options;
+    options.num_nodes = 5;
+    options.drop_rate = 0.02;
+    options.seed = 7;
+    options.raft.snapshot_threshold = 500;
+    SimulatedRaftNetwork net(options);
+
+    assert(net.run_until([&net]() { return net.leader() != -1; }, 1000));
+    int leader = net.leader();
+
+    // Keep one follower cut off so it falls behind the snapshot and must be caught up with one.
+    int lagging = (leader + 1) % options.num_nodes;
+    net.set_isolated(lagging, true);
+
+    const int num_keys = 2000;
+    const int per_tick = 50;
+    int committed = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_keys; i++) {
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        std::vector<uint8_t> value = {static_cast<uint8_t>(i), static_cast<uint8_t>(i >> 8)};
+        assert(net.nodes[leader]->propose_put(key, value, [&committed](bool ok) { committed += ok; }));
+        if (i % per_tick == per_tick - 1) {
+            net.tick();
+        }
+    }
+    for (int i = 0; i < num_keys; i += 10) {
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        assert(net.nodes[leader]->propose_erase(key, [&committed](bool ok) { committed += ok; }));
+    }
+    assert(net.run_until([&]() { return committed == num_keys + num_keys / 10; }, 2000));
+    assert(net.nodes[leader]->get_snapshot_index() > 0);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    // Rejoin the lagging follower; it must be restored from a snapshot and then catch up.
+    net.set_isolated(lagging, false);
+    uint64_t target = net.nodes[leader]->get_commit_index();
+    assert(net.run_until([&]() {
+        for (auto &node: net.nodes) {
+            if (node->get_last_applied() < target) {
+                return false;
+            }
+        }
+        return true;
+    }, 2000));
+    for (size_t n = 0; n < net.trees.size(); n++) {
+        assert(net.trees[n]->size() == static_cast<size_t>(num_keys - num_keys / 10));
+    }
+
+    // Linearizable reads from every replica: a follower read must observe a write that the
+    // leader has just committed.
+    std::vector<uint8_t> fresh_key = {0xAA};
+    bool fresh_committed = false;
+    assert(net.nodes[leader]->propose_put(fresh_key, {0x01}, [&](bool ok) { fresh_committed = ok; }));
+    assert(net.run_until([&]() { return fresh_committed; }, 500));
+    int reads_done = 0;
+    for (size_t n = 0; n < net.nodes.size(); n++) {
+        net.nodes[n]->read(fresh_key, [&reads_done](bool ok, bool found, const std::vector<uint8_t> &value) {
+            assert(ok && found && value == std::vector<uint8_t>{0x01});
+            reads_done++;
+        });
+    }
+    net.flush();
+    assert(net.run_until([&]() { return reads_done == static_cast<int>(net.nodes.size()); }, 500));
+
+    // Fail the leader; a new one must be elected and keep every committed write.
+    net.set_isolated(leader, true);
+    assert(net.run_until([&]() { return net.leader() != -1 && net.leader() != leader; }, 2000));
+    int new_leader = net.leader();
+    bool after_failover = false;
+    assert(net.nodes[new_leader]->propose_put({0xBB}, {0x02}, [&](bool ok) { after_failover = ok; }));
+    assert(net.run_until([&]() { return after_failover; }, 1000));
+    std::vector<uint8_t> result;
+    assert(net.trees[new_leader]->get(fresh_key, result) && result[0] == 0x01);
+
+    printf("%d puts and %d erases replicated to 5 nodes in %lld ms (%llu ticks, %llu messages)\n",
+           num_keys, num_keys / 10, duration.count(), (unsigned long long) net.get_now(),
+           (unsigned long long) net.get_delivered());
+    printf("Lagging follower restored from snapshot at index %llu, follower reads linearizable\n",
+           (unsigned long long) net.nodes[lagging]->get_snapshot_index());
+    printf("Leader %d failed over to %d in term %llu\n\n", leader, new_leader,
+           (unsigned long long) net.nodes[new_leader]->get_term());
+}
+
+void test_raft_processes() {
+    printf("Test 11: Raft Replication (local processes)\n");
+    const int num_nodes = 3;
+    RaftNode::Options options;
+    options.election_timeout_min = 15;
+    options.election_timeout_max = 30;
+    options.heartbeat_interval = 3;
+    options.lease_ticks = 10;
+    const auto tick_interval = std::chrono::milliseconds(5);
+
+    std::vector<std::vector<int> > peer_fds(num_nodes, std::vector<int>(num_nodes, -1));
+    for (int i = 0; i < num_nodes; i++) {
+        for (int j = i + 1; j < num_nodes; j++) {
+            int pair[2];
+            assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+            peer_fds[i][j] = pair[0];
+            peer_fds[j][i] = pair[1];
+        }
+    }
+    std::vector<int> control_fds;
+    std::vector<pid_t> pids;
+    for (int i = 0; i < num_nodes; i++) {
+        int pair[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pair[0]);
+            for (int fd: control_fds) {
+                close(fd);
+            }
+            for (int a = 0; a < num_nodes; a++) {
+                for (int b = 0; b < num_nodes; b++) {
+                    if (a != i && peer_fds[a][b] >= 0) {
+                        close(peer_fds[a][b]);
+                    }
+                }
+            }
+            run_raft_process(i, peer_fds[i], pair[1], options, tick_interval);
+            _exit(0);
+        }
+        close(pair[1]);
+        timeval timeout{2, 0};
+        setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        control_fds.push_back(pair[0]);
+        pids.push_back(pid);
+    }
+    for (auto &row: peer_fds) {
+        for (int fd: row) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    std::vector<bool> alive(num_nodes, true);
+    auto request = [&](int node, const WireMessage &message, WireMessage &response) {
+        std::vector<uint8_t> buffer;
+        return send_message(control_fds[node], message) && read_message(control_fds[node], response, buffer) &&
+               response.code == static_cast<uint8_t>(WireStatus::Ok);
+    };
+    // Offers the batch to each live node until the current leader accepts it.
+    auto put_batch = [&](int first, int count) {
+        WireMessage message;
+        message.code = static_cast<uint8_t>(WireOp::PutBatch);
+        for (int i = first; i < first + count; i++) {
+            message.entries.push_back(WireEntry{{static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)},
+                                                {static_cast<uint8_t>(i)}, false});
+        }
+        for (int attempt = 0; attempt < 200; attempt++) {
+            int node = attempt % num_nodes;
+            WireMessage response;
+            if (alive[node] && request(node, message, response)) {
+                return node;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    };
+    auto verify = [&](int node, int count) {
+        WireMessage message;
+        message.code = static_cast<uint8_t>(WireOp::MultiGet);
+        for (int i = 0; i < count; i++) {
+            message.entries.push_back(WireEntry{{static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)}, {}, false});
+        }
+        WireMessage response;
+        if (!request(node, message, response)) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!response.entries[i].found || response.entries[i].value[0] != static_cast<uint8_t>(i)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    const int batch = 100;
+    const int batches = 10;
+    auto start = std::chrono::high_resolution_clock::now();
+    int leader = -1;
+    for (int b = 0; b < batches; b++) {
+        leader = put_batch(b * batch, batch);
+        assert(leader != -1);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    int follower = (leader + 1) % num_nodes;
+    assert(verify(follower, batch * batches));
+
+    // Kill the leader process; the survivors elect a new leader and keep all data.
+    kill(pids[leader], SIGKILL);
+    waitpid(pids[leader], nullptr, 0);
+    alive[leader] = false;
+    auto failover_start = std::chrono::high_resolution_clock::now();
+    int new_leader = put_batch(batch * batches, batch);
+    auto failover_end = std::chrono::high_resolution_clock::now();
+    auto failover = std::chrono::duration_cast<std::chrono::milliseconds>(failover_end - failover_start);
+    assert(new_leader != -1 && new_leader != leader);
+    int survivor = new_leader == follower ? (leader + 2) % num_nodes : follower;
+    assert(verify(survivor, batch * (batches + 1)));
+
+    for (int i = 0; i < num_nodes; i++) {
+        close(control_fds[i]);
+        if (alive[i]) {
+            waitpid(pids[i], nullptr, 0);
+        }
+    }
+
+    printf("%d puts committed through node %d in %lld ms, read back from follower %d\n",
+           batch * batches, leader, duration.count(), follower);
+    printf("Leader process killed; node %d took over within %lld ms, data verified on node %d\n\n",
+           new_leader, failover.count(), survivor);
+}
+
+void test_raft_read_throughput() {
+    printf("Test 12: Raft Linearizable Read Throughput\n");
+    SimulatedRaftNetwork::Options options;
+    options.num_nodes = 3;
+    options.clock_skew = 0.05;
+    options.seed = 3;
+    options.raft.election_timeout_min = 20;
+    options.raft.election_timeout_max = 40;
+    options.raft.lease_ticks = 19;
+    options.raft.max_clock_drift = options.clock_skew;
+    options.raft.snapshot_threshold = 100000;
+    SimulatedRaftNetwork net(options);
+
+    assert(net.run_until([&net]() { return net.leader() != -1; }, 1000));
+    int leader = net.leader();
+    int follower = (leader + 1) % options.num_nodes;
+    const int num_keys = 10000;
+    int committed = 0;
+    for (int i = 0; i < num_keys; i++) {
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        assert(net.nodes[leader]->propose_put(key, {static_cast<uint8_t>(i)}, [&committed](bool ok) {
+            committed += ok;
+        }));
+    }
+    assert(net.run_until([&]() {
+        return committed == num_keys && net.nodes[follower]->get_last_applied() == net.nodes[leader]->get_commit_index();
+    }, 1000));
+    assert(net.run_until([&]() { return net.nodes[leader]->has_valid_lease(); }, 100));
+
+    const int num_reads = 200000;
+    std::vector<std::vector<uint8_t> > keys;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> dis(0, num_keys - 1);
+    for (int i = 0; i < num_reads; i++) {
+        int k = dis(gen);
+        keys.push_back({static_cast<uint8_t>(k >> 8), static_cast<uint8_t>(k & 0xFF)});
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int found_local = 0;
+    std::vector<uint8_t> value;
+    for (const auto &key: keys) {
+        found_local += net.trees[leader]->get(key, value);
+    }
+    auto local_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+
+    int found_lease = 0;
+    start = std::chrono::high_resolution_clock::now();
+    for (const auto &key: keys) {
+        net.nodes[leader]->read(key, [&found_lease](bool ok, bool found, const std::vector<uint8_t> &) {
+            assert(ok);
+            found_lease += found;
+        });
+    }
+    auto lease_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(found_local == num_reads && found_lease == num_reads);
+    assert(net.nodes[leader]->get_lease_reads() == static_cast<uint64_t>(num_reads));
+
+    // Every read issued on the follower before the next flush rides on one ReadIndex request.
+    int found_follower = 0;
+    uint64_t requests_before = net.nodes[follower]->get_read_index_requests();
+    start = std::chrono::high_resolution_clock::now();
+    for (const auto &key: keys) {
+        net.nodes[follower]->read(key, [&found_follower](bool ok, bool found, const std::vector<uint8_t> &) {
+            assert(ok);
+            found_follower += found;
+        });
+    }
+    net.flush();
+    assert(net.run_until([&]() { return found_follower == num_reads; }, 100));
+    auto follower_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    uint64_t requests = net.nodes[follower]->get_read_index_requests() - requests_before;
+    assert(requests == 1);
+
+    // Lease safety under skew: give the leader the slowest clock and the followers the fastest,
+    // cut it off, and check it stops serving lease reads before a new leader commits anything.
+    net.set_clock_rate(leader, 1 - options.clock_skew);
+    for (size_t n = 0; n < net.nodes.size(); n++) {
+        if (static_cast<int>(n) != leader) {
+            net.set_clock_rate(n, 1 + options.clock_skew);
+        }
+    }
+    assert(net.run_until([&]() { return net.nodes[leader]->has_valid_lease(); }, 100));
+    net.set_partitioned(leader, true);
+    uint64_t lease_end = 0;
+    bool new_write = false;
+    bool proposed = false;
+    assert(net.run_until([&]() {
+        int current = net.leader();
+        if (!proposed && current != -1 && current != leader) {
+            proposed = net.nodes[current]->propose_put({0xCC}, {0x01}, [&new_write](bool ok) { new_write = ok; });
+        }
+        if (net.nodes[leader]->has_valid_lease()) {
+            assert(!new_write);
+            lease_end = net.get_now();
+        }
+        return new_write;
+    }, 2000));
+    net.set_partitioned(leader, false);
+
+    printf("%d gets: local %lld us, leader lease reads %lld us (%.0f%% of local throughput)\n", num_reads,
+           (long long) local_us, (long long) lease_us, 100.0 * local_us / std::max<long long>(lease_us, 1));
+    printf("Follower reads %lld us using %llu ReadIndex request(s)\n", (long long) follower_us,
+           (unsigned long long) requests);
+    printf("With +/-%.0f%% clock skew the partitioned leader's lease ended at tick %llu, before the new "
+           "leader's first commit at tick %llu\n\n", options.clock_skew * 100, (unsigned long long) lease_end,
+           (unsigned long long) net.get_now());
+}
+
+void test_client_pipelining() {
+    printf("Test 13: Client Pipelining and Batching\n");
+    const std::string path = "ytdb_client.sock";
+    pid_t pid = spawn_server_process(path);
+    assert(pid > 0);
+
+    const int num_keys = 20000;
+    auto make_key = [](int i) {
+        return std::vector<uint8_t>{static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+    };
+    {
+        YtdbClient loader(YtdbClient::Options{});
+        assert(loader.connect(path));
+        std::vector<std::future<YtdbResult> > puts;
+        for (int i = 0; i < num_keys; i++) {
+            puts.push_back(loader.put(make_key(i), {static_cast<uint8_t>(i), static_cast<uint8_t>(i >> 8)}));
+        }
+        for (auto &put: puts) {
+            assert(put.get().ok);
+        }
+        // A closed client, one never connected, and one with no connections fail requests.
+        loader.close();
+        assert(!loader.get(make_key(0)).get().ok);
+        YtdbClient unconnected(YtdbClient::Options{});
+        assert(!unconnected.put(make_key(0), {1}).get().ok);
+        YtdbClient::Options none;
+        none.connections = 0;
+        YtdbClient empty(none);
+        assert(!empty.connect(path) && !empty.get(make_key(0)).get().ok);
+    }
+
+    auto run = [&](size_t connections, size_t depth, size_t batch) {
+        YtdbClient::Options options;
+        options.connections = connections;
+        options.pipeline_depth = depth;
+        options.max_batch_entries = batch;
+        YtdbClient client(options);
+        assert(client.connect(path));
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<std::future<YtdbResult> > gets;
+        for (int i = 0; i < num_keys; i++) {
+            gets.push_back(client.get(make_key(i)));
+        }
+        for (int i = 0; i < num_keys; i++) {
+            YtdbResult result = gets[i].get();
+            assert(result.ok && result.found && result.value[0] == static_cast<uint8_t>(i));
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        printf("connections %zu, depth %3zu, batch %3zu: %8.0f gets/sec in %llu frames\n", connections, depth,
+               batch, num_keys * 1e6 / std::max<long long>(duration, 1),
+               (unsigned long long) client.get_frames_sent());
+    };
+    for (size_t depth: {1, 4, 16, 64}) {
+        run(1, depth, 1);
+    }
+    run(1, 16, 128);
+    run(4, 16, 128);
+
+    stop_server_process(pid, path);
+    printf("\n");
+}
+
+void test_zero_copy_responses() {
+    printf("Test 14: Zero-Copy Responses\n");
+    ConcurrentRedBlackTree tree;
+    const int num_keys = 128;
+    std::mt19937 gen(42);
+    for (int i = 0; i < num_keys; i++) {
+        size_t value_size = i % 2 == 0 ? 64 * 1024 : 256 * 1024;
+        std::vector<uint8_t> value(value_size, static_cast<uint8_t>(i));
+        tree.put({static_cast<uint8_t>(i)}, value);
+    }
+
+    // The reference keeps the old buffer alive across an overwrite.
+    ValueRef pinned;
+    assert(tree.get_ref({0}, pinned));
+    tree.put({0}, std::vector<uint8_t>(64 * 1024, 0xEE));
+    assert(pinned->size() == 64 * 1024 && (*pinned)[0] == 0);
+    tree.put({0}, *pinned);
+
+    auto run = [&](bool gather) {
+        const std::string path = "ytdb_zero_copy.sock";
+        int listen_fd = listen_unix(path);
+        assert(listen_fd >= 0);
+        YtdbServer::Options server_options;
+        server_options.gather_values = gather;
+        YtdbServer server(tree, server_options);
+        std::thread serving([&server, listen_fd]() { server.serve(listen_fd); });
+
+        YtdbClient::Options options;
+        options.pipeline_depth = 8;
+        options.max_batch_entries = 8;
+        YtdbClient client(options);
+        assert(client.connect(path));
+        const int rounds = 20;
+        size_t bytes = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            std::vector<std::future<YtdbResult> > gets;
+            for (int i = 0; i < num_keys; i++) {
+                gets.push_back(client.get({static_cast<uint8_t>(i)}));
+            }
+            for (int i = 0; i < num_keys; i++) {
+                YtdbResult result = gets[i].get();
+                assert(result.ok && result.found && result.value.back() == static_cast<uint8_t>(i));
+                bytes += result.value.size();
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        client.close();
+        server.stop();
+        serving.join();
+        close(listen_fd);
+        unlink(path.c_str());
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        return bytes / static_cast<double>(std::max<long long>(duration, 1));
+    };
+    double copied = run(false);
+    double gathered = run(true);
+    printf("64/256 KB values: copied into frames %.0f MB/s, gathered with sendmsg %.0f MB/s (%.2fx)\n\n", copied,
+           gathered, gathered / copied);
+}
+
+void test_tenant_qos() {
+    printf("Test 15: Per-Tenant Admission Control\n");
+    ConcurrentRedBlackTree tree;
+    const int noisy_keys = 40000;
+    const int quiet_keys = 1000;
+    for (int i = 0; i < noisy_keys; i++) {
+        tree.put({'a', static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)}, std::vector<uint8_t>(32, 1));
+    }
+    for (int i = 0; i < quiet_keys; i++) {
+        tree.put({'b', static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)}, std::vector<uint8_t>(32, 2));
+    }
+
+    struct Result {
+        uint64_t p99_us;
+        size_t noisy_entries;
+        double seconds;
+    };
+    const double noisy_ops_per_sec = 20000;
+    auto run = [&](bool qos) {
+        const std::string path = "ytdb_qos.sock";
+        int listen_fd = listen_unix(path);
+        assert(listen_fd >= 0);
+        YtdbServer::Options options;
+        if (qos) {
+            options.tenants.push_back(TenantPolicy{{'a'}, noisy_ops_per_sec, 0, 1});
+            options.tenants.push_back(TenantPolicy{{'b'}, 0, 0, 4});
+        }
+        YtdbServer server(tree, options);
+        std::thread serving([&server, listen_fd]() { server.serve(listen_fd); });
+
+        // The noisy tenant floods the server with long scans and write batches.
+        std::atomic<bool> done{false};
+        std::atomic<size_t> noisy_entries{0};
+        std::vector<std::thread> noisy;
+        for (int t = 0; t < 4; t++) {
+            noisy.emplace_back([&, t]() {
+                int fd = connect_unix(path);
+                assert(fd >= 0);
+                std::mt19937 gen(t);
+                std::uniform_int_distribution<> dis(0, noisy_keys - 1);
+                WireMessage response;
+                std::vector<uint8_t> buffer;
+                while (!done.load()) {
+                    int start = dis(gen);
+                    WireMessage scan;
+                    scan.code = static_cast<uint8_t>(WireOp::Scan);
+                    scan.entries.push_back(WireEntry{{'a', static_cast<uint8_t>(start >> 8),
+                                                      static_cast<uint8_t>(start & 0xFF)}, {}, false});
+                    append_u32(scan.entries[0].value, 1000);
+                    assert(send_message(fd, scan) && read_message(fd, response, buffer));
+                    noisy_entries += response.entries.size();
+                    WireMessage batch;
+                    batch.code = static_cast<uint8_t>(WireOp::PutBatch);
+                    for (int i = 0; i < 100; i++) {
+                        int k = dis(gen);
+                        batch.entries.push_back(WireEntry{{'a', static_cast<uint8_t>(k >> 8),
+                                                           static_cast<uint8_t>(k & 0xFF)},
+                                                          std::vector<uint8_t>(32, 3), false});
+                    }
+                    assert(send_message(fd, batch) && read_message(fd, response, buffer));
+                    noisy_entries += batch.entries.size();
+                }
+                close(fd);
+            });
+        }
+
+        // The well-behaved tenant issues one get per round trip and records its latency.
+        int fd = connect_unix(path);
+        assert(fd >= 0);
+        std::vector<uint64_t> latencies;
+        std::mt19937 gen(99);
+        std::uniform_int_distribution<> dis(0, quiet_keys - 1);
+        WireMessage response;
+        std::vector<uint8_t> buffer;
+        auto start = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(1000)) {
+            int k = dis(gen);
+            WireMessage get;
+            get.code = static_cast<uint8_t>(WireOp::MultiGet);
+            get.entries.push_back(WireEntry{{'b', static_cast<uint8_t>(k >> 8), static_cast<uint8_t>(k & 0xFF)},
+                                            {}, false});
+            auto sent = std::chrono::steady_clock::now();
+            assert(send_message(fd, get) && read_message(fd, response, buffer));
+            assert(response.entries.size() == 1 && response.entries[0].found);
+            latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - sent).count());
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t entries = noisy_entries.load();
+        done = true;
+        for (auto &thread: noisy) {
+            thread.join();
+        }
+        close(fd);
+        if (qos) {
+            // The quiet tenant has no quotas but its usage is still counted.
+            assert(server.tenant_stats(1).ops == latencies.size() && server.tenant_stats(0).ops > 0);
+            printf("Noisy tenant throttled for %llu ms in total\n",
+                   (unsigned long long) server.tenant_stats(0).throttled_us / 1000);
+        }
+        server.stop();
+        serving.join();
+        close(listen_fd);
+        unlink(path.c_str());
+
+        std::sort(latencies.begin(), latencies.end());
+        return Result{latencies[latencies.size() * 99 / 100], entries, seconds};
+    };
+
+    Result open = run(false);
+    Result limited = run(true);
+    // Each noisy connection may have one request in flight past its quota.
+    assert(limited.noisy_entries <= noisy_ops_per_sec * limited.seconds * 1.1 + noisy_ops_per_sec / 10 + 4 * 1100);
+    assert(limited.p99_us < open.p99_us);
+    printf("Without QoS: quiet tenant p99 get %llu us, noisy tenant %.0f entries/sec\n",
+           (unsigned long long) open.p99_us, open.noisy_entries / open.seconds);
+    printf("With QoS:    quiet tenant p99 get %llu us, noisy tenant %.0f entries/sec (quota %.0f)\n\n",
+           (unsigned long long) limited.p99_us, limited.noisy_entries / limited.seconds, noisy_ops_per_sec);
+}
+
+void test_stored_procedures() {
+    printf("Test 16: Stored Procedures\n");
+    using Op = ProcedureOp;
+    ConcurrentRedBlackTree tree;
+    const std::string path = "ytdb_procedures.sock";
+    int listen_fd = listen_unix(path);
+    assert(listen_fd >= 0);
+    YtdbServer server(tree);
+    std::thread serving([&server, listen_fd]() { server.serve(listen_fd); });
+
+    // incr(key, delta): adds delta to the counter at key and returns the new value.
+    Procedure incr;
+    incr.code = {{Op::PushArg, 0}, {Op::PushArg, 0}, {Op::Get}, {Op::PushArg, 1}, {Op::Add}, {Op::Put},
+                 {Op::PushArg, 0}, {Op::Get}, {Op::Return}};
+    // transfer(from, to, amount): moves amount between balances, aborting if from is short.
+    Procedure transfer;
+    transfer.constants = {{'o', 'k'}};
+    transfer.code = {{Op::PushArg, 0}, {Op::Get}, {Op::PushArg, 2}, {Op::Less}, {Op::JumpIfZero, 6}, {Op::Abort},
+                     {Op::PushArg, 0}, {Op::PushArg, 0}, {Op::Get}, {Op::PushArg, 2}, {Op::Sub}, {Op::Put},
+                     {Op::PushArg, 1}, {Op::PushArg, 1}, {Op::Get}, {Op::PushArg, 2}, {Op::Add}, {Op::Put},
+                     {Op::PushConst, 0}, {Op::Return}};
+    // bump10(prefix): increments the ten counters prefix+0 .. prefix+9.
+    const int fan_out = 10;
+    Procedure bump;
+    bump.constants.push_back(procedure_slot(1));
+    for (int i = 0; i < fan_out; i++) {
+        bump.constants.push_back({static_cast<uint8_t>(i)});
+        bump.code.insert(bump.code.end(), {{Op::PushArg, 0}, {Op::PushConst, static_cast<uint32_t>(i + 1)},
+                                           {Op::Concat}, {Op::Dup}, {Op::Get}, {Op::PushConst, 0}, {Op::Add},
+                                           {Op::Put}});
+    }
+    bump.code.push_back({Op::PushConst, 0});
+    bump.code.push_back({Op::Return});
+    Procedure runaway;
+    runaway.code = {{Op::Jump, 0}};
+    // Doubles a value forever; the byte budget stops it long before the step budget.
+    Procedure doubler;
+    doubler.constants = {std::vector<uint8_t>(1024, 'x')};
+    doubler.code = {{Op::PushConst, 0}, {Op::Dup}, {Op::Concat}, {Op::Jump, 1}};
+    assert(server.register_procedure("incr", incr));
+    assert(server.register_procedure("transfer", transfer));
+    assert(server.register_procedure("bump10", bump));
+    assert(server.register_procedure("runaway", runaway));
+    assert(server.register_procedure("doubler", doubler));
+    assert(!server.register_procedure("bad", Procedure{{{Op::Jump, 7}}, {}}));
+
+    YtdbClient::Options options;
+    options.connections = 2;
+    YtdbClient client(options);
+    assert(client.connect(path));
+
+    // Concurrent increments never lose an update.
+    const int threads = 4;
+    const int increments = 500;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&client]() {
+            for (int i = 0; i < increments; i++) {
+                assert(client.call("incr", {{'c'}, procedure_slot(1)}).get().ok);
+            }
+        });
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    YtdbResult counter = client.get({'c'}).get();
+    assert(counter.found && procedure_number(counter.value) == threads * increments);
+
+    // An aborted transfer leaves both balances untouched.
+    assert(client.put({'a'}, procedure_slot(100)).get().ok && client.put({'b'}, procedure_slot(0)).get().ok);
+    assert(!client.call("transfer", {{'a'}, {'b'}, procedure_slot(150)}).get().ok);
+    assert(client.call("transfer", {{'a'}, {'b'}, procedure_slot(60)}).get().ok);
+    assert(procedure_number(client.get({'a'}).get().value) == 40);
+    assert(procedure_number(client.get({'b'}).get().value) == 60);
+    assert(!client.call("runaway", {}).get().ok);
+    assert(!client.call("doubler", {}).get().ok);
+    assert(!client.call("missing", {}).get().ok);
+
+    // The same read-modify-write of ten keys as 20 round trips versus one call.
+    const int logical_ops = 500;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int n = 0; n < logical_ops; n++) {
+        for (int i = 0; i < fan_out; i++) {
+            std::vector<uint8_t> key = {'r', static_cast<uint8_t>(i)};
+            YtdbResult current = client.get(key).get();
+            assert(client.put(key, procedure_slot(procedure_number(current.value) + 1)).get().ok);
+        }
+    }
+    auto round_trip_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    start = std::chrono::high_resolution_clock::now();
+    for (int n = 0; n < logical_ops; n++) {
+        assert(client.call("bump10", {{'p'}}).get().ok);
+    }
+    auto procedure_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    for (int i = 0; i < fan_out; i++) {
+        assert(procedure_number(client.get({'r', static_cast<uint8_t>(i)}).get().value) == logical_ops);
+        assert(procedure_number(client.get({'p', static_cast<uint8_t>(i)}).get().value) == logical_ops);
+    }
+
+    // Procedure writes are versioned like ordinary ones.
+    tree.enable_history(std::chrono::milliseconds(1000));
+    uint64_t before = tree.get_last_timestamp();
+    assert(client.call("incr", {{'c'}, procedure_slot(1)}).get().ok);
+    std::vector<uint8_t> versioned;
+    assert(tree.get_last_timestamp() > before);
+    assert(tree.get_as_of({'c'}, tree.get_last_timestamp(), versioned) &&
+           procedure_number(versioned) == threads * increments + 1);
+
+    client.close();
+    server.stop();
+    serving.join();
+    close(listen_fd);
+    unlink(path.c_str());
+    printf("%d concurrent incr calls, no lost updates; aborted transfer rolled back\n", threads * increments);
+    printf("%d ten-key updates: %lld us with %d round trips each, %lld us as one procedure call (%.1fx)\n\n",
+           logical_ops, (long long) round_trip_us, 2 * fan_out, (long long) procedure_us,
+           round_trip_us / static_cast<double>(std::max<long long>(procedure_us, 1)));
+}
+
+void test_time_travel() {
+    printf("Test 17: Time-Travel Queries\n");
+    ConcurrentRedBlackTree tree;
+    tree.put({'o', 'l', 'd'}, {1});
+    tree.enable_history(std::chrono::milliseconds(200));
+
+    // A single key through five versions and an erase.
+    std::vector<uint8_t> key = {'k'};
+    std::vector<uint64_t> stamps;
+    for (uint8_t v = 1; v <= 5; v++) {
+        tree.put(key, {v});
+        stamps.push_back(tree.get_last_timestamp());
+    }
+    assert(tree.erase(key));
+    uint64_t erased_at = tree.get_last_timestamp();
+    std::vector<uint8_t> value;
+    assert(!tree.get_as_of(key, stamps[0] - 1, value));
+    for (size_t i = 0; i < stamps.size(); i++) {
+        assert(tree.get_as_of(key, stamps[i], value) && value[0] == i + 1);
+    }
+    assert(!tree.get_as_of(key, erased_at, value) && !tree.get(key, value));
+    assert(tree.get_as_of({'o', 'l', 'd'}, erased_at, value) && value[0] == 1);
+
+    // Many keys with many versions each.
+    const int num_keys = 1000;
+    const int versions = 100;
+    std::vector<uint64_t> round_end;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int v = 0; v < versions; v++) {
+        for (int i = 0; i < num_keys; i++) {
+            tree.put({'v', static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)}, {static_cast<uint8_t>(v)});
+        }
+        round_end.push_back(tree.get_last_timestamp());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto write_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+
+    const int lookups = 200000;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> key_dis(0, num_keys - 1);
+    std::uniform_int_distribution<> round_dis(0, versions - 1);
+    start = std::chrono::high_resolution_clock::now();
+    for (int n = 0; n < lookups; n++) {
+        int i = key_dis(gen);
+        int v = round_dis(gen);
+        assert(tree.get_as_of({'v', static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)}, round_end[v],
+                              value) && value[0] == v);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    auto lookup_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > entries;
+    tree.scan_as_of({'v'}, round_end[42], num_keys, entries);
+    assert(entries.size() == static_cast<size_t>(num_keys));
+    for (const auto &[k, v]: entries) {
+        assert(v[0] == 42);
+    }
+
+    // Once everything is older than the retention window only current values remain.
+    size_t before = tree.history_versions();
+    assert(tree.start_history_compaction(std::chrono::milliseconds(20)));
+    assert(!tree.start_history_compaction(std::chrono::milliseconds(20)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    tree.stop_history_compaction();
+    size_t after = tree.history_versions();
+    assert(after == tree.size());
+    assert(tree.get_as_of({'v', 0, 7}, tree.get_last_timestamp(), value) && value[0] == versions - 1);
+
+    // A restore keeps the history and is itself a version; unversioned writes are refused.
+    std::vector<uint8_t> snapshot;
+    ConcurrentRedBlackTree source;
+    source.put({'r'}, {9});
+    source.serialize(snapshot);
+    // A truncated snapshot changes neither the tree nor the history.
+    size_t size_before = tree.size();
+    uint64_t before_restore = tree.get_last_timestamp();
+    assert(!tree.restore(snapshot.data(), snapshot.size() - 1) && tree.size() == size_before);
+    assert(tree.get_last_timestamp() == before_restore);
+    assert(tree.get({'v', 0, 7}, value) && tree.get_as_of({'v', 0, 7}, before_restore, value));
+    assert(tree.restore(snapshot.data(), snapshot.size()) && tree.size() == 1);
+    assert(tree.get_as_of({'v', 0, 7}, before_restore, value) && value[0] == versions - 1);
+    assert(!tree.get_as_of({'v', 0, 7}, tree.get_last_timestamp(), value));
+    assert(tree.get_as_of({'r'}, tree.get_last_timestamp(), value) && value[0] == 9);
+    assert(!tree.get_as_of({'r'}, before_restore, value));
+    assert(!tree.atomically([](RedBlackTree &t) { t.put({'x'}, {1}); }) && !tree.get({'x'}, value));
+
+    printf("%d versions written in %lld ms, %d get_as_of lookups in %lld ms\n", num_keys * versions,
+           (long long) write_ms, lookups, (long long) lookup_ms);
+    printf("Background compaction past retention: %zu versions -> %zu\n\n", before, after);
+}
+
+void test_tiered_storage() {
+    printf("Test 18: Tiered Storage\n");
+    TieredRedBlackTree::Options options;
+    options.path_prefix = "ytdb_tier_test";
+    options.max_hot_bytes = 2 * 1024 * 1024;
+    TieredRedBlackTree tree(options);
+
+    const int num_keys = 20000;
+    const size_t value_size = 1024;
+    auto make_key = [](int i) {
+        return std::vector<uint8_t>{static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+    };
+    auto make_value = [value_size](int i) {
+        std::vector<uint8_t> value(value_size, static_cast<uint8_t>(i));
+        value[0] = static_cast<uint8_t>(i >> 8);
+        return value;
+    };
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_keys; i++) {
+        assert(tree.put(make_key(i), make_value(i)));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    assert(tree.size() == static_cast<size_t>(num_keys));
+    // Eviction runs in the background; once it catches up, merging has bounded the run files.
+    assert(tree.settle());
+    assert(tree.get_hot_bytes() <= options.max_hot_bytes);
+    assert(tree.run_files() <= options.max_runs && tree.get_merges() > 0);
+
+    // A skewed workload: 90% of gets go to a 1,000-key working set that starts out cold.
+    const int working_set = 1000;
+    const int gets = 100000;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> hot_dis(0, working_set - 1);
+    std::uniform_int_distribution<> any_dis(0, num_keys - 1);
+    std::uniform_real_distribution<> pick(0, 1);
+    uint64_t promotions_before = tree.get_promotions();
+    std::vector<uint8_t> value;
+    start = std::chrono::high_resolution_clock::now();
+    for (int n = 0; n < gets; n++) {
+        int i = pick(gen) < 0.9 ? hot_dis(gen) : any_dis(gen);
+        assert(tree.get(make_key(i), value) && value == make_value(i));
+    }
+    end = std::chrono::high_resolution_clock::now();
+    auto get_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    uint64_t promotions = tree.get_promotions() - promotions_before;
+    // Only the first touch of each working-set key and the 10% tail should hit disk.
+    assert(promotions < gets / 5);
+    assert(tree.settle() && tree.get_hot_bytes() <= options.max_hot_bytes);
+
+    // Scans merge hot and cold entries, and overwrites and erases retire run files.
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > entries;
+    assert(tree.scan(make_key(5000), 3000, entries) && entries.size() == 3000);
+    for (size_t i = 0; i < entries.size(); i++) {
+        assert(entries[i].first == make_key(5000 + i) && entries[i].second == make_value(5000 + i));
+    }
+    size_t runs = tree.run_files();
+    for (int i = 0; i < num_keys; i++) {
+        if (i % 2 == 0) {
+            assert(tree.erase(make_key(i)));
+        }
+    }
+    assert(tree.size() == static_cast<size_t>(num_keys / 2));
+    assert(!tree.get(make_key(0), value) && tree.get(make_key(1), value) && value == make_value(1));
+
+    printf("%d x %zu-byte values loaded in %lld ms with %zu KB of RAM for values (%zu run files, %llu merges)\n",
+           num_keys, value_size, (long long) load_ms, options.max_hot_bytes / 1024, runs,
+           (unsigned long long) tree.get_merges());
+    printf("%d skewed gets in %lld ms, %llu promoted from disk; %zu hot of %zu entries\n\n", gets,
+           (long long) get_ms, (unsigned long long) promotions, tree.hot_entries(), tree.size());
+}
+
+void test_value_compression() {
+    printf("Test 19: Dictionary Value Compression\n");
+    const int num_keys = 50000;
+    auto make_key = [](int i) {
+        return std::vector<uint8_t>{static_cast<uint8_t>(i >> 16), static_cast<uint8_t>(i >> 8),
+                                    static_cast<uint8_t>(i & 0xFF)};
+    };
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> score(0, 100);
+    auto user_json = [&](int i) {
+        std::string json = "{\"user_id\":" + std::to_string(i) + ",\"name\":\"user_" + std::to_string(i) +
+                           "\",\"email\":\"user" + std::to_string(i) + "@example.com\",\"active\":" +
+                           (i % 3 ? "true" : "false") + ",\"score\":" + std::to_string(score(gen)) + "}";
+        return std::vector<uint8_t>(json.begin(), json.end());
+    };
+    auto order_record = [&](int i) {
+        std::string record = "order|id=" + std::to_string(i) + "|status=shipped|currency=EUR|amount=" +
+                             std::to_string(score(gen)) + ".00|warehouse=north-" + std::to_string(i % 7);
+        return std::vector<uint8_t>(record.begin(), record.end());
+    };
+    std::vector<std::vector<uint8_t> > values;
+    for (int i = 0; i < num_keys; i++) {
+        values.push_back(user_json(i));
+    }
+
+    ConcurrentRedBlackTree plain;
+    size_t plain_bytes = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_keys; i++) {
+        plain.put(make_key(i), values[i]);
+        plain_bytes += values[i].size();
+    }
+    auto plain_put_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    std::vector<uint8_t> value;
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_keys; i++) {
+        assert(plain.get(make_key(i), value));
+    }
+    auto plain_get_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+
+    // Warm up the sampler, train once, then load everything.
+    CompressedRedBlackTree tree;
+    for (int i = 0; i < 5000; i++) {
+        tree.put(make_key(i), values[i]);
+    }
+    assert(tree.retrain());
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_keys; i++) {
+        tree.put(make_key(i), values[i]);
+    }
+    auto put_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_keys; i++) {
+        assert(tree.get(make_key(i), value) && value == values[i]);
+    }
+    auto get_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    CompressionStats first = tree.stats();
+    assert(first.raw_bytes == plain_bytes && first.stored_bytes < plain_bytes * 3 / 4);
+
+    // The workload drifts to a different record shape; background retraining catches up,
+    // re-encodes values written under the first table and frees it.
+    uint64_t retrains = tree.get_retrains();
+    assert(tree.start_retraining(std::chrono::milliseconds(20)));
+    assert(!tree.start_retraining(std::chrono::milliseconds(20)));
+    for (int i = 0; i < num_keys / 2; i++) {
+        tree.put(make_key(num_keys + i), order_record(i));
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (tree.get_retrains() == retrains && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    tree.stop_retraining();
+    assert(tree.get_retrains() > retrains && tree.stats().dictionaries == 1);
+    std::vector<std::vector<uint8_t> > orders;
+    for (int i = 0; i < num_keys / 2; i++) {
+        orders.push_back(order_record(i));
+        tree.put(make_key(num_keys + i), orders.back());
+    }
+    for (int i = 0; i < num_keys; i += 97) {
+        assert(tree.get(make_key(i), value) && value == values[i]);
+    }
+    for (int i = 0; i < num_keys / 2; i += 97) {
+        assert(tree.get(make_key(num_keys + i), value) && value == orders[i]);
+    }
+    CompressionStats second = tree.stats();
+
+    // Table ids are reused, so retraining never runs out of them.
+    CompressedRedBlackTree::Options always;
+    always.min_improvement = -1;
+    CompressedRedBlackTree churn(always);
+    for (int i = 0; i < 300; i++) {
+        churn.put(make_key(i), values[i]);
+        assert(churn.retrain());
+    }
+    for (int i = 0; i < 300; i++) {
+        assert(churn.get(make_key(i), value) && value == values[i]);
+    }
+    assert(churn.stats().dictionaries == 1);
+
+    printf("%d JSON values: %zu KB plain, %zu KB compressed + %zu B dictionary (%.2fx)\n", num_keys,
+           plain_bytes / 1024, first.stored_bytes / 1024, first.dictionary_bytes,
+           static_cast<double>(plain_bytes) / first.stored_bytes);
+    printf("CPU per value: put %.2f us vs %.2f us plain, get %.2f us vs %.2f us plain\n",
+           static_cast<double>(put_us) / num_keys, static_cast<double>(plain_put_us) / num_keys,
+           static_cast<double>(get_us) / num_keys, static_cast<double>(plain_get_us) / num_keys);
+    printf("After drift and background retraining: %zu dictionaries, %zu KB raw stored in %zu KB (%.2fx)\n\n",
+           second.dictionaries, second.raw_bytes / 1024, second.stored_bytes / 1024,
+           static_cast<double>(second.raw_bytes) / second.stored_bytes);
+}
+
+void test_learned_index() {
+    printf("Test 20: Learned Index over Frozen Key Sets\n");
+    const size_t num_keys = 2000000;
+    const size_t num_lookups = 1000000;
+    std::mt19937_64 gen(42);
+    struct Distribution {
+        const char *name;
+        std::vector<uint64_t> keys;
+    };
+    std::vector<Distribution> distributions(3);
+    distributions[0].name = "sequential ids with gaps";
+    distributions[1].name = "uniform random";
+    distributions[2].name = "clustered timestamps";
+    uint64_t id = 0;
+    std::uniform_int_distribution<uint64_t> gap(1, 16);
+    for (size_t i = 0; i < num_keys; i++) {
+        id += gap(gen);
+        distributions[0].keys.push_back(id);
+        distributions[1].keys.push_back(gen());
+    }
+    // Bursts of events microseconds apart, separated by long idle periods.
+    uint64_t now = 1700000000000000ULL;
+    std::exponential_distribution<> idle(1.0 / 5e6);
+    std::exponential_distribution<> burst(1.0 / 20);
+    while (distributions[2].keys.size() < num_keys) {
+        now += static_cast<uint64_t>(idle(gen));
+        for (int i = 0; i < 1000; i++) {
+            now += static_cast<uint64_t>(burst(gen));
+            distributions[2].keys.push_back(now);
+        }
+    }
+    distributions[2].keys.resize(num_keys);
+
+    for (auto &distribution: distributions) {
+        std::vector<uint64_t> &keys = distribution.keys;
+        std::sort(keys.begin(), keys.end());
+        // Half the lookups hit existing keys, half fall anywhere in the key range.
+        std::vector<uint64_t> lookups;
+        std::uniform_int_distribution<size_t> pick(0, num_keys - 1);
+        std::uniform_int_distribution<uint64_t> anywhere(keys.front(), keys.back() + 1);
+        for (size_t i = 0; i < num_lookups; i++) {
+            lookups.push_back(i % 2 ? keys[pick(gen)] : anywhere(gen));
+        }
+
+        EytzingerIndex eytzinger;
+        eytzinger.build(keys);
+        PgmIndex pgm(32);
+        auto start = std::chrono::high_resolution_clock::now();
+        pgm.build(keys);
+        auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+
+        uint64_t binary_sum = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (uint64_t key: lookups) {
+            auto it = std::lower_bound(keys.begin(), keys.end(), key);
+            binary_sum += it == keys.end() ? 0 : *it;
+        }
+        auto binary_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        uint64_t eytzinger_sum = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (uint64_t key: lookups) {
+            uint64_t found = 0;
+            eytzinger_sum += eytzinger.lower_bound(key, found) ? found : 0;
+        }
+        auto eytzinger_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        uint64_t pgm_sum = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (uint64_t key: lookups) {
+            size_t pos = pgm.lower_bound(keys, key);
+            pgm_sum += pos == keys.size() ? 0 : keys[pos];
+        }
+        auto pgm_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        assert(eytzinger_sum == binary_sum && pgm_sum == binary_sum);
+        for (size_t i = 0; i < lookups.size(); i += 101) {
+            uint64_t key = lookups[i];
+            assert(pgm.lower_bound(keys, key) ==
+                   static_cast<size_t>(std::lower_bound(keys.begin(), keys.end(), key) - keys.begin()));
+        }
+
+        printf("%s: binary %.0f ns, eytzinger %.0f ns, pgm %.0f ns per lookup; "
+               "pgm %zu segments in %zu levels (%zu KB vs %zu KB keys), built in %lld ms\n",
+               distribution.name, static_cast<double>(binary_ns) / num_lookups,
+               static_cast<double>(eytzinger_ns) / num_lookups, static_cast<double>(pgm_ns) / num_lookups,
+               pgm.segment_count(), pgm.level_count(), pgm.memory_bytes() / 1024,
+               keys.size() * sizeof(uint64_t) / 1024, (long long) build_ms);
+    }
+
+    // String keys sharing a prefix, frozen from a snapshot file.
+    RedBlackTree tree;
+    const int num_users = 200000;
+    std::vector<std::vector<uint8_t> > user_keys;
+    for (int i = 0; i < num_users; i++) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "user:%010llu", (unsigned long long) (gen() % 10000000000ULL));
+        user_keys.emplace_back(buffer, buffer + strlen(buffer));
+        tree.put(user_keys.back(), std::vector<uint8_t>(8, static_cast<uint8_t>(i)));
+    }
+    const std::string path = "ytdb_frozen.bin";
+    assert(tree.save_snapshot(path));
+    FrozenSnapshot frozen;
+    assert(frozen.load(path));
+    // A truncated file is rejected and leaves the loaded snapshot in place.
+    assert(truncate(path.c_str(), 100) == 0 && !frozen.load(path));
+    unlink(path.c_str());
+    assert(frozen.size() == tree.size());
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> value;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto &key: user_keys) {
+        assert(frozen.get(key, value));
+    }
+    auto frozen_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    start = std::chrono::high_resolution_clock::now();
+    for (const auto &key: user_keys) {
+        assert(tree.get(key, expected));
+    }
+    auto tree_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    for (size_t i = 0; i < user_keys.size(); i += 13) {
+        assert(frozen.get(user_keys[i], value) && tree.get(user_keys[i], expected) && value == expected);
+        std::vector<uint8_t> missing = user_keys[i];
+        missing.push_back('x');
+        assert(frozen.get(missing, value) == tree.get(missing, expected));
+    }
+    assert(!frozen.get({'a'}, value) && !frozen.get({'z'}, value));
+
+    // Keys that agree well past the 8 projected bytes all project to the same value.
+    RedBlackTree nested;
+    std::vector<std::vector<uint8_t> > nested_keys;
+    for (int i = 0; i < 20000; i++) {
+        char buffer[48];
+        snprintf(buffer, sizeof(buffer), "tenant-%c/bucket-0000/object-%06d", i % 2 ? 'a' : 'b', i);
+        nested_keys.emplace_back(buffer, buffer + strlen(buffer));
+        nested.put(nested_keys.back(), std::vector<uint8_t>(4, static_cast<uint8_t>(i)));
+    }
+    FrozenSnapshot nested_frozen;
+    nested_frozen.build(nested);
+    for (size_t i = 0; i < nested_keys.size(); i++) {
+        assert(nested_frozen.get(nested_keys[i], value) && value[0] == static_cast<uint8_t>(i));
+        std::vector<uint8_t> missing = nested_keys[i];
+        missing.back() = 'x';
+        assert(!nested_frozen.get(missing, value));
+    }
+    printf("Frozen snapshot of %zu string keys: %zu segments, get %.0f ns vs %.0f ns in the tree\n\n",
+           frozen.size(), frozen.get_index().segment_count(),
+           static_cast<double>(frozen_us) * 1000 / num_users, static_cast<double>(tree_us) * 1000 / num_users);
+}
+
+void test_z_order_box_queries() {
+    printf("Test 21: Z-Order Box Queries\n");
+    for (uint32_t v: {0u, 1u, 12345u, 0x80000000u, 0xFFFFFFFFu}) {
+        uint32_t x = 0;
+        uint32_t y = 0;
+        z_decode(z_encode(v, ~v), x, y);
+        assert(x == v && y == ~v);
+    }
+    // BIGMIN agrees with a linear search on a small grid.
+    for (uint32_t x0 = 0; x0 < 8; x0 += 3) {
+        for (uint32_t y0 = 1; y0 < 8; y0 += 2) {
+            uint32_t x1 = x0 + 5;
+            uint32_t y1 = y0 + 3;
+            uint64_t zmin = z_encode(x0, y0);
+            uint64_t zmax = z_encode(x1, y1);
+            for (uint64_t z = zmin; z < zmax; z++) {
+                uint32_t x = 0;
+                uint32_t y = 0;
+                z_decode(z, x, y);
+                if (x >= x0 && x <= x1 && y >= y0 && y <= y1) {
+                    continue;
+                }
+                uint64_t next = z + 1;
+                for (;; next++) {
+                    z_decode(next, x, y);
+                    if (x >= x0 && x <= x1 && y >= y0 && y <= y1) {
+                        break;
+                    }
+                }
+                assert(z_bigmin(z, zmin, zmax) == next);
+            }
+        }
+    }
+
+    // Geo points clustered around cities, lon/lat quantized to 32 bits.
+    ConcurrentRedBlackTree tree;
+    const std::vector<uint8_t> geo = {'g', 'e', 'o', ':'};
+    const std::vector<uint8_t> events = {'e', 'v', 't', ':'};
+    const int num_points = 300000;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<> lon(-180, 180);
+    std::uniform_real_distribution<> lat(-60, 70);
+    std::normal_distribution<> spread(0, 0.5);
+    auto quantize = [](double v, double lo, double hi) {
+        return static_cast<uint32_t>((v - lo) / (hi - lo) * 4294967295.0);
+    };
+    std::vector<std::pair<double, double> > cities;
+    for (int i = 0; i < 40; i++) {
+        cities.emplace_back(lon(gen), lat(gen));
+    }
+    std::vector<std::pair<uint32_t, uint32_t> > points;
+    for (int i = 0; i < num_points; i++) {
+        const auto &city = cities[i % cities.size()];
+        uint32_t x = quantize(std::clamp(city.first + spread(gen), -180.0, 180.0), -180, 180);
+        uint32_t y = quantize(std::clamp(city.second + spread(gen), -90.0, 90.0), -90, 90);
+        points.emplace_back(x, y);
+        tree.put(z_key(geo, x, y), std::vector<uint8_t>(8, static_cast<uint8_t>(i)));
+    }
+    // (tenant, time) points live under their own prefix in the same tree.
+    for (uint32_t tenant = 0; tenant < 100; tenant++) {
+        for (uint32_t t = 0; t < 2000; t++) {
+            tree.put(z_key(events, tenant, 1700000000 + t * 60), {static_cast<uint8_t>(tenant)});
+        }
+    }
+
+    const int num_queries = 200;
+    std::vector<std::array<uint32_t, 4> > boxes;
+    for (int q = 0; q < num_queries; q++) {
+        const auto &center = points[gen() % points.size()];
+        uint32_t half_width = 1u << (18 + gen() % 6);
+        boxes.push_back({center.first - std::min(center.first, half_width),
+                         center.second - std::min(center.second, half_width),
+                         center.first + std::min(~center.first, half_width),
+                         center.second + std::min(~center.second, half_width)});
+    }
+    std::vector<std::set<std::pair<uint32_t, uint32_t> > > found(num_queries);
+    ZBoxStats totals;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int q = 0; q < num_queries; q++) {
+        const auto &box = boxes[q];
+        ZBoxStats stats = tree.scan_box(geo, box[0], box[1], box[2], box[3],
+                                        [&](uint32_t x, uint32_t y, const auto &, const auto &) {
+            found[q].emplace(x, y);
+        });
+        totals.visited += stats.visited;
+        totals.seeks += stats.seeks;
+    }
+    auto box_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    size_t results = 0;
+    for (int q = 0; q < num_queries; q++) {
+        const auto &box = boxes[q];
+        std::set<std::pair<uint32_t, uint32_t> > expected;
+        for (const auto &point: points) {
+            if (point.first >= box[0] && point.first <= box[2] && point.second >= box[1] && point.second <= box[3]) {
+                expected.insert(point);
+            }
+        }
+        assert(found[q] == expected);
+        results += expected.size();
+    }
+
+    // One hour of tenants 10..19.
+    size_t event_count = 0;
+    ZBoxStats event_stats = tree.scan_box(events, 10, 1700000000, 19, 1700000000 + 3599,
+                                          [&](uint32_t tenant, uint32_t, const auto &, const auto &value) {
+        assert(tenant >= 10 && tenant <= 19 && value[0] == tenant);
+        event_count++;
+    });
+    assert(event_count == 10 * 60);
+
+    // The full-scan baseline the box queries replace.
+    const int num_full_scans = 5;
+    start = std::chrono::high_resolution_clock::now();
+    for (int q = 0; q < num_full_scans; q++) {
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > all;
+        tree.scan(geo, SIZE_MAX, all);
+        size_t matched = 0;
+        for (const auto &entry: all) {
+            if (entry.first.size() == geo.size() + 8 && std::equal(geo.begin(), geo.end(), entry.first.begin())) {
+                uint64_t z = 0;
+                for (size_t i = geo.size(); i < entry.first.size(); i++) {
+                    z = (z << 8) | entry.first[i];
+                }
+                uint32_t x = 0;
+                uint32_t y = 0;
+                z_decode(z, x, y);
+                matched += x < 0x80000000u && y < 0x80000000u;
+            }
+        }
+        assert(matched > 0);
+    }
+    auto full_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+
+    printf("%d geo boxes over %d points: %.1f results, %.1f entries visited, %.1f seeks, %.0f us per query\n",
+           num_queries, num_points, static_cast<double>(results) / num_queries,
+           static_cast<double>(totals.visited) / num_queries, static_cast<double>(totals.seeks) / num_queries,
+           static_cast<double>(box_us) / num_queries);
+    printf("Full scan and filter: %.0f us per query\n", static_cast<double>(full_us) / num_full_scans);
+    printf("(tenant, time) box: %zu events, %zu visited in %zu seeks\n\n", event_count, event_stats.visited,
+           event_stats.seeks);
+}
+
+void test_merkle_diff() {
+    printf("Test 22: Merkle Diff and Anti-Entropy\n");
+    auto make_key = [](int i) {
+        return std::vector<uint8_t>{static_cast<uint8_t>(i >> 24), static_cast<uint8_t>(i >> 16),
+                                    static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+    };
+    std::mt19937 gen(42);
+
+    // Digests stay consistent through rotations on insert and erase.
+    RedBlackTree small;
+    small.enable_digests();
+    for (int n = 0; n < 20000; n++) {
+        int i = gen() % 5000;
+        if (gen() % 3 == 0) {
+            small.erase(make_key(i));
+        } else {
+            small.put(make_key(i), std::vector<uint8_t>(1 + n % 7, static_cast<uint8_t>(n)));
+        }
+        if (n % 1000 == 0) {
+            assert(small.check_invariants() && small.check_digests());
+        }
+    }
+    assert(small.check_invariants() && small.check_digests());
+
+    // Two replicas of the same data written in different orders have different shapes but the
+    // same digests; one of them is only augmented after loading.
+    const int num_keys = 300000;
+    std::vector<int> order(num_keys);
+    for (int i = 0; i < num_keys; i++) {
+        order[i] = i;
+    }
+    ConcurrentRedBlackTree a;
+    ConcurrentRedBlackTree b;
+    a.enable_digests();
+    for (int i: order) {
+        a.put(make_key(i), std::vector<uint8_t>(16, static_cast<uint8_t>(i)));
+    }
+    std::shuffle(order.begin(), order.end(), gen);
+    for (int i: order) {
+        b.put(make_key(i), std::vector<uint8_t>(16, static_cast<uint8_t>(i)));
+    }
+    b.enable_digests();
+    assert(a.range_digest(nullptr, nullptr) == b.range_digest(nullptr, nullptr));
+    std::vector<uint8_t> lo = make_key(1000);
+    std::vector<uint8_t> hi = make_key(2000);
+    assert(a.range_digest(&lo, &hi).count == 1000 && a.range_digest(&lo, &hi) == b.range_digest(&lo, &hi));
+    assert(a.diff(b, [](const auto &, const auto *, const auto *) { assert(false); }) == 1);
+
+    // Replica b drifts: overwrites, erases and new keys.
+    std::map<std::vector<uint8_t>, int> expected;
+    for (int n = 0; n < 100; n++) {
+        int i = gen() % (num_keys + 1000);
+        std::vector<uint8_t> key = make_key(i);
+        if (n % 3 == 0 && i < num_keys) {
+            b.erase(key);
+            expected[key] = -1;
+        } else {
+            b.put(key, std::vector<uint8_t>(16, static_cast<uint8_t>(i + 1)));
+            expected[key] = 1;
+        }
+    }
+    std::map<std::vector<uint8_t>, int> found;
+    auto start = std::chrono::high_resolution_clock::now();
+    size_t compared = a.diff(b, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> *mine,
+                                    const std::vector<uint8_t> *theirs) {
+        assert(mine != nullptr || theirs != nullptr);
+        found[key] = theirs == nullptr ? -1 : 1;
+    });
+    auto diff_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(found == expected);
+
+    // Baseline: stream both replicas and compare every entry.
+    start = std::chrono::high_resolution_clock::now();
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > all_a;
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > all_b;
+    a.scan({}, SIZE_MAX, all_a);
+    b.scan({}, SIZE_MAX, all_b);
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > only;
+    std::set_symmetric_difference(all_a.begin(), all_a.end(), all_b.begin(), all_b.end(), std::back_inserter(only));
+    auto stream_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(!only.empty());
+
+    start = std::chrono::high_resolution_clock::now();
+    size_t repaired = a.repair_from(b);
+    auto repair_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(repaired == expected.size());
+    assert(a.range_digest(nullptr, nullptr) == b.range_digest(nullptr, nullptr));
+    assert(a.size() == b.size());
+
+    // Without digests diff walks both trees instead of reporting no differences.
+    ConcurrentRedBlackTree plain_a;
+    ConcurrentRedBlackTree plain_b;
+    for (uint8_t i = 0; i < 100; i++) {
+        plain_a.put({i}, {i});
+        if (i % 10 != 0) {
+            plain_b.put({i}, {static_cast<uint8_t>(i % 7 == 0 ? 0xFF : i)});
+        }
+    }
+    size_t plain_differences = 0;
+    assert(plain_a.diff(plain_b, [&plain_differences](const std::vector<uint8_t> &, const std::vector<uint8_t> *,
+                                                      const std::vector<uint8_t> *) { plain_differences++; }) == 0);
+    assert(plain_differences == 10 + 13);
+    assert(plain_b.repair_from(plain_a) == plain_differences);
+    plain_differences = 0;
+    plain_b.diff(plain_a, [&plain_differences](auto &&...) { plain_differences++; });
+    assert(plain_differences == 0);
+
+    printf("%zu differences between two %d-key replicas: diff %lld us comparing %zu range digests, "
+           "full stream %lld us\n", found.size(), num_keys, (long long) diff_us, compared, (long long) stream_us);
+    printf("Anti-entropy repair of %zu keys: %lld us, replicas converge\n\n", repaired, (long long) repair_us);
+}
+
+void test_set_operations() {
+    printf("Test 23: Join-Based Set Operations\n");
+    auto make_key = [](int i) {
+        return std::vector<uint8_t>{static_cast<uint8_t>(i >> 24), static_cast<uint8_t>(i >> 16),
+                                    static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+    };
+    auto contents = [](const RedBlackTree &tree) {
+        std::map<std::vector<uint8_t>, std::vector<uint8_t> > out;
+        tree.for_each([&out](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+            out[key] = value;
+        });
+        return out;
+    };
+    std::mt19937 gen(42);
+
+    // Random trees against a std::map model, with and without digests and threads.
+    for (int trial = 0; trial < 300; trial++) {
+        RedBlackTree a;
+        RedBlackTree b;
+        if (trial % 2 == 0) {
+            a.enable_digests();
+        }
+        int range = 1 + gen() % 3000;
+        int a_keys = gen() % 2000;
+        int b_keys = trial % 10 == 0 ? 0 : gen() % 2000;
+        for (int n = 0; n < a_keys; n++) {
+            a.put(make_key(gen() % range), {'a'});
+        }
+        for (int n = 0; n < b_keys; n++) {
+            b.put(make_key(gen() % range), {'b'});
+        }
+        auto model_a = contents(a);
+        auto model_b = contents(b);
+        for (int op = 0; op < 3; op++) {
+            RedBlackTree result;
+            RedBlackTree input;
+            result.copy_from(a);
+            input.copy_from(b);
+            auto expected = model_a;
+            if (op == 0) {
+                result.unite(input, 1 + trial % 4);
+                for (const auto &entry: model_b) {
+                    expected[entry.first] = entry.second;
+                }
+            } else if (op == 1) {
+                result.intersect(input, 1 + trial % 4);
+                for (auto it = expected.begin(); it != expected.end();) {
+                    it = model_b.count(it->first) ? std::next(it) : expected.erase(it);
+                }
+            } else {
+                result.subtract(input, 1 + trial % 4);
+                for (const auto &entry: model_b) {
+                    expected.erase(entry.first);
+                }
+            }
+            assert(input.size() == 0);
+            assert(result.check_invariants() && result.check_digests());
+            assert(result.size() == expected.size() && contents(result) == expected);
+        }
+    }
+
+    // Naive baseline: walk both inputs in key order and build the result tree.
+    auto naive = [](const RedBlackTree &a, const RedBlackTree &b, int op, RedBlackTree &out) {
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > left;
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > right;
+        a.for_each([&left](const auto &key, const auto &value) { left.emplace_back(key, value); });
+        b.for_each([&right](const auto &key, const auto &value) { right.emplace_back(key, value); });
+        size_t i = 0;
+        size_t j = 0;
+        while (i < left.size() || j < right.size()) {
+            int cmp = i == left.size() ? 1 : (j == right.size() ? -1 : compare_keys(left[i].first, right[j].first));
+            if (cmp < 0) {
+                if (op != 1) {
+                    out.put(left[i].first, left[i].second);
+                }
+                i++;
+            } else if (cmp > 0) {
+                if (op == 0) {
+                    out.put(right[j].first, right[j].second);
+                }
+                j++;
+            } else {
+                if (op == 0) {
+                    out.put(right[j].first, right[j].second);
+                } else if (op == 1) {
+                    out.put(left[i].first, left[i].second);
+                }
+                i++;
+                j++;
+            }
+        }
+    };
+
+    const int large = 500000;
+    const char *names[] = {"union", "intersection", "difference"};
+    unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    for (int small: {large, 1000}) {
+        RedBlackTree a;
+        RedBlackTree b;
+        for (int i = 0; i < large; i++) {
+            a.put(make_key(2 * i), std::vector<uint8_t>(8, 'a'));
+        }
+        // b overlaps half of a's keys and spreads the rest between them.
+        for (int n = 0; n < small; n++) {
+            int i = static_cast<int>(static_cast<long long>(n) * large / small);
+            b.put(make_key(n % 2 == 0 ? 2 * i : 2 * i + 1), std::vector<uint8_t>(8, 'b'));
+        }
+        for (int op = 0; op < 3; op++) {
+            RedBlackTree naive_out;
+            auto start = std::chrono::high_resolution_clock::now();
+            naive(a, b, op, naive_out);
+            auto naive_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+            long long join_us[2] = {0, 0};
+            for (int parallel = 0; parallel < 2; parallel++) {
+                RedBlackTree result;
+                RedBlackTree input;
+                result.copy_from(a);
+                input.copy_from(b);
+                start = std::chrono::high_resolution_clock::now();
+                if (op == 0) {
+                    result.unite(input, parallel ? threads : 1);
+                } else if (op == 1) {
+                    result.intersect(input, parallel ? threads : 1);
+                } else {
+                    result.subtract(input, parallel ? threads : 1);
+                }
+                join_us[parallel] = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::high_resolution_clock::now() - start).count();
+                assert(result.check_invariants() && result.size() == naive_out.size());
+            }
+            printf("%s of %d and %d keys: naive merge %lld us, join %lld us, join on %u threads %lld us\n",
+                   names[op], large, small, (long long) naive_us, join_us[0], threads, join_us[1]);
+        }
+    }
+    printf("\n");
+}
+
+// Byte-string key without the prefix specialization: its tree uses the generic node, with the
+// key first and every step comparing full keys. Test 24 times lookups against it.
+struct UnprefixedKey {
+    std::vector<uint8_t> bytes;
+
+    const uint8_t *data() const {
+        return bytes.data();
+    }
+
+    size_t size() const {
+        return bytes.size();
+    }
+};
+
+int compare_keys(const UnprefixedKey &a, const UnprefixedKey &b) {
+    return compare_keys(a.bytes, b.bytes);
+}
+
+void test_node_layout() {
+    printf("Test 24: Hot/Cold Node Layout\n");
+    // Prefix, three links, key, color padded to a word, value and merkle: nothing else.
+    static_assert(sizeof(Node) == 6 * sizeof(uint64_t) + sizeof(std::vector<uint8_t>) + sizeof(ValueRef));
+    static_assert(sizeof(BasicNode<UnprefixedKey>) == sizeof(Node) - sizeof(uint64_t));
+    // Prefixes only decide comparisons they can: short keys and zero bytes fall back to the key.
+    {
+        std::vector<std::vector<uint8_t> > edge = {{}, {0}, {0, 0}, {'a'}, {'a', 0}, {'a', 0, 0, 0, 0, 0, 0, 0},
+                                                  {'a', 0, 0, 0, 0, 0, 0, 0, 0}, {'a', 0, 0, 0, 0, 0, 0, 0, 1},
+                                                  {'a', 0, 1}, {'a', 1}, {0xFF}};
+        RedBlackTree tree;
+        for (size_t i = edge.size(); i-- > 0;) {
+            tree.put(edge[i], edge[i]);
+        }
+        std::vector<std::vector<uint8_t> > visited;
+        tree.for_each([&visited](const std::vector<uint8_t> &key, const std::vector<uint8_t> &) {
+            visited.push_back(key);
+        });
+        assert(visited == edge && tree.check_invariants());
+        std::vector<uint8_t> value;
+        for (const auto &key: edge) {
+            assert(tree.get(key, value) && value == key);
+        }
+        assert(!tree.get({'a', 0, 0}, value));
+    }
+    const int num_keys = 300000;
+    const int num_lookups = 100000;
+    std::mt19937_64 gen(42);
+    // Random binary keys, then text keys whose first 8 bytes are all the same.
+    for (int shape = 0; shape < 2; shape++) {
+        std::vector<std::vector<uint8_t> > keys;
+        for (int i = 0; i < num_keys; i++) {
+            if (shape == 0) {
+                uint64_t a = gen();
+                uint64_t b = gen();
+                std::vector<uint8_t> key(16);
+                memcpy(key.data(), &a, 8);
+                memcpy(key.data() + 8, &b, 8);
+                keys.push_back(key);
+            } else {
+                char buffer[32];
+                snprintf(buffer, sizeof(buffer), "tenant:0001:%012llu", (unsigned long long) (gen() % 1000000000000ULL));
+                keys.emplace_back(buffer, buffer + strlen(buffer));
+            }
+        }
+        RedBlackTree tree;
+        BasicRedBlackTree<UnprefixedKey> plain;
+        for (const auto &key: keys) {
+            tree.put(key, std::vector<uint8_t>(32, 'v'));
+            plain.put(UnprefixedKey{key}, std::vector<uint8_t>(32, 'v'));
+        }
+        // The same hits and misses against both trees, alternating; the best of three rounds counts.
+        std::vector<std::vector<uint8_t> > lookups;
+        std::vector<UnprefixedKey> plain_lookups;
+        for (int n = 0; n < 2 * num_lookups; n++) {
+            lookups.push_back(keys[gen() % keys.size()]);
+            if (n >= num_lookups) {
+                lookups.back().back() ^= 0x80;
+            }
+            plain_lookups.push_back(UnprefixedKey{lookups.back()});
+        }
+        auto time_gets = [num_lookups](auto &target, const auto &batch, int half, int64_t &best) {
+            ValueRef ref;
+            size_t found = 0;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int n = half * num_lookups; n < (half + 1) * num_lookups; n++) {
+                found += target.get_ref(batch[n], ref);
+            }
+            int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+            best = best == 0 ? ns : std::min(best, ns);
+            return found;
+        };
+        int64_t hit_ns[2] = {0, 0};
+        int64_t miss_ns[2] = {0, 0};
+        for (int round = 0; round < 3; round++) {
+            assert(time_gets(tree, lookups, 0, hit_ns[0]) == static_cast<size_t>(num_lookups));
+            assert(time_gets(plain, plain_lookups, 0, hit_ns[1]) == static_cast<size_t>(num_lookups));
+            assert(time_gets(tree, lookups, 1, miss_ns[0]) == 0);
+            assert(time_gets(plain, plain_lookups, 1, miss_ns[1]) == 0);
+        }
+        assert(plain.size() == tree.size());
+        printf("%s keys, %zu in tree: get hit %.0f ns vs %.0f ns, miss %.0f ns vs %.0f ns (prefix vs none)\n",
+               shape == 0 ? "16-byte random" : "shared-prefix text", tree.size(),
+               static_cast<double>(hit_ns[0]) / num_lookups, static_cast<double>(hit_ns[1]) / num_lookups,
+               static_cast<double>(miss_ns[0]) / num_lookups, static_cast<double>(miss_ns[1]) / num_lookups);
+    }
+    printf("sizeof(Node) = %zu, %zu without the prefix\n\n", sizeof(Node), sizeof(BasicNode<UnprefixedKey>));
+}
+
+template<size_t N>
+static void check_fixed_key_order(std::mt19937_64 &gen) {
+    for (int n = 0; n < 10000; n++) {
+        std::vector<uint8_t> a(N);
+        std::vector<uint8_t> b(N);
+        for (size_t i = 0; i < N; i++) {
+            a[i] = static_cast<uint8_t>(gen() % 3);
+            b[i] = i < N - 1 - n % N ? a[i] : static_cast<uint8_t>(gen() % 3);
+        }
+        FixedKey<N> x;
+        FixedKey<N> y;
+        assert(FixedKey<N>::from(a, x) && FixedKey<N>::from(b, y));
+        int expected = compare_keys(a, b);
+        int cmp = x.compare(y);
+        assert((cmp < 0) == (expected < 0) && (cmp == 0) == (expected == 0));
+    }
+}
+
+void test_fixed_key_tree() {
+    printf("Test 25: Fixed-Length Key Trees\n");
+    std::mt19937_64 gen(42);
+    check_fixed_key_order<8>(gen);
+    check_fixed_key_order<12>(gen);
+    check_fixed_key_order<16>(gen);
+    check_fixed_key_order<20>(gen);
+    FixedKey<16> rejected;
+    assert(!FixedKey<16>::from(std::vector<uint8_t>(15), rejected));
+
+    // Random puts and erases against a std::map model.
+    FixedKeyRedBlackTree<12> small;
+    std::map<std::vector<uint8_t>, std::vector<uint8_t> > model;
+    for (int n = 0; n < 50000; n++) {
+        std::vector<uint8_t> bytes(12, 0);
+        bytes[3] = static_cast<uint8_t>(gen() % 40);
+        bytes[11] = static_cast<uint8_t>(gen() % 50);
+        FixedKey<12> key;
+        FixedKey<12>::from(bytes, key);
+        if (gen() % 3 == 0) {
+            assert(small.erase(key) == (model.erase(bytes) == 1));
+        } else {
+            std::vector<uint8_t> value = {static_cast<uint8_t>(n)};
+            small.put(key, value);
+            model[bytes] = value;
+        }
     }
+    assert(small.check_invariants() && small.size() == model.size());
+    auto it = model.begin();
+    small.for_each([&it](const FixedKey<12> &key, const std::vector<uint8_t> &value) {
+        assert(key.to_vector() == it->first && value == it->second);
+        ++it;
+    });
+    assert(it == model.end());
+    FixedKey<12> start;
+    FixedKey<12>::from(model.rbegin()->first, start);
+    size_t tail = 0;
+    small.scan(start, [&tail](const FixedKey<12> &, const std::vector<uint8_t> &) {
+        tail++;
+        return true;
+    });
+    assert(tail == 1);
 
-    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) const {
-        Node *node = find_node(root, key);
-        if (node != nullptr) {
-            out_value = node->value;
-            return true;
+    // UUID keys in the general tree and the 16-byte specialization.
+    const int num_keys = 300000;
+    std::vector<std::vector<uint8_t> > uuids;
+    std::vector<FixedKey<16> > fixed(num_keys);
+    for (int i = 0; i < num_keys; i++) {
+        std::vector<uint8_t> uuid(16);
+        for (auto &byte: uuid) {
+            byte = static_cast<uint8_t>(gen());
         }
-        return false;
+        uuid[6] = (uuid[6] & 0x0F) | 0x40;
+        uuids.push_back(uuid);
+        FixedKey<16>::from(uuid, fixed[i]);
     }
-};
+    ValueRef value = std::make_shared<const std::vector<uint8_t> >(32, 'v');
+    RedBlackTree general;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (const auto &uuid: uuids) {
+        general.put(uuid, value);
+    }
+    auto general_put_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time).count();
+    FixedKeyRedBlackTree<16> specialized;
+    start_time = std::chrono::high_resolution_clock::now();
+    for (const auto &key: fixed) {
+        specialized.put(key, value);
+    }
+    auto fixed_put_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time).count();
+    std::vector<int> order;
+    for (int n = 0; n < num_keys; n++) {
+        order.push_back(gen() % num_keys);
+    }
+    ValueRef found;
+    size_t hits = 0;
+    start_time = std::chrono::high_resolution_clock::now();
+    for (int i: order) {
+        hits += general.get_ref(uuids[i], found);
+    }
+    auto general_get_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time).count();
+    start_time = std::chrono::high_resolution_clock::now();
+    for (int i: order) {
+        hits += specialized.get_ref(fixed[i], found);
+    }
+    auto fixed_get_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time).count();
+    assert(hits == 2 * order.size() && specialized.check_invariants());
 
-class ConcurrentRedBlackTree {
-private:
-    RedBlackTree tree;
-    mutable std::shared_mutex mutex;
+    printf("%d UUID keys: put %.0f ns vs %.0f ns, get %.0f ns vs %.0f ns (fixed vs general)\n", num_keys,
+           static_cast<double>(fixed_put_ns) / num_keys, static_cast<double>(general_put_ns) / num_keys,
+           static_cast<double>(fixed_get_ns) / num_keys, static_cast<double>(general_get_ns) / num_keys);
+    printf("Node size: %zu bytes with the key inline vs %zu bytes + a 16-byte key buffer\n\n",
+           FixedKeyRedBlackTree<16>::node_bytes, sizeof(Node));
+}
 
-public:
-    ConcurrentRedBlackTree() = default;
+void test_radix_bulk_ingest() {
+    printf("Test 26: Radix Sort and Bulk Ingest\n");
+    std::mt19937_64 gen(42);
+    unsigned threads = std::max(4u, std::thread::hardware_concurrency());
 
-    void put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
-        std::unique_lock lock(mutex);
-        tree.put(key, value);
+    // Stable and ordered like compare_keys, including empty keys, shared prefixes and duplicates.
+    for (size_t n: {size_t(0), size_t(1), size_t(100), size_t(5000), size_t(200000)}) {
+        std::vector<KeyValue> entries;
+        for (size_t i = 0; i < n; i++) {
+            std::vector<uint8_t> key(gen() % 12);
+            for (auto &byte: key) {
+                byte = static_cast<uint8_t>(gen() % 4 == 0 ? 0 : 'a' + gen() % 3);
+            }
+            entries.emplace_back(key, std::vector<uint8_t>{static_cast<uint8_t>(i), static_cast<uint8_t>(i >> 8)});
+        }
+        for (unsigned t: {1u, threads}) {
+            std::vector<KeyValue *> items;
+            for (auto &entry: entries) {
+                items.push_back(&entry);
+            }
+            std::vector<KeyValue *> expected = items;
+            std::stable_sort(expected.begin(), expected.end(), [](const KeyValue *a, const KeyValue *b) {
+                return compare_keys(a->first, b->first) < 0;
+            });
+            radix_sort_by_key(items, t);
+            assert(items == expected);
+        }
     }
 
-    bool get(const std::vector<uint8_t> &key, std::vector<uint8_t> &out_value) const {
-        std::shared_lock lock(mutex);
-        return tree.get(key, out_value);
+    // Keys sharing a 4 KB prefix, many of them duplicates, sort without deep recursion.
+    std::vector<KeyValue> long_keys;
+    for (size_t i = 0; i < 100000; i++) {
+        std::vector<uint8_t> key(4096, 'p');
+        key.push_back(static_cast<uint8_t>(gen() % 3));
+        if (i % 2 == 0) {
+            key.resize(key.size() + 4096, 'q');
+            key.push_back(static_cast<uint8_t>(gen() % 3));
+        }
+        long_keys.emplace_back(std::move(key), std::vector<uint8_t>{static_cast<uint8_t>(i)});
+    }
+    for (unsigned t: {1u, threads}) {
+        std::vector<KeyValue *> items;
+        for (auto &entry: long_keys) {
+            items.push_back(&entry);
+        }
+        std::vector<KeyValue *> expected = items;
+        std::stable_sort(expected.begin(), expected.end(), [](const KeyValue *a, const KeyValue *b) {
+            return compare_keys(a->first, b->first) < 0;
+        });
+        radix_sort_by_key(items, t);
+        assert(items == expected);
     }
-};
 
-void test_concurrent_writes() {
-    printf("Test 1: Concurrent Writes\n");
-    ConcurrentRedBlackTree tree;
-    const int num_threads = 8;
-    const int ops_per_thread = 1000;
+    // put_batch: later entries win inside the batch, and the batch wins over the tree.
+    RedBlackTree tree;
+    std::map<std::vector<uint8_t>, std::vector<uint8_t> > model;
+    for (int round = 0; round < 4; round++) {
+        std::vector<KeyValue> batch;
+        for (int i = 0; i < 30000; i++) {
+            std::vector<uint8_t> key = {'k', static_cast<uint8_t>(gen() % 50), static_cast<uint8_t>(gen() % 200)};
+            std::vector<uint8_t> value = {static_cast<uint8_t>(round), static_cast<uint8_t>(i)};
+            batch.emplace_back(key, value);
+            model[key] = value;
+        }
+        tree.put_batch(batch, round % 2 ? threads : 1);
+        assert(tree.check_invariants() && tree.size() == model.size());
+    }
+    auto it = model.begin();
+    tree.for_each([&it](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value) {
+        assert(key == it->first && value == it->second);
+        ++it;
+    });
 
-    std::vector<std::thread> threads;
+    // Sort throughput on random binary keys and on text keys with a shared prefix.
+    for (int shape = 0; shape < 2; shape++) {
+        for (size_t n: {size_t(1000000), size_t(2000000)}) {
+            std::vector<KeyValue> entries;
+            entries.reserve(n);
+            for (size_t i = 0; i < n; i++) {
+                std::vector<uint8_t> key(16);
+                if (shape == 0) {
+                    uint64_t a = gen();
+                    uint64_t b = gen();
+                    memcpy(key.data(), &a, 8);
+                    memcpy(key.data() + 8, &b, 8);
+                } else {
+                    char buffer[17];
+                    snprintf(buffer, sizeof(buffer), "user:%011llu", (unsigned long long) (gen() % 100000000000ULL));
+                    memcpy(key.data(), buffer, 16);
+                }
+                entries.emplace_back(std::move(key), std::vector<uint8_t>());
+            }
+            std::vector<KeyValue *> items;
+            for (auto &entry: entries) {
+                items.push_back(&entry);
+            }
+            std::vector<KeyValue *> compared = items;
+            auto start = std::chrono::high_resolution_clock::now();
+            std::sort(compared.begin(), compared.end(), [](const KeyValue *a, const KeyValue *b) {
+                return compare_keys(a->first, b->first) < 0;
+            });
+            auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+            long long radix_ms[2];
+            for (int parallel = 0; parallel < 2; parallel++) {
+                std::vector<KeyValue *> sorted = items;
+                start = std::chrono::high_resolution_clock::now();
+                radix_sort_by_key(sorted, parallel ? threads : 1);
+                radix_ms[parallel] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::high_resolution_clock::now() - start).count();
+                for (size_t i = 1; i < sorted.size(); i += 997) {
+                    assert(compare_keys(sorted[i - 1]->first, sorted[i]->first) <= 0);
+                }
+            }
+            printf("%zuM %s keys: std::sort %lld ms, radix %lld ms, radix on %u threads %lld ms\n", n / 1000000,
+                   shape == 0 ? "random" : "prefixed", (long long) sort_ms, radix_ms[0], threads, radix_ms[1]);
+        }
+    }
 
+    // Bulk load: one put per entry against put_batch.
+    const int num_keys = 1000000;
+    std::vector<KeyValue> entries;
+    for (int i = 0; i < num_keys; i++) {
+        std::vector<uint8_t> key(16);
+        uint64_t a = gen();
+        memcpy(key.data(), &a, 8);
+        entries.emplace_back(std::move(key), std::vector<uint8_t>(16, 'v'));
+    }
+    RedBlackTree one_by_one;
     auto start = std::chrono::high_resolution_clock::now();
+    for (const auto &entry: entries) {
+        one_by_one.put(entry.first, entry.second);
+    }
+    auto put_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    ConcurrentRedBlackTree bulk;
+    start = std::chrono::high_resolution_clock::now();
+    bulk.put_batch(entries, threads);
+    auto batch_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(bulk.size() == one_by_one.size());
+    printf("Bulk load of %d unsorted entries: %lld ms with put, %lld ms with put_batch\n\n", num_keys,
+           (long long) put_ms, (long long) batch_ms);
+}
 
-    for (int t = 0; t < num_threads; t++) {
-        threads.emplace_back([&tree, t, ops_per_thread]() {
-            for (int i = 0; i < ops_per_thread; i++) {
-                std::vector<uint8_t> key = {
-                    static_cast<uint8_t>(t),
-                    static_cast<uint8_t>(i >> 8),
-                    static_cast<uint8_t>(i & 0xFF)
-                };
-                std::vector<uint8_t> value = {
-                    static_cast<uint8_t>(t * 100 + i)
-                };
-                tree.put(key, value);
+void test_work_stealing_pool() {
+    printf("Test 27: Work-Stealing Pool\n");
+    // Every pushed item is taken exactly once by the owner or one of the thieves.
+    {
+        const int num_items = 200000;
+        std::vector<int> items(num_items);
+        std::vector<std::atomic<int> > taken(num_items);
+        WorkStealingDeque<int> deque(4);
+        std::atomic<bool> done{false};
+        std::vector<std::thread> thieves;
+        std::atomic<int> stolen{0};
+        for (int t = 0; t < 3; t++) {
+            thieves.emplace_back([&] {
+                while (!done.load() || !deque.empty()) {
+                    if (int *item = deque.steal()) {
+                        taken[item - items.data()]++;
+                        stolen++;
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for (int i = 0; i < num_items; i++) {
+            deque.push(&items[i]);
+            if (i % 3 == 0) {
+                if (int *item = deque.pop()) {
+                    taken[item - items.data()]++;
+                }
             }
-        });
+        }
+        while (int *item = deque.pop()) {
+            taken[item - items.data()]++;
+        }
+        done = true;
+        for (auto &thief: thieves) {
+            thief.join();
+        }
+        for (int i = 0; i < num_items; i++) {
+            assert(taken[i] == 1);
+        }
+        printf("Deque: %d items, %d stolen, each taken once\n", num_items, stolen.load());
     }
 
-    for (auto &thread: threads) {
-        thread.join();
+    WorkStealingPool pool(4);
+    std::atomic<uint64_t> fib_forks{0};
+    std::function<uint64_t(uint64_t)> fib = [&](uint64_t n) -> uint64_t {
+        if (n < 12) {
+            return n < 2 ? n : fib(n - 1) + fib(n - 2);
+        }
+        uint64_t a = 0;
+        uint64_t b = 0;
+        fib_forks++;
+        pool.fork_join([&] { a = fib(n - 1); }, [&] { b = fib(n - 2); });
+        return a + b;
+    };
+    assert(fib(27) == 196418);
+    // Every forked half ran as a task, plus the root handed over by this thread.
+    uint64_t fib_tasks = pool.get_tasks_run();
+    assert(fib_forks > 0 && fib_tasks == fib_forks + 1);
+    std::vector<uint64_t> squares(100000);
+    pool.parallel_for(0, squares.size(), 1000, [&](size_t i) { squares[i] = i * i; });
+    for (size_t i = 0; i < squares.size(); i += 997) {
+        assert(squares[i] == i * i);
     }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    // Cost of a fork/join pair: the pool against a thread per fork.
+    const int num_forks = 20000;
+    std::atomic<uint64_t> sum{0};
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_forks; i++) {
+        pool.fork_join([&] { sum += 1; }, [&] { sum += 2; });
+    }
+    auto pool_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_forks; i++) {
+        std::thread worker([&] { sum += 2; });
+        sum += 1;
+        worker.join();
+    }
+    auto thread_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(sum == 6ULL * num_forks);
 
-    // Verify all keys are present
-    int verified = 0;
-    for (int t = 0; t < num_threads; t++) {
-        for (int i = 0; i < ops_per_thread; i++) {
-            std::vector<uint8_t> key = {
-                static_cast<uint8_t>(t),
-                static_cast<uint8_t>(i >> 8),
-                static_cast<uint8_t>(i & 0xFF)
-            };
-            std::vector<uint8_t> result;
-            assert(tree.get(key, result) == true);
-            verified++;
-        }
+    // Nested parallel operations ask for far more tasks than there are cores.
+    RedBlackTree a;
+    RedBlackTree b;
+    std::vector<KeyValue> batch;
+    for (int i = 0; i < 200000; i++) {
+        std::vector<uint8_t> key = {static_cast<uint8_t>(i >> 16), static_cast<uint8_t>(i >> 8),
+                                    static_cast<uint8_t>(i)};
+        a.put(key, {'a'});
+        batch.emplace_back(std::vector<uint8_t>{0xFF, static_cast<uint8_t>(i >> 16), static_cast<uint8_t>(i >> 8),
+                                                static_cast<uint8_t>(i)}, std::vector<uint8_t>{'b'});
     }
+    uint64_t tasks_before = WorkStealingPool::shared().get_tasks_run();
+    start = std::chrono::high_resolution_clock::now();
+    b.put_batch(batch, 64);
+    a.unite(b, 64);
+    auto nested_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(a.size() == 400000 && a.check_invariants());
+    uint64_t nested_tasks = WorkStealingPool::shared().get_tasks_run() - tasks_before;
+    assert(nested_tasks > 0);
 
-    printf("%d concurrent writes completed in %lld ms\n", num_threads * ops_per_thread, duration.count());
-    printf("All %d keys verified\n\n", verified);
+    printf("fib(27) on 4 workers: %llu forks, %llu tasks run, %llu stolen in total\n",
+           (unsigned long long) fib_forks.load(), (unsigned long long) fib_tasks,
+           (unsigned long long) pool.get_steals());
+    printf("Fork/join: %.2f us on the pool vs %.2f us with a thread per fork\n",
+           static_cast<double>(pool_us) / num_forks, static_cast<double>(thread_us) / num_forks);
+    printf("put_batch and unite asking for 64-way parallelism: %lld ms on %u shared workers, %llu tasks run\n\n",
+           (long long) nested_us / 1000, WorkStealingPool::shared().size(), (unsigned long long) nested_tasks);
 }
 
-void test_concurrent_reads() {
-    printf("Test 2: Concurrent Reads\n");
-    ConcurrentRedBlackTree tree;
-    const int num_keys = 1000;
-    const int num_reader_threads = 16;
-    const int reads_per_thread = 10000;
-
-    // Pre-populate tree
-    for (int i = 0; i < num_keys; i++) {
-        std::vector<uint8_t> key = {
-            static_cast<uint8_t>(i >> 8),
-            static_cast<uint8_t>(i & 0xFF)
-        };
-        std::vector<uint8_t> value = {
-            static_cast<uint8_t>(i)
-        };
-        tree.put(key, value);
-    }
-
-    std::atomic<int> successful_reads{0};
-    std::vector<std::thread> threads;
+void test_ingest_rings() {
+    printf("Test 28: Ingest Rings and Pipelined Ingest\n");
+    const uint64_t num_items = 1000000;
 
+    // SPSC: batches of varying size arrive whole and in order.
+    SpscRing<uint64_t> spsc(1024);
     auto start = std::chrono::high_resolution_clock::now();
+    std::thread spsc_producer([&] {
+        std::vector<uint64_t> batch;
+        for (uint64_t next = 0; next < num_items;) {
+            batch.clear();
+            for (uint64_t i = 0; i < 1 + next % 61 && next + i < num_items; i++) {
+                batch.push_back(next + i);
+            }
+            size_t pushed = 0;
+            while (pushed < batch.size()) {
+                size_t n = spsc.try_push_batch(batch.data() + pushed, batch.size() - pushed);
+                if (n == 0) {
+                    std::this_thread::yield();
+                }
+                pushed += n;
+            }
+            next += batch.size();
+        }
+    });
+    std::vector<uint64_t> out(256);
+    for (uint64_t expected = 0; expected < num_items;) {
+        size_t n = spsc.try_pop_batch(out.data(), out.size());
+        for (size_t i = 0; i < n; i++) {
+            assert(out[i] == expected++);
+        }
+        if (n == 0) {
+            std::this_thread::yield();
+        }
+    }
+    spsc_producer.join();
+    auto spsc_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
 
-    for (int t = 0; t < num_reader_threads; t++) {
-        threads.emplace_back([&tree, &successful_reads, num_keys, reads_per_thread, t]() {
-            for (int i = 0; i < reads_per_thread; i++) {
-                int idx = (t * 7919 + i * 31) % num_keys;
-                std::vector<uint8_t> key = {
-                    static_cast<uint8_t>(idx >> 8),
-                    static_cast<uint8_t>(idx & 0xFF)
-                };
-                std::vector<uint8_t> result;
-                if (tree.get(key, result)) {
-                    ++successful_reads;
+    // MPSC: every item arrives once and each producer's items stay in order.
+    const int num_producers = 4;
+    MpscRing<uint64_t> mpsc(1024);
+    std::vector<std::thread> producers;
+    start = std::chrono::high_resolution_clock::now();
+    for (int p = 0; p < num_producers; p++) {
+        producers.emplace_back([&, p] {
+            uint64_t batch[8];
+            for (uint64_t next = 0; next < num_items / num_producers;) {
+                size_t n = std::min<uint64_t>(1 + next % 8, num_items / num_producers - next);
+                for (size_t i = 0; i < n; i++) {
+                    batch[i] = static_cast<uint64_t>(p) << 32 | (next + i);
+                }
+                while (!mpsc.try_push_batch(batch, n)) {
+                    std::this_thread::yield();
                 }
+                next += n;
             }
         });
     }
-
-    for (auto &thread: threads) {
-        thread.join();
+    std::vector<uint64_t> expected(num_producers, 0);
+    for (uint64_t received = 0; received < num_items;) {
+        size_t n = mpsc.try_pop_batch(out.data(), out.size());
+        for (size_t i = 0; i < n; i++) {
+            assert((out[i] & 0xFFFFFFFF) == expected[out[i] >> 32]++);
+        }
+        received += n;
+        if (n == 0) {
+            std::this_thread::yield();
+        }
+    }
+    for (auto &producer: producers) {
+        producer.join();
     }
+    auto mpsc_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    assert(!mpsc.try_pop(out[0]));
+    printf("SPSC: %.1f M items/s, MPSC with %d producers: %.1f M items/s\n",
+           num_items / static_cast<double>(spsc_us), num_producers, num_items / static_cast<double>(mpsc_us));
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    // Producers format and encode their records, then either put them directly or hand them
+    // to the pipeline.
+    const int per_producer = 100000;
+    auto encode = [](int p, int i) {
+        char text[32];
+        int len = snprintf(text, sizeof(text), "user:%02d:%08d", p, (i * 7919) % per_producer);
+        KeyValue entry;
+        entry.first.assign(text, text + len);
+        entry.second.assign(16, static_cast<uint8_t>(p + i));
+        return entry;
+    };
+    auto run = [&](const std::function<void(int)> &producer) {
+        std::vector<std::thread> threads;
+        auto begin = std::chrono::high_resolution_clock::now();
+        for (int p = 0; p < num_producers; p++) {
+            threads.emplace_back(producer, p);
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - begin).count();
+    };
 
-    printf("%d concurrent reads completed in %lld ms\n",
-           num_reader_threads * reads_per_thread, duration.count());
-    printf("%d successful reads\n\n", successful_reads.load());
+    ConcurrentRedBlackTree direct;
+    auto direct_us = run([&](int p) {
+        for (int i = 0; i < per_producer; i++) {
+            KeyValue entry = encode(p, i);
+            direct.put(entry.first, entry.second);
+        }
+    });
+    assert(direct.size() == static_cast<size_t>(num_producers * per_producer));
+    printf("Direct put from %d producers: %.0f K entries/s\n", num_producers,
+           num_producers * per_producer * 1000.0 / direct_us);
+
+    for (unsigned appliers: {1u, 2u}) {
+        ConcurrentRedBlackTree piped;
+        IngestPipeline::Options options;
+        options.appliers = appliers;
+        uint64_t batches = 0;
+        uint64_t waits = 0;
+        long long piped_us = 0;
+        {
+            IngestPipeline pipeline(piped, options);
+            piped_us = run([&](int p) {
+                for (int i = 0; i < per_producer; i++) {
+                    pipeline.submit(encode(p, i));
+                }
+            });
+            auto begin = std::chrono::high_resolution_clock::now();
+            pipeline.close();
+            piped_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::high_resolution_clock::now() - begin).count();
+            assert(pipeline.get_applied() == static_cast<uint64_t>(num_producers * per_producer));
+            batches = pipeline.get_batches();
+            waits = pipeline.get_full_waits();
+        }
+        assert(piped.size() == direct.size());
+        for (int p = 0; p < num_producers; p++) {
+            for (int i = 0; i < per_producer; i += 4999) {
+                KeyValue entry = encode(p, i);
+                std::vector<uint8_t> value;
+                assert(piped.get(entry.first, value) && value == entry.second);
+            }
+        }
+        printf("Pipelined with %u applier(s): %.0f K entries/s, %llu batches (avg %.0f), %llu full-ring waits\n",
+               appliers, num_producers * per_producer * 1000.0 / piped_us, (unsigned long long) batches,
+               static_cast<double>(num_producers * per_producer) / batches, (unsigned long long) waits);
+    }
+
+    // submit_batch routes a producer-side batch per applier; the last write to a key wins, even
+    // through one-slot rings.
+    for (size_t capacity: {1, 64}) {
+        ConcurrentRedBlackTree batched;
+        {
+            IngestPipeline::Options options;
+            options.appliers = 3;
+            options.ring_capacity = capacity;
+            IngestPipeline pipeline(batched, options);
+            std::vector<KeyValue> entries;
+            for (int round = 0; round < 3; round++) {
+                for (int i = 0; i < 1000; i++) {
+                    KeyValue entry = encode(0, i);
+                    entry.second = {static_cast<uint8_t>(round)};
+                    entries.push_back(std::move(entry));
+                }
+                pipeline.submit_batch(entries);
+                entries.clear();
+            }
+        }
+        std::vector<uint8_t> value;
+        assert(batched.size() == 1000);
+        assert(batched.get(encode(0, 123).first, value) && value == std::vector<uint8_t>{2});
+    }
+    printf("submit_batch across 3 appliers with 1- and 64-slot rings: 1000 keys, last round kept\n\n");
 }
 
-void test_mixed_read_write() {
-    printf("Test 3: Mixed Read/Write Operations\n");
-    ConcurrentRedBlackTree tree;
-    const int num_writer_threads = 4;
-    const int num_reader_threads = 12;
-    const int ops_per_thread = 5000;
+void test_workload_capture_replay() {
+    printf("Test 29: Workload Capture and Replay\n");
+    const std::string path = "ytdb_workload.trace";
+    const int num_threads = 4;
+    const int ops_per_thread = 50000;
+    auto key_for = [](int t, int i) {
+        char text[32];
+        int len = snprintf(text, sizeof(text), "t%d:%06d", t, (i * 7) % 5000);
+        return std::vector<uint8_t>(text, text + len);
+    };
+    auto op_for = [](int i) {
+        return i % 10 < 5 ? TraceOp::PUT : i % 10 < 9 ? TraceOp::GET : i % 20 == 9 ? TraceOp::ERASE : TraceOp::SCAN;
+    };
+    // Threads touch disjoint keys, so the final state does not depend on how they interleave.
+    auto run = [&](ConcurrentRedBlackTree &tree) {
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t] {
+                std::vector<uint8_t> value;
+                std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > scanned;
+                for (int i = 0; i < ops_per_thread; i++) {
+                    std::vector<uint8_t> key = key_for(t, i);
+                    switch (op_for(i)) {
+                        case TraceOp::PUT:
+                            tree.put(key, std::vector<uint8_t>(16 + i % 48, 'v'));
+                            break;
+                        case TraceOp::GET:
+                            tree.get(key, value);
+                            break;
+                        case TraceOp::ERASE:
+                            tree.erase(key);
+                            break;
+                        case TraceOp::SCAN:
+                            scanned.clear();
+                            tree.scan(key, 10, scanned);
+                            break;
+                    }
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+    };
+    // Keys and value sizes, which is what a replay reproduces.
+    auto shape = [](ConcurrentRedBlackTree &tree) {
+        std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > entries;
+        tree.scan({}, SIZE_MAX, entries);
+        std::vector<std::pair<std::vector<uint8_t>, size_t> > out;
+        for (auto &entry: entries) {
+            out.emplace_back(entry.first, entry.second.size());
+        }
+        return out;
+    };
 
-    std::atomic<int> writes{0};
-    std::atomic<int> reads{0};
+    ConcurrentRedBlackTree plain;
+    auto plain_us = run(plain);
+    ConcurrentRedBlackTree captured;
+    WorkloadCapture capture;
+    assert(capture.open(path));
+    captured.set_capture(&capture);
+    auto captured_us = run(captured);
+    captured.set_capture(nullptr);
+    assert(capture.close());
+    const uint64_t total = static_cast<uint64_t>(num_threads) * ops_per_thread;
+    assert(capture.get_recorded() == total);
+    printf("Capture: %.0f K ops/s without, %.0f K ops/s with, %.1f bytes per record\n",
+           total * 1000.0 / plain_us, total * 1000.0 / captured_us,
+           static_cast<double>(capture.get_bytes_written()) / total);
 
-    std::vector<std::thread> threads;
+    // Each captured thread's stream is exactly the operations that thread issued, in order.
+    std::vector<TraceRecord> trace;
+    assert(load_trace(path, trace));
+    assert(trace.size() == total);
+    std::vector<std::vector<const TraceRecord *> > streams(num_threads);
+    for (size_t i = 0; i < trace.size(); i++) {
+        assert(i == 0 || trace[i - 1].ns <= trace[i].ns);
+        assert(trace[i].thread < static_cast<uint32_t>(num_threads));
+        streams[trace[i].thread].push_back(&trace[i]);
+    }
+    for (auto &stream: streams) {
+        assert(stream.size() == static_cast<size_t>(ops_per_thread));
+        int t = stream[0]->key[1] - '0';
+        for (int i = 0; i < ops_per_thread; i++) {
+            assert(stream[i]->key == key_for(t, i) && stream[i]->op == op_for(i));
+            assert(stream[i]->op != TraceOp::PUT || stream[i]->value_size == static_cast<uint64_t>(16 + i % 48));
+        }
+    }
 
-    auto start = std::chrono::high_resolution_clock::now();
+    // Replays as fast as possible reproduce the captured state every time.
+    ReplayOptions fast;
+    fast.speed = 0;
+    for (int round = 0; round < 2; round++) {
+        ConcurrentRedBlackTree replayed;
+        ReplayReport report = replay_trace(replayed, trace, fast);
+        assert(report.ops == total && report.skipped == 0);
+        assert(shape(replayed) == shape(captured));
+        if (round == 0) {
+            print_replay_report(report);
+        }
+    }
 
-    // Writer threads
-    for (int t = 0; t < num_writer_threads; t++) {
-        threads.emplace_back([&, t]() {
-            std::random_device rd;
-            std::mt19937 gen(rd());
-            std::uniform_int_distribution<> dis(0, 255);
+    // Paced at the captured rate the replay cannot finish before the trace says it may.
+    ReplayOptions paced;
+    paced.speed = 1;
+    ConcurrentRedBlackTree replayed;
+    ReplayReport report = replay_trace(replayed, trace, paced);
+    assert(report.elapsed_us >= report.trace_us);
+    print_replay_report(report);
 
-            for (int i = 0; i < ops_per_thread; i++) {
-                std::vector<uint8_t> key = {
-                    static_cast<uint8_t>(dis(gen)),
-                    static_cast<uint8_t>(dis(gen))
-                };
-                std::vector<uint8_t> value = {
-                    static_cast<uint8_t>(t),
-                    static_cast<uint8_t>(i & 0xFF)
-                };
-                tree.put(key, value);
-                ++writes;
+    // An engine without erase and scan skips them; the CLI entry point does the same.
+    ShardedRedBlackTree sharded;
+    report = replay_trace(sharded, trace, fast);
+    assert(report.skipped == total / 10 && report.ops == total - total / 10);
+    char arg0[] = "ytdb", arg1[] = "replay", arg3[] = "--speed", arg4[] = "0", arg5[] = "--engine", arg6[] = "sharded";
+    std::vector<char> arg2(path.begin(), path.end());
+    arg2.push_back('\0');
+    char *argv[] = {arg0, arg1, arg2.data(), arg3, arg4, arg5, arg6};
+    assert(replay_main(7, argv) == 0);
+
+    // A thread alternating between two captures keeps one buffer, and one stream, in each.
+    const std::string second_path = "ytdb_workload_second.trace";
+    {
+        WorkloadCapture first;
+        WorkloadCapture second;
+        assert(first.open(path) && second.open(second_path));
+        for (int i = 0; i < 10000; i++) {
+            (i % 2 == 0 ? first : second).record(TraceOp::GET, key_for(0, i), 0);
+        }
+        assert(first.close() && second.close());
+        for (const std::string &file: {path, second_path}) {
+            std::vector<TraceRecord> records;
+            assert(load_trace(file, records) && records.size() == 5000);
+            for (const TraceRecord &record: records) {
+                assert(record.thread == 0);
             }
-        });
+        }
     }
 
-    // Reader threads
-    for (int t = 0; t < num_reader_threads; t++) {
-        threads.emplace_back([&]() {
-            std::random_device rd;
-            std::mt19937 gen(rd());
-            std::uniform_int_distribution<> dis(0, 255);
+    // put_if_absent and transact record only the writes they made, after releasing the tree lock.
+    {
+        ConcurrentRedBlackTree tree;
+        WorkloadCapture conditional;
+        assert(conditional.open(second_path));
+        tree.set_capture(&conditional);
+        std::vector<uint8_t> value(20, 'v');
+        assert(tree.put_if_absent(key_for(0, 0), value) && !tree.put_if_absent(key_for(0, 0), value));
+        assert(tree.transact([&](const RedBlackTree &, ConcurrentRedBlackTree::WriteSet &writes) {
+            writes[key_for(0, 0)] = {false, {}};
+            writes[key_for(0, 1)] = {true, value};
+            return true;
+        }));
+        tree.set_capture(nullptr);
+        assert(conditional.close());
+        std::vector<TraceRecord> records;
+        assert(load_trace(second_path, records) && records.size() == 3);
+        assert(records[0].op == TraceOp::PUT && records[0].key == key_for(0, 0) && records[0].value_size == 20);
+        assert(records[1].op == TraceOp::ERASE && records[1].key == key_for(0, 0));
+        assert(records[2].op == TraceOp::PUT && records[2].key == key_for(0, 1) && records[2].value_size == 20);
+    }
 
-            for (int i = 0; i < ops_per_thread; i++) {
-                std::vector<uint8_t> key = {
-                    static_cast<uint8_t>(dis(gen)),
-                    static_cast<uint8_t>(dis(gen))
-                };
-                std::vector<uint8_t> result;
-                tree.get(key, result);
-                ++reads;
+    // A block header claiming more payload than the file holds is rejected before allocating it.
+    {
+        FILE *file = fopen(path.c_str(), "wb");
+        uint32_t header[5] = {TRACE_MAGIC, TRACE_VERSION, 0, 1, 0xFFFFFFF0u};
+        uint64_t base_ns = 0;
+        uint8_t record[4] = {static_cast<uint8_t>(TraceOp::GET), 0, 0, 0};
+        fwrite(header, sizeof(header), 1, file);
+        fwrite(&base_ns, sizeof(base_ns), 1, file);
+        fwrite(record, sizeof(record), 1, file);
+        fclose(file);
+        std::vector<TraceRecord> records;
+        assert(!load_trace(path, records));
+    }
+    remove(path.c_str());
+    remove(second_path.c_str());
+    printf("\n");
+}
+
+void test_slow_op_log() {
+    printf("Test 30: Slow-Operation Log\n");
+    // The ring keeps the newest `capacity` records, oldest first.
+    {
+        SlowOpLog::Options options;
+        options.threshold_ns = 0;
+        options.capacity = 8;
+        SlowOpLog log(options);
+        for (uint32_t i = 0; i < 20; i++) {
+            OpTrace trace;
+            trace.depth = i;
+            log.finish(TraceOp::GET, std::vector<uint8_t>(i + 1, 'k'), steady_ns(), trace);
+        }
+        std::vector<SlowOp> records = log.read();
+        assert(records.size() == 8 && log.get_recorded() == 20);
+        for (uint32_t i = 0; i < 8; i++) {
+            assert(records[i].sequence == 12 + i && records[i].depth == 12 + i);
+            assert(records[i].key_size == 13 + i && records[i].key_prefix_len == std::min<uint32_t>(13 + i, 16));
+        }
+    }
+
+    // Readers never see a record that is half one write and half another.
+    {
+        SlowOpLog::Options options;
+        options.threshold_ns = 0;
+        options.capacity = 64;
+        SlowOpLog log(options);
+        std::atomic<bool> done{false};
+        std::vector<std::thread> writers;
+        for (uint32_t t = 0; t < 4; t++) {
+            writers.emplace_back([&, t] {
+                for (uint32_t i = 0; i < 50000; i++) {
+                    OpTrace trace;
+                    trace.depth = i;
+                    trace.rotations = t;
+                    trace.lock_wait_ns = static_cast<uint64_t>(t) << 32 | i;
+                    trace.alloc_ns = ~trace.lock_wait_ns;
+                    std::vector<uint8_t> key = {static_cast<uint8_t>(t), static_cast<uint8_t>(i >> 16),
+                                                static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+                    log.finish(TraceOp::PUT, key, steady_ns(), trace);
+                }
+            });
+        }
+        size_t checked = 0;
+        std::thread reader([&] {
+            while (!done.load()) {
+                for (const SlowOp &record: log.read()) {
+                    uint32_t i = record.key_prefix[1] << 16 | record.key_prefix[2] << 8 | record.key_prefix[3];
+                    assert(record.key_prefix[0] == record.rotations && record.depth == i);
+                    assert(record.lock_wait_ns == (static_cast<uint64_t>(record.rotations) << 32 | i));
+                    assert(record.alloc_ns == ~record.lock_wait_ns);
+                    checked++;
+                }
             }
         });
+        for (auto &writer: writers) {
+            writer.join();
+        }
+        done = true;
+        reader.join();
+        assert(log.get_recorded() == 200000);
+        printf("Concurrent writers: %zu records read consistently, %llu dropped after being lapped\n", checked,
+               (unsigned long long) log.get_dropped());
     }
 
-    for (auto &thread: threads) {
-        thread.join();
+    // Cost on the normal path: no log attached, and a log whose threshold nothing reaches.
+    const int num_keys = 200000;
+    std::vector<std::vector<uint8_t> > keys(num_keys);
+    std::mt19937_64 rng(42);
+    for (auto &key: keys) {
+        uint64_t k = rng();
+        key.assign(reinterpret_cast<uint8_t *>(&k), reinterpret_cast<uint8_t *>(&k) + sizeof(k));
     }
+    std::vector<uint8_t> value(32, 'v');
+    auto time_ops = [&](ConcurrentRedBlackTree &tree) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<uint8_t> out;
+        for (auto &key: keys) {
+            tree.put(key, value);
+        }
+        for (auto &key: keys) {
+            tree.get(key, out);
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - start).count() / (2.0 * num_keys);
+    };
+    ConcurrentRedBlackTree plain;
+    double plain_ns = time_ops(plain);
+    SlowOpLog::Options quiet_options;
+    quiet_options.threshold_ns = 1000000000;
+    SlowOpLog quiet(quiet_options);
+    ConcurrentRedBlackTree traced;
+    traced.set_slow_op_log(&quiet);
+    double traced_ns = time_ops(traced);
+    traced.set_slow_op_log(nullptr);
+    assert(quiet.get_recorded() == 0);
+    printf("Per operation: %.0f ns without a log, %.0f ns with one attached\n", plain_ns, traced_ns);
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    // Every insert logged: depth stays within the red-black bound and rotations are reported.
+    {
+        SlowOpLog::Options options;
+        options.threshold_ns = 0;
+        options.capacity = 4096;
+        SlowOpLog log(options);
+        ConcurrentRedBlackTree tree;
+        tree.set_slow_op_log(&log);
+        for (int i = 0; i < 1000; i++) {
+            tree.put({static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)}, value);
+        }
+        std::vector<uint8_t> out;
+        assert(tree.get({0, 5}, out) && tree.erase({0, 5}));
+        tree.set_slow_op_log(nullptr);
+        std::vector<SlowOp> records = log.read();
+        assert(records.size() == 1002);
+        uint64_t rotations = 0;
+        uint32_t max_depth = 0;
+        for (int i = 0; i < 1000; i++) {
+            assert(records[i].op == TraceOp::PUT && records[i].key_size == 2 && records[i].alloc_ns > 0);
+            rotations += records[i].rotations;
+            max_depth = std::max(max_depth, records[i].depth);
+        }
+        assert(max_depth <= 2 * 10 && rotations > 0);
+        assert(records[1000].op == TraceOp::GET && records[1000].depth > 0);
+        assert(records[1001].op == TraceOp::ERASE && records[1001].depth == records[1000].depth);
+        printf("1000 sequential inserts: max depth %u, %llu rotations\n", max_depth, (unsigned long long) rotations);
+    }
 
-    printf("Mixed operations completed in %lld ms\n", duration.count());
-    printf("Writes: %d, Reads: %d, Ops/ms: %lld\n\n", writes.load(), reads.load(),
-           (writes.load() + reads.load()) / duration.count());
+    // A put stuck behind a writer is logged with the wait as its cause.
+    SlowOpLog::Options options;
+    options.threshold_ns = 2000000;
+    SlowOpLog log(options);
+    traced.set_slow_op_log(&log);
+    std::atomic<bool> locked{false};
+    std::thread holder([&] {
+        traced.atomically([&](RedBlackTree &) {
+            locked = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        });
+    });
+    while (!locked.load()) {
+        std::this_thread::yield();
+    }
+    traced.put({'s', 'l', 'o', 'w'}, value);
+    holder.join();
+    traced.set_slow_op_log(nullptr);
+    std::vector<SlowOp> records = log.read();
+    assert(!records.empty());
+    const SlowOp &slow = records.back();
+    assert(slow.op == TraceOp::PUT && slow.key_size == 4 && memcmp(slow.key_prefix, "slow", 4) == 0);
+    assert(slow.lock_wait_ns >= 10000000 && slow.lock_wait_ns <= slow.total_ns && slow.depth > 0);
+    printf("Blocked put: %.1f ms total, %.1f ms lock wait, depth %u, %u rotations, %.1f us allocating\n\n",
+           slow.total_ns / 1e6, slow.lock_wait_ns / 1e6, slow.depth, slow.rotations, slow.alloc_ns / 1e3);
 }
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+        return replay_main(argc, argv);
+    }
+
     printf("=== Concurrent Red-Black Tree Test ===\n\n");
 
     test_concurrent_writes();
     test_concurrent_reads();
     test_mixed_read_write();
+    test_background_snapshot();
+    test_background_scheduler();
+    test_write_stall();
+    test_shard_rebalancing();
+    test_erase();
+    test_cluster_router();
+    test_raft_simulated();
+    test_raft_processes();
+    test_raft_read_throughput();
+    test_client_pipelining();
+    test_zero_copy_responses();
+    test_tenant_qos();
+    test_stored_procedures();
+    test_time_travel();
+    test_tiered_storage();
+    test_value_compression();
+    test_learned_index();
+    test_z_order_box_queries();
+    test_merkle_diff();
+    test_set_operations();
+    test_node_layout();
+    test_fixed_key_tree();
+    test_radix_bulk_ingest();
+    test_work_stealing_pool();
+    test_ingest_rings();
+    test_workload_capture_replay();
+    test_slow_op_log();
 
     printf("=== All Tests Passed! ===\n");
 